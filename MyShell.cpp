@@ -1,24 +1,48 @@
 #include <vector>
 #include <string>
+#include <string_view>
+#include <memory_resource>
 #include <cstring>
 #include <unordered_map>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
 #include <algorithm>
-#include <sstream>
-#include <fstream>
+#include <charconv>
+#include <csignal>
+#include <cerrno>
 
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <termios.h>
+#include <climits>
 #include <fcntl.h>
+#include <spawn.h>
 #include <ctime>
 #include <unistd.h>
 #include <dirent.h>
+#include <fnmatch.h>
 
 using namespace std;
 
+extern char **environ; // 环境变量表，系统预定义
+
 /* ---------- 宏定义 ---------- */
 
 #define BUFFER_SIZE 1024
+#define READ_BLOCK_SIZE 65536
 #define INVALID_PID (-1)
 
 #define YELLOW "\e[1;33m"
@@ -28,782 +52,6984 @@ using namespace std;
 #define BLUE "\e[1;34m"
 #define CLEAR "\e[1;1H\e[2J"
 
+/* ---------- 单行内存池 ---------- */
+
+/* 单行指令的内存池
+ * 按顺序从块中切出内存，释放单块内存是空操作；第一块是静态缓冲区，用完后向系统申请更大的块，
+ * 与 monotonic_buffer_resource 不同的是可以回到之前记下的位置，之后切出的内存全部作废，块保留复用。
+ * 循环每执行完一轮就回到这一轮开始时的位置，循环体中展开的参数、重定向计划不会随循环次数累积
+ */
+class ScratchArena : public pmr::memory_resource {
+public:
+    // 内存池中的位置
+    struct Mark {
+        size_t block; // 块的下标
+        size_t used; // 块中已使用的字节数
+    };
+
+    ScratchArena(void *buffer, size_t size) : blocks{{static_cast<char *>(buffer), size}} {}
+    ~ScratchArena() override;
+
+    // 当前位置
+    Mark Position() const { return {current, used}; }
+
+    // 回到 mark，mark 之后分配的内存不能再使用
+    void Rewind(Mark mark);
+
+    // 回到开头，归还向系统申请的块
+    void Release();
+
+private:
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *, size_t, size_t) override {}
+    bool do_is_equal(const pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+    struct Block {
+        char *data;
+        size_t size;
+    };
+    vector<Block> blocks; // 第一块是静态缓冲区
+    size_t current = 0; // 正在使用的块
+    size_t used = 0; // 当前块已使用的字节数
+};
+
+/* ---------- 输入缓冲 ---------- */
+
+/* 行读取器
+ * 批文件整体映射到内存中，按行切分不需要系统调用；
+ * 标准输入按块读入环形缓冲区，一次 read 可以取出多行，行长度不受限制；
+ * 标准输入是管道时逐字节读入，避免读走子进程的输入
+ */
+class LineReader {
+public:
+    LineReader() = default;
+    ~LineReader();
+
+    // 将批文件映射到内存，失败返回 false
+    bool LoadFile(const char *path);
+
+    // 读入一行（不含换行符），没有更多输入时返回 false
+    bool ReadLine(string &line);
+
+    // 读入一个字节，供行编辑器使用，没有更多输入时返回 false
+    bool ReadByte(char &c);
+
+    // 映射到内存的批文件的内容
+    string_view Mapped() const { return {map_data, map_size}; }
+
+    // 缓冲区中是否还有未读的输入
+    bool Pending() const { return count > 0; }
+
+    // 执行指令前把多读的输入退回文件描述符，使子进程从下一行开始读
+    void Release();
+
+    // 等待输入时同时等待 watch_fd，watch_fd 可读时调用 handler，之后继续等待输入
+    void Watch(int watch_fd, void (*handler)());
+
+private:
+    // 从文件描述符读入一块数据到环形缓冲区，返回读入的字节数
+    ssize_t Fill();
+
+    int fd = STDIN_FILENO; // 按块读取的文件描述符
+    bool probed = false; // 是否已检查过 fd 的类型
+    bool seekable = false; // fd 可以定位：按块读入，执行指令前退回多读的部分
+    bool byte_wise = false; // fd 是管道等不可定位的非终端：逐字节读入，不越过换行符
+    int watch_fd = -1; // 等待输入时同时等待的文件描述符
+    void (*on_watch)() = nullptr; // watch_fd 可读时的处理函数
+
+    // 映射到内存的批文件
+    const char *map_data = nullptr;
+    size_t map_size = 0;
+    size_t map_pos = 0; // 下一行的起始位置
+
+    // 环形缓冲区
+    char ring[READ_BLOCK_SIZE]{};
+    size_t head = 0; // 第一个未读字节的下标
+    size_t count = 0; // 未读字节数
+    bool eof = false;
+};
+
+/* ---------- 补全 ---------- */
+
+// 补全缓存中目录的一个条目
+struct CompletionEntry {
+    uint32_t name; // 名字在名字池中的偏移
+    uint32_t name_len; // 名字的长度
+    bool directory; // 是否为目录（包括指向目录的符号链接）
+};
+
+// 补全缓存中的一个目录，条目按名字排序，目录的修改时间改变时重新读取
+struct CompletionDir {
+    timespec mtime{}; // 读取时目录的修改时间
+    string names; // 名字池
+    vector<CompletionEntry> entries;
+
+    string_view Name(const CompletionEntry &entry) const { return {names.data() + entry.name, entry.name_len}; }
+};
+
+// 补全的候选项
+struct Completion {
+    string_view name; // 指向补全缓存或内建命令表，下次补全前有效
+    bool directory; // 是否为目录，补全后加'/'
+};
+
+/* Tab 补全
+ * 指令位置的单词补全内建命令和 PATH 中的可执行文件，含'/'的单词和参数补全文件路径；
+ * PATH 中每个目录的可执行文件分别缓存，合并为一个有序数组，按前缀二分查找，
+ * 只有 PATH 或其中某个目录的修改时间改变时才重新读取该目录并重新合并；
+ * 补全路径时读取的目录同样按修改时间缓存，十万个条目的目录再次补全只需要一次 stat 和二分查找
+ */
+class Completer {
+public:
+    /* 补全 line 中 end 之前的单词，word 返回单词的开始位置，
+     * directory 返回单词中目录的部分（去掉转义），候选项为目录中的名字或指令名，按名字排序
+     */
+    vector<Completion> Complete(string_view line, size_t end, size_t &word, string &directory);
+
+private:
+    // 读取目录并按名字排序，executables 为 true 时只保留可执行文件，失败时返回 false
+    static bool LoadDirectory(const string &path, bool executables, CompletionDir &dir);
+
+    // 目录的缓存，修改时间改变时重新读取，失败时返回 nullptr
+    const CompletionDir *Directory(const string &path);
+
+    // 按需重建 PATH 中可执行文件的有序索引
+    void UpdateCommands();
+
+    unordered_map<string, CompletionDir> dirs; // 补全路径时读取的目录，键为绝对路径
+    static constexpr size_t MAX_CACHED_DIRS = 64; // 缓存的目录数超过此值时清空
+
+    string indexed_path; // 建立索引时的 PATH
+    vector<CompletionDir> path_dirs; // PATH 中每个目录的可执行文件
+    vector<string_view> commands; // 所有可执行文件名，有序且不重复，指向 path_dirs 的名字池
+};
+
+/* ---------- 行编辑器 ---------- */
+
+/* 交互执行时的行编辑器
+ * 终端设为原始模式，按键逐字节从 LineReader 读入，粘贴的多行内容留在缓冲区中供下一行使用；
+ * 屏幕上已显示的内容记录在 drawn 中，每次按键后只重画从第一个不同字符开始的部分，
+ * 所有光标移动和文字拼接为一段，一次 write 写出；超过终端宽度的内容折行显示，可以跨行编辑
+ * 按键：Ctrl+A/E 行首/行尾，Ctrl+B/F 和方向键移动，Alt+B/F 按单词移动，Ctrl+K/U/W、Alt+D 删除并保存，
+ * Ctrl+Y 粘贴，上下键和 Ctrl+P/N 浏览历史，Ctrl+R 反向搜索历史，Tab 补全，Ctrl+L 清屏，Ctrl+C 放弃当前行
+ */
+class LineEditor {
+public:
+    /* 显示提示符并编辑一行，空行上按 Ctrl+D 或输入结束时返回 false
+     * continuation 为 true 时是未结束指令的后续行，Ctrl+C 放弃整条指令
+     */
+    bool ReadLine(string &line, bool continuation = false);
+
+    // 上一次编辑后续行时是否按了 Ctrl+C
+    bool Cancelled() const { return cancelled; }
+
+    // 编辑期间输出其他内容之前：光标移到输入之后并换行
+    void Hide();
+
+    // 输出其他内容之后：重新显示提示符和正在编辑的内容
+    void Show();
+
+private:
+    // 方向键等转义序列对应的按键，普通按键为其字节值
+    enum EditKey : int {
+        KEY_DELETE = 256, KEY_WORD_LEFT, KEY_WORD_RIGHT, KEY_KILL_WORD, KEY_KILL_WORD_BACK
+    };
+
+    // 处理一个按键，返回 true 表示本行编辑结束
+    bool Key(int key);
+
+    // 读入 ESC 之后的转义序列并转换为对应的按键，无法识别时返回 0
+    int Escape();
+
+    // 反向搜索时处理按键，返回 true 表示搜索结束、按键仍需按普通按键处理
+    bool SearchKey(int key);
+
+    // 从第 before 条记录（不含）向前搜索，更新搜索结果
+    void SearchFrom(size_t before);
+
+    // 把内容与屏幕上已显示的内容比较，只写出变化的部分
+    void Refresh();
+
+    // 把光标移到提示符开始的第 cell 个字符处，移动序列追加到 out
+    void MoveTo(size_t cell);
+
+    // 写出宽度为 width 的文字后光标前进，恰好写满一行时换到下一行开头
+    void Advance(string_view text, size_t width);
+
+    // 一次写出 out 中的内容
+    void Flush();
+
+    // 光标位置前后的单词边界
+    size_t WordLeft() const;
+    size_t WordRight() const;
+
+    // 删除 [begin, end) 并保存到 yank
+    void Kill(size_t begin, size_t end);
+
+    // 补全光标前的单词，不能继续补全时再按一次 Tab 列出所有候选项
+    void Complete();
+
+    // 在编辑的内容下方按列显示候选项，候选项很多时先询问
+    void ListCompletions(const vector<Completion> &candidates);
+
+    bool active = false; // 是否正在编辑
+    bool at_eof = false; // 空行上按了 Ctrl+D
+    bool continuation = false; // 是否在编辑未结束指令的后续行
+    bool cancelled = false; // 编辑后续行时按了 Ctrl+C
+    int last_key = 0; // 上一个按键，连续按两次 Tab 时列出候选项
+    bool saved_mode = false; // 是否已保存终端原来的模式
+    termios cooked{}; // 终端原来的模式，每行编辑结束后恢复
+
+    string buffer; // 正在编辑的内容
+    size_t pos = 0; // 光标所在的字节位置
+    string yank; // 最近一次删除的内容
+
+    // 历史浏览
+    size_t history_size = 0; // 开始编辑时的历史记录数
+    size_t history_index = 0; // 正在显示的历史记录号，history_size + 1 表示正在编辑的内容
+    string saved_line; // 开始浏览历史前正在编辑的内容
+
+    // 反向搜索
+    bool searching = false;
+    string query; // 搜索的内容
+    string search_prompt; // 搜索时代替提示符显示的内容
+    size_t match = 0; // 匹配的历史记录号，0 表示没有匹配
+    bool failed = false; // 最近一次搜索是否失败
+    string before_search; // 开始搜索前的内容，放弃搜索时恢复
+
+    // 屏幕上已显示的内容，位置以字符为单位，从提示符开头算起
+    string drawn_prompt; // 已显示的提示符，为空表示需要重画提示符
+    size_t drawn_prompt_width = 0; // 已显示的提示符的宽度
+    string drawn; // 已显示的内容
+    size_t cursor = 0; // 终端光标的位置
+    size_t columns = 80; // 终端宽度
+    string out; // 本次要写出的内容
+};
+
+/* ---------- 输出缓冲 ---------- */
+
+/* 内建命令的输出缓冲
+ * 输出内容整理为 iovec，凑满一批后一次 writev 写出，不经过 stdio；
+ * 短小的内容拷贝到内部存储，生命期足够长的内容（如环境变量）只记录指针
+ */
+class OutputBuffer {
+public:
+    explicit OutputBuffer(int fd = STDOUT_FILENO);
+    ~OutputBuffer();
+
+    // 拷贝一段内容
+    void Append(string_view data);
+
+    // 只记录指针，data 必须在 Flush 之前保持有效
+    void AppendRef(string_view data);
+
+    // 写出所有缓冲的内容
+    void Flush();
+
+private:
+    static constexpr size_t FLUSH_SIZE = READ_BLOCK_SIZE; // 缓冲字节数达到此值时写出
+
+    int fd;
+    // 以下内容分配在单行内存池中
+    pmr::string storage; // 拷贝的内容
+    pmr::vector<iovec> iov; // 待写出的内容，iov_base 为空时 iov_len 之前的 storage 偏移见 offsets
+    pmr::vector<size_t> offsets; // 拷贝内容在 storage 中的偏移，与 iov 一一对应
+    size_t pending = 0; // 待写出的字节数
+};
+
+/* ---------- 历史记录 ---------- */
+
+/* 历史记录
+ * 历史文件只追加，每条指令一行，多个 MyShell 同时写入时用 flock 加锁，整行一次 write 写入；
+ * 启动时只打开文件，首次使用时才映射到内存并建立行索引，之后文件增长时只映射和索引新增的部分，
+ * 因此其他 MyShell 追加的记录也能看到
+ * 搜索使用三元组（连续三个字节）倒排索引，取查询中最短的倒排表从新到旧逐条验证
+ */
+class History {
+public:
+    History() = default;
+    ~History();
+
+    // 打开历史文件，不存在时创建，失败时不记录历史
+    void Open(const string &path);
+
+    // 追加一条记录
+    void Add(string_view line);
+
+    // 记录数，包括其他 MyShell 追加的记录
+    size_t Size();
+
+    // 第 n 条记录（从 1 开始），调用前需先调用 Size
+    string_view Entry(size_t n) const;
+
+    // 从第 before 条记录（不含）向前搜索包含 text 的记录，返回记录号，没有时返回 0
+    size_t Search(string_view text, size_t before);
+
+private:
+    // 映射文件新增的部分，为其中完整的行建立索引
+    void Refresh();
+
+    // 三元组的编码
+    static uint32_t Trigram(const char *p) {
+        return static_cast<uint8_t>(p[0]) << 16 | static_cast<uint8_t>(p[1]) << 8 | static_cast<uint8_t>(p[2]);
+    }
+
+    int fd = -1;
+    const char *map_data = nullptr;
+    size_t map_size = 0; // 映射的字节数
+    vector<size_t> offsets = {0}; // 第 i 条记录的起始偏移，最后一项为已索引部分的结尾
+    unordered_map<uint32_t, vector<uint32_t>> trigrams; // 三元组到包含它的记录下标的倒排表，下标递增
+    size_t trigram_entries = 0; // 已加入三元组索引的记录数
+};
+
+/* ---------- 变量表 ---------- */
+
+// 变量属性
+enum VariableFlag : unsigned {
+    VAR_SET = 1u << 0, // 已赋值，unset 后清除
+    VAR_EXPORT = 1u << 1, // 导出为子进程的环境变量
+    VAR_INTEGER = 1u << 2, // 整数变量，赋值时按整数求值
+    VAR_ARRAY = 1u << 3, // 数组变量
+};
+
+// 一个变量，名字在变量表中只保存一次
+struct Variable {
+    string name;
+    uint32_t hash = 0; // 名字的哈希值
+    unsigned flags = 0; // VariableFlag 的组合
+    string value; // 标量的值
+    vector<string> elements; // 数组的元素
+    int env_index = -1; // 在环境变量表中的位置，未导出时为 -1
+};
+
+/* 环境变量表的快照，可以直接传给 posix_spawn 和 execve
+ * strings 使用 deque，追加时已有字符串的地址不变，envp 中的指针始终有效
+ */
+struct EnvSnapshot {
+    deque<string> strings; // "名字=值"
+    vector<Variable *> owners; // strings[i] 对应的变量
+    vector<char *> envp{nullptr}; // 指向 strings，以 nullptr 结尾
+
+    EnvSnapshot() = default;
+    EnvSnapshot(const EnvSnapshot &other);
+};
+
+// 变量名的哈希值
+uint32_t HashName(string_view name);
+
+/* 变量表：开放寻址的哈希表，线性探测
+ * 名字第一次出现时驻留在表中，之后只会改变属性和值，unset 只清除 VAR_SET，
+ * 因此槽位从不删除，不需要墓碑标记，变量的地址在整个运行期间不变
+ * 导出变量变化时只更新环境变量表中的一项；环境变量表在启动子进程之间共享，
+ * 仍被持有时才复制后修改（写时复制）
+ */
+class VariableTable {
+public:
+    // 从环境变量表导入，所有变量都被导出
+    void Import(char **env);
+
+    // 查找已赋值的变量，不存在或未赋值时返回 nullptr
+    const Variable *Find(string_view name) const;
+
+    // 查找变量，不存在时驻留一个未赋值的变量
+    Variable &Intern(string_view name);
+
+    // 标量变量的值，不存在时返回 nullptr
+    const string *Value(string_view name) const;
+
+    // 给标量或数组的第 0 个元素赋值，整数变量按整数求值
+    void Assign(string_view name, string_view value) { Assign(Intern(name), value); }
+    void Assign(Variable &var, string_view value);
+
+    // 给数组的第 index 个元素赋值，标量变量转换为数组
+    void AssignElement(string_view name, size_t index, string_view value) { AssignElement(Intern(name), index, value); }
+    void AssignElement(Variable &var, size_t index, string_view value);
+
+    // 给整个数组赋值
+    void AssignArray(string_view name, vector<string> elements) { AssignArray(Intern(name), move(elements)); }
+    void AssignArray(Variable &var, vector<string> elements);
+
+    // 设置或清除属性，VAR_SET 除外
+    void SetFlags(string_view name, unsigned flags, bool on);
+
+    // 删除变量的值和属性
+    void Unset(string_view name);
+
+    // 恢复之前保存的变量副本
+    void Restore(const Variable &saved);
+
+    // 导出变量组成的环境变量表，持有期间不会被修改
+    shared_ptr<const EnvSnapshot> Snapshot() const { return env; }
+
+    // 按驻留顺序遍历所有变量
+    const deque<Variable> &All() const { return vars; }
+
+private:
+    // 名字所在的槽位，不存在时为应插入的空槽位
+    size_t Probe(string_view name, uint32_t hash) const;
+
+    // 槽位数翻倍后重新插入
+    void Grow();
+
+    // 变量改变后：更新环境变量表中对应的一项，PATH 使命令路径缓存失效
+    void Changed(Variable &var);
+
+    // 可以修改的环境变量表，仍被其他地方持有时先复制
+    EnvSnapshot &WritableEnv();
+
+    deque<Variable> vars; // 变量，下标 + 1 保存在槽位中
+    vector<uint32_t> slots = vector<uint32_t>(64, 0); // 槽位，0 为空
+    shared_ptr<EnvSnapshot> env = make_shared<EnvSnapshot>(); // 导出变量组成的环境变量表
+};
+
+/* ---------- 算术求值 ---------- */
+
+/* 算术表达式的字节码，在栈上求值
+ * ASSIGN、INC 的 binop 为复合赋值的运算，POP 表示直接赋值；带 _ELEM 的指令先从栈中取出数组下标
+ */
+enum ArithOp : uint8_t {
+    OP_PUSH, OP_POP, OP_LOAD, OP_LOAD_ELEM, OP_LOAD_SPECIAL,
+    OP_ASSIGN, OP_ASSIGN_ELEM, OP_INC, OP_INC_ELEM,
+    OP_NEG, OP_NOT, OP_BIT_NOT, OP_BOOL,
+    OP_MUL, OP_DIV, OP_MOD, OP_POW, OP_ADD, OP_SUB, OP_SHL, OP_SHR,
+    OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE, OP_BIT_AND, OP_BIT_XOR, OP_BIT_OR,
+    OP_JUMP, OP_JUMP_IF_ZERO, OP_JUMP_IF_NONZERO
+};
+
+// 一条字节码指令
+struct ArithInstr {
+    ArithOp op;
+    ArithOp binop = OP_POP; // ASSIGN 的复合运算
+    bool post = false; // INC 是否为后缀，后缀时结果为原来的值
+    long long operand = 0; // PUSH 的常数、INC 的增量、跳转的目标、LOAD_SPECIAL 的名字下标
+    Variable *var = nullptr; // 变量，驻留后地址不变，执行时不需要查找
+};
+
+// 编译好的算术表达式
+struct ArithProgram {
+    string source; // 源文本，同时作为缓存的键
+    vector<ArithInstr> code;
+    vector<string> specials; // $1 $# $? 等特殊变量的名字
+
+    // 执行字节码，depth 为变量值作为表达式嵌套求值的层数
+    long long Run(int depth) const;
+};
+
+/* 递归下降编译器，优先级从低到高：
+ * ,  = += -= ...  ?:  ||  &&  |  ^  &  == !=  < <= > >=  << >>  + -  * / %  **  单目 + - ! ~ ++ --  后缀 ++ --
+ * 语法错误时抛出异常
+ */
+class ArithCompiler {
+public:
+    ArithCompiler(string_view text, ArithProgram &program) : text(text), program(program) {}
+
+    // 编译整个表达式
+    void Compile();
+
+private:
+    void Comma();
+    void Assignment();
+    void Ternary();
+    void Binary(int level);
+    void Power();
+    void Unary();
+    void Postfix();
+    void Primary();
+
+    // 解析变量名和可选的下标，下标的代码直接生成，不是变量名时返回 nullptr
+    Variable *LValue(bool &element);
+
+    // 当前位置的运算符，取最长的匹配，不是运算符时为空
+    string_view PeekOp();
+
+    // 当前运算符为 op 时跳过并返回 true
+    bool Accept(string_view op);
+
+    // 生成一条指令，返回其下标
+    size_t Emit(ArithOp op, long long operand = 0, Variable *var = nullptr);
+
+    // 抛出语法错误，指出出错的位置
+    [[noreturn]] void Error();
+
+    string_view text;
+    size_t pos = 0;
+    ArithProgram &program;
+};
+
+// 对算术表达式求值，首次出现时编译为字节码并按源文本缓存，出错时抛出异常
+long long EvaluateArithmetic(string_view text, int depth = 0);
+
+/* ---------- 脚本缓存 ---------- */
+
+struct ListNode; // 语法树，定义见词法与语法分析
+
+// 缓存文件头，之后依次是批文件的绝对路径（补齐到 4 字节）、指令表和语法树数据
+struct ScriptCacheHeader {
+    char magic[8]; // 格式标识和版本，格式改变时修改
+    uint64_t size; // 批文件的大小
+    int64_t mtime_sec; // 批文件的修改时间
+    int64_t mtime_nsec;
+    uint64_t hash; // 批文件内容的哈希
+    uint32_t path_len; // 绝对路径的长度
+    uint32_t count; // 指令数，指令表每项三个字：指令的偏移、长度、语法树在数据中的下标
+    uint32_t data_size; // 语法树数据的字数
+    uint32_t reserved;
+};
+
+/* 批文件的编译缓存
+ * 首次执行批文件时对每条指令做词法和语法分析，把语法树序列化为 32 位字的数组，
+ * 写入缓存目录（MYSHELL_CACHE_DIR，默认为 ~/.cache/myshell），文件名由批文件绝对路径的哈希得到；
+ * 再次执行时映射缓存文件，批文件的路径、大小、修改时间和内容哈希都一致才使用，
+ * 之后逐条指令直接从缓存还原语法树，单词指向映射的批文件，跳过词法和语法分析；
+ * 有语法错误的指令不还原，执行到时照常分析并报错
+ */
+class ScriptCache {
+public:
+    ScriptCache() = default;
+    ~ScriptCache();
+
+    // 为映射到内存的批文件准备缓存：有效时映射，否则编译并写入缓存目录，stats 为 true 时输出统计
+    void Load(const char *path, string_view script, bool stats);
+
+    // 是否在使用缓存执行
+    bool Active() const { return table != nullptr; }
+
+    // 读入下一条指令，没有更多指令时返回 false
+    bool Next(string &command);
+
+    // 还原当前指令的语法树，没有缓存的语法树时返回 false
+    bool Restore(ListNode &list);
+
+private:
+    // 编译批文件的所有指令，结果保存在 compiled 中
+    void Compile();
+
+    // 映射缓存文件并校验，失败时返回 false
+    bool Map(const string &cache_path, const ScriptCacheHeader &expected);
+
+    // 写入缓存文件，先写临时文件再改名，其他进程不会读到写了一半的文件
+    bool Write(const string &cache_path, const ScriptCacheHeader &header);
+
+    string_view script; // 映射的批文件
+    string script_path; // 批文件的绝对路径
+
+    // 映射的缓存文件
+    void *map_data = nullptr;
+    size_t map_size = 0;
+
+    // 本次编译的结果，缓存无效或无法映射时直接使用
+    vector<uint32_t> compiled_table;
+    vector<uint32_t> compiled_data;
+
+    const uint32_t *table = nullptr; // 指令表
+    const uint32_t *data = nullptr; // 语法树数据
+    uint32_t count = 0; // 指令数
+    uint32_t data_size = 0; // 语法树数据的字数
+    uint32_t next = 0; // 下一条指令的下标
+};
+
+/* ---------- 函数与控制流 ---------- */
+
+/* break、continue、return 执行后设置的控制流
+ * 之后各层指令列表不再执行其余的指令，逐层返回，直到对应的循环或函数处理后清除
+ */
+enum ControlFlow {
+    FLOW_NONE, FLOW_BREAK, FLOW_CONTINUE, FLOW_RETURN
+};
+
+// 函数调用的最大嵌套层数，避免无限递归耗尽栈空间
+constexpr unsigned MAX_FUNCTION_DEPTH = 1000;
+
+/* 函数：定义时在自己的内存池中重新分析一次，语法树中的单词指向 source，
+ * 不随单行内存池释放，每次调用直接执行语法树
+ */
+struct ShellFunction {
+    string source; // 定义函数的指令
+    pmr::monotonic_buffer_resource arena; // 函数体语法树的内存池，函数被替换或删除时整体释放
+    const ListNode *body = nullptr; // 函数体，分配在 arena 中
+};
+
 /* ---------- 全局变量 ---------- */
 
 namespace Global {
 
     // 储存当前指令
+    LineReader input; // 指令输入
+    LineEditor editor; // 交互执行时的行编辑器
+    Completer completer; // Tab 补全及其目录缓存
+    bool use_editor = false; // 是否使用行编辑器：交互执行且终端不是 dumb
+
+    /* 单行指令的内存池
+     * 词法单元、语法树、展开后的参数和内建命令的输出缓冲都从这里分配，
+     * 一行指令执行完后整体释放，循环每轮结束时回到这一轮开始的位置，解释循环中几乎不再调用 malloc
+     */
+    char line_buffer[READ_BLOCK_SIZE];
+    ScratchArena line_arena(line_buffer, sizeof(line_buffer));
+    pmr::memory_resource *syntax_arena = &line_arena; // 语法树节点的内存池，分析函数定义时改为函数自己的内存池
     string command;
-    vector<string> command_tokens; // 切割后的指令段
+    string job_command; // 当前前台作业的指令，被挂起时记入作业表
 
     // 环境变量
     string host; // 主机名
     string user; // 用户名
     string home_path; // 用户主目录路径
     string shell_path; // MyShell 路径
-    string manual_path; // 帮助手册路径
+    string manual_path; // 帮助手册路径，默认在 MyShell 所在目录，可由 MYSHELL_MANUAL 指定
+    string_view manual; // 映射到内存的帮助手册，首次使用 help 时映射
+    unordered_map<string_view, string_view> manual_index; // 手册中的标题（如 dir）到对应内容的映射
     string pwd; // 当前工作目录
-    pid_t sub_pid = INVALID_PID; // 子进程号，默认为-1
+    string prompt; // 预先生成的命令提示符，用户名、主机名或当前目录改变时重新生成
+    size_t prompt_width = 0; // 提示符在终端上的宽度，不含颜色控制序列
+    pid_t sub_pid = INVALID_PID; // 前台作业的进程组号（或子进程号），默认为-1
+    pid_t shell_pgid = INVALID_PID; // MyShell 的进程组号
 
     // 作业表
-    constexpr unsigned MAX_WORK = 1024; // 最大子进程数
-    bool is_backend = false; // 是否是后台指令
-    unordered_map<pid_t, int> jobs; // 子进程 pid
-    vector<int> work_id_list; // 已分配的作业号，用于计算分配
-
-    /* 子进程状态
-     * BACKEND - 子进程在后台执行
-     * SUSPEND - 子进程被挂起
+    unsigned max_jobs = 1024; // 最大作业数，启动时可由环境变量 MYSHELL_MAX_JOBS 设置
+    bool is_backend = false; // 是否在子进程中执行（后台指令、管道中的一段）
+    bool exec_in_place = false; // 当前指令是子进程要执行的最后一条指令，外部指令直接 exec，重定向直接应用
+
+    // parallel、wait 等待作业期间 Ctrl+C 只中断等待
+    volatile sig_atomic_t waiting_jobs = 0;
+    volatile sig_atomic_t wait_interrupted = 0;
+
+    /* 作业状态
+     * BACKEND - 作业在后台执行
+     * SUSPEND - 作业被挂起
+     * DONE - 作业的所有进程都已结束，尚未提示
      */
     typedef enum {
-        BACKEND, SUSPEND
+        BACKEND, SUSPEND, DONE
     } JobStatus;
 
-    unordered_map<pid_t, JobStatus> state; // 子进程状态
-    unordered_map<pid_t, string> sub_commands; // 子进程执行的命令
+    /* 作业：一条后台指令或被挂起的前台管道，可以包含多个进程
+     * 作业号为作业在 job_slots 中的下标加 1，id 为 0 表示空槽
+     */
+    struct Job {
+        int id = 0;
+        pid_t pgid = INVALID_PID; // 进程组号，为 INVALID_PID 时与 MyShell 同组，信号逐个发送给进程
+        JobStatus state = BACKEND;
+        string command; // 执行的指令
+        vector<pid_t> pids; // 作业中的所有进程
+        vector<int> status; // 对应进程的 wait 状态，尚未结束时为 -1
+        size_t remaining = 0; // 尚未结束的进程数
+    };
+
+    vector<Job> job_slots; // 作业槽
+    vector<int> free_job_ids; // 已释放的作业号，分配时先取栈顶
+    unordered_map<pid_t, int> job_of_pid; // 尚未结束的后台进程到作业号的映射
+    size_t job_count = 0; // 作业数
+    vector<int> finished_jobs; // 已结束但尚未提示的作业号
+
+    /* 子进程状态变化的通知管道（self-pipe）
+     * SIGCHLD 处理函数回收到子进程后写入一个字节，等待输入时与标准输入一起等待
+     */
+    int notify_pipe[2] = {-1, -1};
+    bool notify_now = false; // set -b：作业结束时立即提示，不等到下一个提示符
+
+    // 子进程回收队列，由 SIGCHLD 处理函数写入，主流程在屏蔽 SIGCHLD 时读出
+    constexpr int REAP_QUEUE_SIZE = 4096;
+    struct ReapRecord {
+        pid_t pid;
+        int status;
+    };
+    ReapRecord reap_queue[REAP_QUEUE_SIZE];
+    volatile sig_atomic_t reap_head = 0, reap_tail = 0; // 队首、队尾下标
+
+    // 前台作业的等待结果
+    vector<pid_t> fg_pids; // 前台作业的所有子进程
+    vector<int> fg_status; // 对应子进程的 wait 状态
+    size_t fg_remaining = 0; // 尚未结束的子进程数
+    bool fg_stopped = false; // 前台作业是否被挂起
+    bool fg_own_group = false; // 前台作业是否在单独的进程组中
+    int last_status = 0; // 最近一条前台指令的退出状态
+    int builtin_status = 0; // 当前内建命令的退出状态，执行前置 0，抛出异常时为 1
+    vector<int> pipe_status; // 最近一条前台指令中每一段的退出状态
+
+    /* 命令路径缓存
+     * 指令名到可执行文件绝对路径的映射，首次查找时填充，
+     * PATH 改变或缓存路径失效时清除
+     */
+    struct HashEntry {
+        string path; // 可执行文件路径
+        unsigned hits; // 命中次数
+    };
+    unordered_map<string, HashEntry> command_hash;
 
     // 命令行参数
-    unsigned argc = 0; // 命令行参数个数
-    vector<string> argv; // 命令行参数字符串
+    unsigned argc = 0; // argv 的元素个数
+    vector<string> argv; // $0 和位置参数 $1 $2 ...
+
+    VariableTable variables; // 变量表，启动时导入环境变量
+    ScriptCache script_cache; // 批文件的编译缓存
+    History history; // 历史记录，交互执行时打开 HISTFILE 或 ~/.myshell_history
+
+    // 算术表达式的字节码缓存，键指向 ArithProgram::source，超过上限时整体清空
+    constexpr size_t ARITH_CACHE_SIZE = 1024;
+    unordered_map<string_view, unique_ptr<ArithProgram>> arith_cache;
+    unsigned arith_running = 0; // 正在执行的字节码层数，不为 0 时不能清空缓存
+
+    // 控制流
+    ControlFlow control = FLOW_NONE; // 正在返回的 break、continue、return
+    unsigned control_count = 0; // break n、continue n 还要跳出的循环层数
+    unsigned loop_depth = 0; // 当前函数中正在执行的循环层数
+    unsigned compound_depth = 0; // 正在执行的复合指令层数
+    volatile sig_atomic_t interrupted = 0; // 复合指令执行期间按了 Ctrl+C，或前台指令被 Ctrl+C 终止，本行其余的指令不再执行
+
+    // 函数
+    unordered_map<string_view, shared_ptr<ShellFunction>> functions; // 函数名到函数，键指向 ShellFunction::source
+    unsigned function_depth = 0; // 正在执行的函数调用层数
+    vector<vector<Variable>> local_scopes; // 每层函数调用中 local 声明的变量在声明前的副本，返回时恢复
+
+    // 词法或语法分析到达输入末尾时引号、复合指令等尚未结束，可以读入下一行接在后面重新分析
+    bool incomplete_input = false;
 
     // 是否是批处理文件
     bool is_batch_file = false;
+
+    // 是否交互执行（标准输入是终端且不是批文件），交互时前台作业独占终端
+    bool is_interactive = false;
 }
 
+/* ---------- 重定向计划 ---------- */
+
+/* 重定向计划中的一项
+ * OPEN - 打开文件 text 到 fd
+ * DUP - 复制 src_fd 到 fd，如 2>&1
+ * CLOSE - 关闭 fd，如 2>&-
+ * STRING - 以 text 加换行作为 fd 的输入，如 <<< word
+ */
+// 展开后的指令参数，分配在单行内存池中
+typedef pmr::vector<pmr::string> ArgList;
+
+struct Redirection {
+    enum Kind {
+        OPEN, DUP, CLOSE, STRING
+    } kind;
+    int fd; // 被重定向的文件描述符
+    int flags; // OPEN 的打开标志
+    int src_fd; // DUP 的源文件描述符
+    pmr::string text{&Global::line_arena}; // 文件名或 here-string 的内容
+};
+
+// 重定向计划：所有重定向按出现顺序事先解析好，执行时不再扫描指令
+struct RedirectPlan {
+    ArgList argv{&Global::line_arena}; // 去掉重定向后的指令
+    pmr::vector<Redirection> items{&Global::line_arena}; // 重定向项
+    pmr::vector<string_view> assigns{&Global::line_arena}; // 指令前的变量赋值，未展开
+};
+
+
+// 在当前进程中执行一项重定向，失败时抛出异常
+void ApplyRedirection(const Redirection &redirect);
+
+/* 解析一个重定向符号，不是完整的重定向符号时返回 0
+ * 成功时填写 redirect，返回符号的长度
+ */
+size_t ParseRedirectOperator(string_view token, Redirection &redirect);
+
+/* 为在父进程中执行的内建命令临时应用重定向计划
+ * 只备份计划中涉及的文件描述符，析构时恢复，抛出异常时同样恢复
+ */
+class RedirectGuard {
+public:
+    explicit RedirectGuard(const RedirectPlan &plan);
+    ~RedirectGuard();
+
+private:
+    // 恢复所有备份的描述符
+    void Restore();
+
+    pmr::vector<pair<int, int>> saved{&Global::line_arena}; // 被重定向的描述符及其备份，备份为 -1 表示原来未打开
+};
+
+/* 指令前的变量赋值只对这条指令有效，如 LANG=C sort
+ * 赋值并导出，析构时恢复原来的值和属性；没有指令时赋值修改 MyShell 的变量，不恢复
+ */
+class AssignmentGuard {
+public:
+    explicit AssignmentGuard(const RedirectPlan &plan);
+    ~AssignmentGuard();
+
+private:
+    // 按相反的顺序恢复所有保存的变量
+    void Restore();
+
+    vector<Variable> saved; // 赋值前的变量
+};
+
+/* ---------- 词法与语法分析 ---------- */
+
+/* 词法单元类型
+ * WORD - 单词，保留引号和'$'，执行时才展开；if、do 等保留字也是单词，由语法分析识别
+ * REDIRECT - 重定向符号，包括描述符，如 2>、>>、2>&1
+ * PIPE - "|"，AND_IF - "&&"，OR_IF - "||"，SEMI - ";"，AMP - "&"
+ * NEWLINE - 换行，复合指令跨行时与";"作用相同，DSEMI - ";;"，LPAREN - "("，RPAREN - ")"
+ */
+enum TokenKind {
+    WORD, REDIRECT, PIPE, AND_IF, OR_IF, SEMI, AMP, NEWLINE, DSEMI, LPAREN, RPAREN
+};
+
+// 词法单元，text 指向原指令中的一段，不复制字符串
+struct Token {
+    TokenKind kind;
+    string_view text;
+};
+
+// 不在引号中时结束单词的字符
+bool IsMetaChar(char c);
+
+// 重定向符号的长度，不是重定向符号时返回 0：[n]< [n]> [n]>> [n]<<< &> &>> [n]>&m [n]<&m [n]>&-
+size_t RedirectLength(string_view rest);
+
+/* 单趟扫描指令，切分为词法单元，引号不匹配时抛出异常
+ * 指令可以有多行，换行是单独的词法单元
+ */
+pmr::vector<Token> Tokenize(string_view line);
+
+// text[begin] 开始为 $(( 时，返回匹配的 )) 之后的位置，不匹配时返回 npos
+size_t ArithmeticEnd(string_view text, size_t begin);
+
+// 原指令中从 first 的开头到 last 的结尾的范围
+string_view SpanOf(string_view first, string_view last);
+
+// 单词是变量赋值 NAME=value 或 NAME[index]=value 时返回'='的位置，否则返回 0
+size_t AssignmentLength(string_view word);
+
+/* 语法树的所有节点都分配在 Global::syntax_arena 中，通常是单行内存池
+ * 简单指令或复合指令，text 为指令在原指令中的范围
+ * SIMPLE - 简单指令：未展开的单词和重定向
+ * GROUP - { list; }，parts[0] 为指令列表
+ * IF - parts 依次为条件和对应的分支，有 else 时最后多出一个 else 分支
+ * WHILE、UNTIL - parts[0] 为条件，parts[1] 为循环体
+ * FOR - words[0] 为变量名，有 in 时 words[1] 为 in，之后为取值列表；parts[0] 为循环体
+ * CASE - words[0] 为被匹配的单词，之后依次为各分支的模式；patterns[i] 为第 i 个分支的模式数，parts[i] 为其指令列表
+ * FUNCTION - 函数定义，words[0] 为函数名，parts[0] 只含函数体一条复合指令
+ * 复合指令的 redirects 在执行整条复合指令时应用
+ */
+struct CommandNode {
+    enum Kind {
+        SIMPLE, GROUP, IF, WHILE, UNTIL, FOR, CASE, FUNCTION
+    } kind = SIMPLE;
+    pmr::vector<string_view> assigns{Global::syntax_arena}; // 指令名之前的变量赋值
+    pmr::vector<string_view> words{Global::syntax_arena};
+    pmr::vector<pair<Redirection, string_view>> redirects{Global::syntax_arena}; // 重定向及其目标单词，复制和关闭描述符没有目标
+    pmr::vector<ListNode> parts{Global::syntax_arena}; // 复合指令的各部分
+    pmr::vector<uint32_t> patterns{Global::syntax_arena}; // case 各分支的模式数
+    string_view text;
+};
+
+// 管道：由"|"连接的指令，以"!"开头时退出状态取反
+struct PipelineNode {
+    pmr::vector<CommandNode> commands{Global::syntax_arena};
+    bool negate = false;
+    string_view text;
+};
+
+// 由"&&"、"||"连接的管道，ops[i] 连接第 i 个和第 i + 1 个管道
+struct AndOrNode {
+    pmr::vector<PipelineNode> pipelines{Global::syntax_arena};
+    pmr::vector<TokenKind> ops{Global::syntax_arena};
+    bool background = false; // 以"&"结尾，在后台执行
+    string_view text;
+};
+
+// 指令列表：由";"、"&"、换行分隔
+struct ListNode {
+    pmr::vector<AndOrNode> items{Global::syntax_arena};
+};
+
+/* 递归下降语法分析器
+ * list     := and_or ((';' | '&' | NEWLINE) and_or)* [';' | '&']，复合指令中遇到 then、fi 等保留字时结束
+ * and_or   := pipeline (('&&' | '||') NEWLINE* pipeline)*
+ * pipeline := ['!'] command ('|' NEWLINE* command)*
+ * command  := simple | compound redirect* | NAME '(' ')' compound | 'function' NAME ['(' ')'] compound
+ * simple   := (ASSIGNMENT | REDIRECT WORD?)* (WORD | REDIRECT WORD?)*，至少有一项
+ * compound := '{' list '}' | 'if' list 'then' list ('elif' list 'then' list)* ['else' list] 'fi'
+ *           | ('while' | 'until') list 'do' list 'done' | 'for' NAME ['in' WORD*] (';' | NEWLINE) 'do' list 'done'
+ *           | 'case' WORD 'in' (['('] WORD ('|' WORD)* ')' list [';;'])* 'esac'
+ * 语法错误时抛出异常；复合指令或"|"、"&&"、"||"之后到达输入末尾时设置 Global::incomplete_input
+ */
+class Parser {
+public:
+    explicit Parser(const pmr::vector<Token> &tokens) : tokens(tokens) {}
+
+    // 分析整条指令
+    ListNode ParseList();
+
+private:
+    // 指令列表，遇到结束复合指令某一部分的保留字、")"、";;"或输入末尾时结束；required 为 true 时不能为空
+    ListNode ParseBody(bool required);
+
+    AndOrNode ParseAndOr();
+    PipelineNode ParsePipeline();
+    CommandNode ParseCommand();
+
+    // 各种复合指令，当前词法单元为开头的保留字
+    CommandNode ParseGroup();
+    CommandNode ParseIf();
+    CommandNode ParseLoop();
+    CommandNode ParseFor();
+    CommandNode ParseCase();
+
+    // 函数定义，当前词法单元为函数名或 function
+    CommandNode ParseFunction();
+
+    // 解析一个重定向及其目标，加入 command
+    void ParseRedirect(CommandNode &command);
+
+    // 当前词法单元的类型是否为 kind
+    bool Peek(TokenKind kind) const;
+
+    // 当前词法单元是否为保留字 word
+    bool PeekWord(string_view word) const;
+
+    // 当前词法单元为保留字 word 时跳过，否则为语法错误
+    void Expect(string_view word);
+
+    // 当前词法单元是否结束复合指令中的一个指令列表：then、do、fi 等保留字，")"，";;"
+    bool AtTerminator() const;
+
+    // 当前词法单元是否开始一条复合指令：{、if、while、until、for、case
+    bool AtCompound() const;
+
+    // 跳过连续的换行
+    void SkipNewlines();
+
+    // 抛出语法错误，指出当前的词法单元
+    [[noreturn]] void SyntaxError() const;
+
+    const pmr::vector<Token> &tokens;
+    size_t pos = 0; // 当前词法单元的下标
+    unsigned depth = 0; // 正在分析的复合指令层数
+};
+
+// 展开指令的单词并确定重定向的目标，得到执行计划
+RedirectPlan PlanRedirect(const CommandNode &command);
+
+/* ---------- 目录列表 ---------- */
+
+// dir 的选项
+struct DirOptions {
+    enum SortKey {
+        BY_NAME, BY_SIZE, BY_TIME, UNSORTED
+    } sort = BY_NAME; // 排序方式
+    bool reverse = false; // -r: 逆序
+    bool long_format = false; // -l: 长格式
+    bool recursive = false; // -R: 递归列出子目录
+    int max_depth = -1; // -d N: 递归的最大深度，-1 表示不限制
+    string glob; // -g PATTERN: 只列出名字匹配的条目，子目录仍然遍历
+    bool totals = false; // -s: 输出条目数和大小的合计
+    unsigned threads = 1; // -j N: 递归遍历的线程数
+    bool color = false; // 标准输出为终端时着色
+    bool columns = false; // 标准输出为终端时按列排版，-1 时每行一个
+    int width = 80; // 终端宽度
+};
+
+// 目录中的一个条目，名字保存在所属目录的名字池中
+struct DirEntry {
+    uint32_t name; // 名字在名字池中的偏移
+    uint32_t name_len; // 名字的长度
+    unsigned char type; // getdents64 给出的 d_type，DT_UNKNOWN 时由 fstatat 补全
+    bool has_stat = false; // 以下状态是否有效
+    mode_t mode = 0;
+    nlink_t nlink = 0;
+    off_t size = 0;
+    time_t mtime = 0;
+    uint32_t link = 0; // 长格式时符号链接指向的路径在名字池中的偏移
+    uint32_t link_len = 0; // 指向的路径的长度，不是符号链接时为 0
+};
+
+// 一个目录的所有条目
+struct DirListing {
+    string names; // 名字池，每个名字以'\0'结尾，可以直接传给 *at 系列系统调用
+    vector<DirEntry> entries;
+
+    const char *Name(const DirEntry &entry) const { return names.data() + entry.name; }
+};
+
+/* 用 getdents64 读取 dirfd 中除 . 和 .. 外的所有条目
+ * d_type 足够时不调用 stat，只有长格式、按大小或时间排序、着色需要判断可执行文件时才调用 fstatat
+ * 读取失败时返回 false
+ */
+bool ReadDirectory(int dirfd, const DirOptions &options, DirListing &listing);
+
+// 按选项排序目录条目
+void SortDirectory(const DirOptions &options, DirListing &listing);
+
+// 条目名字的颜色：目录为蓝色，可执行文件为绿色，其他为白色
+const char *EntryColor(const DirEntry &entry);
+
+// 名字在终端上的宽度，按 UTF-8 字符计数
+size_t DisplayWidth(const char *name, size_t len);
+
+// 格式化一个目录的条目，追加到 out 中
+void FormatPrintDir(OutputBuffer &out, const DirOptions &options, const DirListing &listing);
+
+// 按 -g 的模式过滤目录条目
+void FilterDirectory(const DirOptions &options, DirListing &listing);
+
+// 条目数和大小的合计
+struct DirTotals {
+    size_t directories = 0;
+    size_t entries = 0;
+    long long bytes = 0;
+};
+
+// 输出一个目录的合计并累加到 totals
+void AppendDirTotals(OutputBuffer &out, const DirListing &listing, DirTotals &totals);
+
+// 递归遍历中的一个目录
+struct DirNode {
+    string path; // 显示的路径
+    int depth = 0; // 相对起始目录的深度
+    int error = 0; // 打开或读取失败时的 errno
+    DirListing listing;
+    vector<unique_ptr<DirNode>> children; // 子目录，按排序后的顺序
+};
+
+/* 多线程目录遍历，工作窃取调度
+ * 每个线程有自己的任务队列，从队尾取出自己的任务（深度优先，局部性好），
+ * 空闲时从其他线程的队头窃取（靠近根的大子树）。任务带有用 openat 打开的目录文件描述符，
+ * 遍历结果是一棵按目录排序的树，输出时按深度优先顺序，与线程的执行顺序无关
+ */
+class DirWalker {
+public:
+    explicit DirWalker(const DirOptions &options);
+
+    // 从 dirfd 开始遍历，返回根目录的节点
+    unique_ptr<DirNode> Walk(int dirfd, const string &path);
+
+private:
+    // 同时打开的子目录文件描述符数达到此值后，子目录改为在处理时按路径打开
+    static constexpr int MAX_OPEN_FDS = 256;
+
+    struct Task {
+        DirNode *node;
+        int fd; // 已打开的目录，-1 时按 node->path 打开
+    };
+
+    struct WorkQueue {
+        mutex lock;
+        deque<Task> tasks;
+    };
+
+    // 工作线程的主循环，没有可取的任务时等待，所有任务处理完后退出
+    void Worker(size_t self);
+
+    // 取出一个任务，自己的队列为空时窃取其他线程的任务
+    bool Pop(size_t self, Task &task);
+
+    // 读取一个目录，为子目录创建节点并放入自己的队列
+    void Process(size_t self, const Task &task);
+
+    const DirOptions &options;
+    vector<WorkQueue> queues; // 每个线程一个任务队列
+    atomic<size_t> pending{0}; // 已入队但未处理完的任务数
+    atomic<size_t> queued{0}; // 仍在队列中、未被取出的任务数
+    atomic<int> open_fds{0}; // 任务中已打开的文件描述符数
+
+    // 空闲线程在此等待，有任务入队或遍历结束时唤醒
+    mutex idle_lock;
+    condition_variable idle;
+};
+
+// 深度优先输出遍历结果，累计合计
+void PrintDirTree(OutputBuffer &out, const DirOptions &options, const DirNode &node, DirTotals &totals);
+
+// 列出 dirfd 对应的目录，path 为显示的路径，header 为真时先输出路径，-R 时并行递归列出子目录
+void ListDirectory(OutputBuffer &out, const DirOptions &options, int dirfd, const string &path, bool header);
+
 /* ---------- 辅助函数 ---------- */
 
 // 初始化，获得主机名、用户名等
 void Initialization(int argc, char**&argv);
 
-// 显示命令提示符，包含当前路径，用户名和主机名
+// 生成命令提示符，包含当前路径，用户名和主机名，它们改变时调用
+void RenderPrompt();
+
+// 显示预先生成的命令提示符
 void DisplayPrompt();
 
 // 处理组合键如 Ctrl+C Ctrl+Z 输入
 void SignalHandle(int signal);
 
-// 分割命令
-vector<string> SpiltCommand(const string& cmd);
+// SIGCHLD 处理函数，回收所有状态变化的子进程并放入回收队列
+void ChildHandle(int signal);
+
+// 在屏蔽 SIGCHLD 的情况下处理回收队列，更新前台状态和作业表
+void ProcessReaped();
+
+// 提示已结束的后台作业并从作业表中删除，只处理已结束的作业
+void ReportFinishedJobs();
+
+// 等待输入时通知管道可读：回收子进程，set -b 时立即提示结束的作业
+void NotifyHandle();
+
+/* 阻塞等待前台作业的所有子进程结束或作业被挂起，不占用 CPU
+ * pgid 为作业的进程组号，交互执行时把终端交给该进程组；为 INVALID_PID 时作业与 MyShell 同组
+ * 每一段的退出状态保存在 pipe_status 中，返回最后一段的退出状态
+ */
+int WaitForeground(const vector<pid_t>&pids, pid_t pgid);
+
+// 将 wait 状态转换为退出状态，被信号终止或挂起时为 128 + 信号值
+int ExitStatus(int status);
+
+// 向作业表中添加作业，返回作业号，作业表已满时抛出异常
+int AddJob(const vector<pid_t>&pids, pid_t pgid, Global::JobStatus stat, string_view sub_cmd);
+
+// 从作业表中删除作业，释放作业号
+void RemoveJob(int id);
+
+/* 按参数 cmd_token[index] 查找作业，参数为作业号 N 或 %N，index 超出参数个数时为作业号最大的作业
+ * name 为内建命令名，找不到时抛出异常
+ */
+Global::Job &FindJob(const ArgList&cmd_token, size_t index, const char *name);
 
-// 向后台进程表中添加进程
-void AddJob(pid_t pid,Global::JobStatus stat,const string& sub_cmd);
+// 向作业的所有进程发送信号
+void SignalJob(const Global::Job &job, int signal);
 
-// 后台进程表项格式化为字符串
-string FormatJobMsg(pid_t pid, bool finish);
+// 作业表项格式化为字符串
+string FormatJobMsg(const Global::Job &job);
 
-// 解析'$'开头的变量
-string Parse2Value(const string&cmd_token);
+/* 将变量的值追加到 value 后，name 为'$'或"${}"中的内容
+ * 包括位置参数 $0-$9 ${N}，特殊变量 $? $# $$ $@ $*，
+ * 数组元素 ${NAME[i]}、${NAME[@]}，长度 ${#NAME}、${#NAME[@]}
+ */
+void LookupVariable(string_view name, pmr::string &value);
 
-// 格式化输出目录里的内容
-void FormatPrintDir(DIR *dir, char *path);
+// 单词为 $@、${NAME[@]}（可以带双引号）时展开为多个参数追加到 argv，返回 true
+bool ExpandListWord(string_view word, ArgList &argv);
+
+// 整数变量的赋值和数组下标按算术表达式求值，空字符串为 0，depth 为表达式的嵌套层数
+long long EvaluateInteger(string_view text, int depth = 0);
+
+// 执行一个变量赋值 NAME=value、NAME[index]=value 或 NAME=(a b c)，失败时抛出异常
+void ApplyAssignment(string_view word);
+
+// 是否为合法的变量名：字母、数字和下划线，不以数字开头
+bool IsIdentifier(string_view name);
+
+// 值加上双引号追加到 out 中，转义双引号中的特殊字符
+void AppendQuoted(OutputBuffer &out, const string &value);
+
+// 将变量格式化为 prefix NAME="value" 或 prefix NAME=("a" "b")，追加到 out 中
+void AppendDeclaration(OutputBuffer &out, string_view prefix, const Variable &var);
+
+/* 展开一个单词：去掉引号和转义，替换'$'开头的变量和开头的'~'，结果分配在单行内存池中
+ * pattern 为 true 时展开的是 case 的模式，引号中和转义的内容按字面匹配，其中的通配符前加'\'
+ */
+pmr::string Parse2Value(string_view word, bool pattern = false);
+
+// value 中 from 之后的通配符和'\'前加'\'，使 fnmatch 按字面匹配
+void EscapeGlob(pmr::string &value, size_t from);
+
+/* 映射帮助手册并建立索引，已映射时直接返回
+ * 手册由"* 名字 *"开头的小节组成，一次扫描得到每个名字对应的字节范围，失败时返回 false
+ */
+bool LoadManual();
+
+// 在命令路径缓存和 PATH 中查找指令，找不到返回空串
+string FindCommand(string_view name);
+
+// 指令既不是函数也不是内建命令，需要启动外部程序
+bool IsExternal(string_view name);
+
+// 展开历史引用 !! !n !-n，单引号中不展开，引用的记录不存在时抛出异常，有展开时返回 true
+bool ExpandHistory(string &line);
+
+// 交互执行时展开当前指令中的历史引用并记入历史，展开失败时返回 false，指令不再执行
+bool RecordHistory();
+
+/* 指令尚未结束时读入下一行：显示 PS2 提示符（默认为 "> "），交互执行时记入历史
+ * 没有更多输入或在行编辑器中按了 Ctrl+C 时返回 false
+ */
+bool ReadContinuation(string &line);
+
+// 将重定向计划转换为 posix_spawn 的文件操作，here-string 的内容文件描述符保存在 temp_fds 中，启动后由调用者关闭
+void AddRedirectActions(const RedirectPlan &plan, posix_spawn_file_actions_t *actions, vector<int> &temp_fds);
+
+/* 使用 posix_spawn 启动外部指令，不复制 MyShell 的页表
+ * actions 为子进程中要执行的文件操作，pgid 不为 INVALID_PID 时设置子进程的进程组
+ * 返回子进程 pid，找不到指令时抛出异常
+ */
+pid_t SpawnCommand(const ArgList&cmd_token,
+                   const posix_spawn_file_actions_t *actions = nullptr,
+                   pid_t pgid = INVALID_PID);
+
+/* test 和 [ 的表达式，递归下降求值
+ * or      := and ('-o' and)*
+ * and     := not ('-a' not)*
+ * not     := '!' not | primary
+ * primary := '(' or ')' | 参数 二元运算符 参数 | 一元运算符 参数 | 参数（非空为真）
+ * 运算符不合法、参数不足或多余时抛出异常
+ */
+class TestExpression {
+public:
+    // 表达式为 args 的 [begin, end)，args[0] 为 test 或 [
+    TestExpression(const ArgList &args, size_t begin, size_t end) : args(args), pos(begin), end(end) {}
+
+    // 对整个表达式求值，没有参数时为假
+    bool Evaluate();
+
+private:
+    bool Or();
+    bool And();
+    bool Not();
+    bool Primary();
+
+    // 一元运算：文件属性，字符串是否为空
+    bool Unary(const pmr::string &option, const pmr::string &val) const;
+
+    // 二元运算：字符串、整数比较
+    bool Binary(const pmr::string &val1, const pmr::string &option, const pmr::string &val2) const;
+
+    // 是否为二元运算符
+    static bool IsBinary(const pmr::string &option);
+
+    // 参数转换为整数，不是整数时抛出异常
+    long Integer(const pmr::string &val) const;
+
+    // 抛出异常，format 中第一个 %s 为指令名，第二个为 arg
+    [[noreturn]] void Error(const char *format, const char *arg = "") const;
+
+    const ArgList &args;
+    size_t pos; // 下一个参数的下标
+    size_t end; // 表达式之后的下标
+};
 
 /* ---------- 指令解释执行 ---------- */
 
-// 第一阶段解析，处理后台执行字符'&'
+// 第一阶段解析，词法、语法分析后执行整条指令，复合指令尚未结束时读入后续的行
 void EvaluationEntry();
 
-// 第二阶段解析，处理由管道组成的多条命令
-void EvaluationOfPipe(vector<string>&cmd_token);
+// 依次执行指令列表，处理后台执行字符'&'
+void EvaluationOfList(const ListNode &list);
+
+// 第二阶段解析，处理"&&"、"||"
+void EvaluationOfAndOr(const AndOrNode &and_or);
+
+// 第三阶段解析，处理由管道组成的多条命令
+void EvaluationOfPipe(const PipelineNode &pipeline);
+
+// 将最近一条前台管道每一段的退出状态保存到数组变量 PIPESTATUS
+void StorePipeStatus();
+
+/* 启动管道中的一段，输入输出分别连接到 in_fd、out_fd，子进程中关闭 close_fd
+ * pgid 为 0 时新建进程组，为 INVALID_PID 时沿用 MyShell 的进程组
+ * 返回子进程 pid，启动失败时抛出异常；在父进程中直接执行的内建命令返回 INVALID_PID
+ */
+pid_t LaunchStage(const CommandNode &stage, int in_fd, int out_fd, int close_fd, pid_t pgid);
+
+// 第四阶段解析，处理重定向
+void EvaluationOfRedirect(const CommandNode &command);
+
+// 执行复合指令，重定向已经应用
+void EvaluationOfCompound(const CommandNode &command);
+
+// if：依次执行条件，执行第一个成功的条件对应的分支
+void EvaluationOfIf(const CommandNode &command);
+
+// while、until：每轮结束时回到单行内存池中这一轮开始的位置
+void EvaluationOfLoop(const CommandNode &command);
 
-// 第三阶段解析，处理重定向
-void EvaluationOfRedirect(const vector<string>&cmd_token);
+// for：取值列表在循环开始前展开一次
+void EvaluationOfFor(const CommandNode &command);
 
-// 第四阶段，执行指令
-void Execute(const vector<string>&cmd_token);
+// case：依次用各分支的模式匹配单词，执行第一个匹配的分支
+void EvaluationOfCase(const CommandNode &command);
+
+// 一轮循环结束时处理 break、continue 和 Ctrl+C，返回 true 表示退出循环
+bool EndOfIteration();
+
+// 定义函数：复制定义的源文本，在函数自己的内存池中重新分析
+void DefineFunction(const CommandNode &command);
+
+// 调用函数：位置参数改为调用的参数，返回时恢复位置参数和 local 声明的变量
+void CallFunction(const ShellFunction &function, const ArgList&cmd_token);
+
+// 第五阶段，执行指令；plan 不为空时为外部指令在子进程中应用的重定向
+void Execute(const ArgList&cmd_token, const RedirectPlan *plan = nullptr);
 
 /* ---------- 内建命令 ---------- */
 
 // cd: 改变目录
-void cd(const vector<string>&cmd_token);
+void cd(const ArgList&cmd_token);
 
 // clr: 清屏
-void clear(const vector<string>&cmd_token);
+void clear(const ArgList&cmd_token);
 
 // echo: 显示文本并换行
-void echo(const vector<string>&cmd_token);
+void echo(const ArgList&cmd_token);
 
 // pwd: 显示当前目录路径
-void pwd(const vector<string>&cmd_token);
+void pwd(const ArgList&cmd_token);
 
-// exit: 退出 MyShell
-void exit(const vector<string>&cmd_token);
+// exit: 退出 MyShell，退出状态默认为最近一条指令的退出状态
+void exit(const ArgList&cmd_token);
 
 // time: 显示当前时间
-void time(const vector<string>&cmd_token);
+void time(const ArgList&cmd_token);
 
 // umask: 显示当前掩码或修改掩码
-void umask(const vector<string>&cmd_token);
+void umask(const ArgList&cmd_token);
 
 // dir: 列出目录内容
-void dir(const vector<string>&cmd_token);
+void dir(const ArgList&cmd_token);
 
 // exec: 使用指定命令替换 MyShell
-void exec(const vector<string>&cmd_token);
+void exec(const ArgList&cmd_token);
 
 // help: 显示用户手册
-void help(const vector<string>&cmd_token);
+void help(const ArgList&cmd_token);
 
-// set: 设置环境变量的值，没有参数则列出所有环境变量
-void set(const vector<string>&cmd_token);
+// history: 显示历史记录，-s 从新到旧列出包含指定内容的记录
+void history(const ArgList&cmd_token);
 
-// test: 进行字符串、数字的比较
-void test(const vector<string>&cmd_token);
+// set: 设置环境变量的值，没有参数则列出所有变量
+void set(const ArgList&cmd_token);
 
-// bg: 将前台命令转移到后台执行
-void bg(const vector<string>&cmd_token);
+// export: 导出变量为环境变量，没有参数则列出所有导出的变量
+void export_var(const ArgList&cmd_token);
 
-// fg: 将后台命令转移到前台执行
-void fg(const vector<string>&cmd_token);
+// unset: 删除变量，-f 删除函数
+void unset(const ArgList&cmd_token);
 
-// jobs: 打印作业表
-void jobs(const vector<string>&cmd_token);
+// declare: 声明变量的属性（数组、整数、导出）并赋值，没有变量名则列出变量
+void declare(const ArgList&cmd_token);
 
-/* ---------- main 函数 ---------- */
+// let: 对每个参数进行算术求值，最后一个值为 0 时退出状态为 1
+void let(const ArgList&cmd_token);
 
-int main(int argc, char * argv[]) {
-    Initialization(argc, argv);
+// test、[: 进行文件测试和字符串、数字的比较，结果为退出状态
+void test(const ArgList&cmd_token);
 
-    bool not_eof = true; // 是否执行到批文件的末尾
-    char buffer[BUFFER_SIZE] = {0};
+// true、false、: 只设置退出状态
+void boolean(const ArgList&cmd_token);
 
-    while (not_eof) {
-        // 显示提示
-        DisplayPrompt();
+// local: 声明函数中的局部变量，函数返回时恢复
+void local(const ArgList&cmd_token);
 
-        // 循环读入，直到读到 EOF 或者换行为止
-        int i = 0;
-        while (true) {
-            // 从批文件中加载时，读到 EOF 结束
-            if (read(STDIN_FILENO, buffer + i, 1) <= 0) {
-                not_eof = false;
-                break;
-            }
-            // 从命令行读入时，读到换行符结束
-            if (buffer[i] == '\n') {
-                break;
-            }
-            i++;
-        }
+// return: 从函数返回
+void return_func(const ArgList&cmd_token);
 
-        buffer[i] = '\0';
-        Global::command = string(buffer); // 从 buffer 中转存到 command 中
+// break、continue: 跳出循环或进入下一轮循环
+void loop_control(const ArgList&cmd_token);
+
+// bg: 将前台命令转移到后台执行
+void bg(const ArgList&cmd_token);
 
-        // 进行指令的切割
-        Global::command_tokens = SpiltCommand(Global::command);
+// fg: 将后台命令转移到前台执行
+void fg(const ArgList&cmd_token);
 
-        // 指令解释入口
-        EvaluationEntry();
+// jobs: 打印作业表
+void jobs(const ArgList&cmd_token);
+
+// parallel: 并发执行多条指令，同时运行的指令数不超过上限
+void parallel(const ArgList&cmd_token);
+
+// wait: 等待后台作业结束
+void wait(const ArgList&cmd_token);
+
+// hash: 显示、添加或清除命令路径缓存
+void hash(const ArgList&cmd_token);
+
+/* ---------- 内建命令表 ---------- */
+
+typedef void (*BuiltinHandler)(const ArgList&cmd_token);
+
+/* 内建命令属性
+ * RUN_IN_PARENT - 修改 MyShell 自身的状态，只有在父进程中执行才有效果，在管道中执行时给出警告
+ * PIPE_SAFE - 可以作为管道中的一段执行；只有此属性的命令只产生输出、不读标准输入，
+ *             作为管道的最后一段时直接在父进程中执行，不创建子进程
+ */
+enum BuiltinFlag : unsigned {
+    RUN_IN_PARENT = 1u << 0,
+    PIPE_SAFE = 1u << 1,
+};
+
+struct Builtin {
+    string_view name; // 命令名
+    BuiltinHandler handler; // 处理函数
+    unsigned flags; // 属性
+};
+
+// 内建命令注册表，所有需要判断内建命令的地方都查询此表
+constexpr Builtin builtin_table[] = {
+        {":",     boolean, PIPE_SAFE},
+        {"[",     test,   PIPE_SAFE},
+        {"bg",    bg,     RUN_IN_PARENT},
+        {"break", loop_control, RUN_IN_PARENT},
+        {"cd",    cd,     RUN_IN_PARENT},
+        {"clr",   clear,  PIPE_SAFE},
+        {"continue", loop_control, RUN_IN_PARENT},
+        {"declare", declare, RUN_IN_PARENT | PIPE_SAFE},
+        {"dir",   dir,    PIPE_SAFE},
+        {"echo",  echo,   PIPE_SAFE},
+        {"exec",  exec,   RUN_IN_PARENT | PIPE_SAFE},
+        {"exit",  exit,   RUN_IN_PARENT},
+        {"export", export_var, RUN_IN_PARENT | PIPE_SAFE},
+        {"false", boolean, PIPE_SAFE},
+        {"fg",    fg,     RUN_IN_PARENT},
+        {"hash",  ::hash, RUN_IN_PARENT | PIPE_SAFE},
+        {"help",  help,   PIPE_SAFE},
+        {"history", history, RUN_IN_PARENT | PIPE_SAFE},
+        {"jobs",  jobs,   RUN_IN_PARENT | PIPE_SAFE},
+        {"let",   let,    RUN_IN_PARENT | PIPE_SAFE},
+        {"local", local,  RUN_IN_PARENT},
+        {"parallel", parallel, RUN_IN_PARENT | PIPE_SAFE},
+        {"pwd",   pwd,    PIPE_SAFE},
+        {"return", return_func, RUN_IN_PARENT},
+        {"set",   set,    RUN_IN_PARENT | PIPE_SAFE},
+        {"test",  test,   PIPE_SAFE},
+        {"time",  time,   PIPE_SAFE},
+        {"true",  boolean, PIPE_SAFE},
+        {"umask", umask,  RUN_IN_PARENT | PIPE_SAFE},
+        {"unset", unset,  RUN_IN_PARENT | PIPE_SAFE},
+        {"wait",  wait,   RUN_IN_PARENT},
+};
+constexpr unsigned BUILTIN_COUNT = sizeof(builtin_table) / sizeof(builtin_table[0]);
+
+// 哈希槽数为不小于命令数 4 倍的 2 的幂，便于在编译期找到无冲突的种子
+constexpr unsigned BuiltinSlotCount() {
+    unsigned slots = 1;
+    while (slots < 4 * BUILTIN_COUNT) {
+        slots <<= 1;
     }
+    return slots;
 }
+constexpr unsigned BUILTIN_SLOTS = BuiltinSlotCount();
 
-/* ---------- 辅助函数实现 ---------- */
-
-void Initialization(int argc, char**&argv) {
-
-    char buf[BUFFER_SIZE] = {0};
-    int fd = -1; // 文件描述符
-
-    // 拷贝命令行参数信息
-    Global::argc = argc;
-    for (int i = 0; i < argc; i++) {
-        Global::argv.emplace_back(argv[i]);
+// FNV-1a 哈希，种子作为初始值
+constexpr unsigned BuiltinHash(string_view name, unsigned seed) {
+    unsigned h = seed;
+    for (char c: name) {
+        h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
     }
+    return h ^ (h >> 15);
+}
 
-    if (argc >= 2) { // 给出的批文件数量多于一个
-        fd = open(argv[1], O_RDONLY);
-
-        if (fd < 0) {
-            // 文件打开失败，退出并提示
-            sprintf(buf, "MyShell: fail to access %s\n", argv[1]);
-            fprintf(stderr, RED "%s", buf);
-            exit(-1);
+// 编译期搜索使注册表中所有命令落入不同槽的种子
+constexpr unsigned FindBuiltinSeed() {
+    for (unsigned seed = 2166136261u;; seed++) {
+        bool used[BUILTIN_SLOTS]{};
+        bool perfect = true;
+        for (auto &builtin: builtin_table) {
+            unsigned slot = BuiltinHash(builtin.name, seed) & (BUILTIN_SLOTS - 1);
+            if (used[slot]) {
+                perfect = false;
+                break;
+            }
+            used[slot] = true;
+        }
+        if (perfect) {
+            return seed;
         }
+    }
+}
+constexpr unsigned BUILTIN_SEED = FindBuiltinSeed();
 
-        // 重定向输入
-        dup2(fd, STDIN_FILENO);
-        close(fd);
+// 槽到注册表下标的映射，空槽为 -1
+struct BuiltinSlots {
+    signed char index[BUILTIN_SLOTS];
+};
 
-        Global::is_batch_file = true; // 设置批文件标记
+constexpr BuiltinSlots MakeBuiltinSlots() {
+    BuiltinSlots slots{};
+    for (auto &index: slots.index) {
+        index = -1;
     }
+    for (unsigned i = 0; i < BUILTIN_COUNT; i++) {
+        slots.index[BuiltinHash(builtin_table[i].name, BUILTIN_SEED) & (BUILTIN_SLOTS - 1)] = i;
+    }
+    return slots;
+}
+constexpr BuiltinSlots builtin_slots = MakeBuiltinSlots();
 
-    gethostname(buf, BUFFER_SIZE); // 得到主机名
-    Global::host = string(buf);
-
-    Global::user = getenv("USERNAME"); // 得到用户名
+// 查找内建命令，O(1)，不是内建命令返回 nullptr
+const Builtin *FindBuiltin(string_view name);
 
-    Global::home_path = getenv("HOME"); // 得到主目录路径
+/* ---------- main 函数 ---------- */
 
-    Global::pwd = getenv("PWD"); // 得到当前工作目录路径
+int main(int argc, char * argv[]) {
+    Initialization(argc, argv);
 
-    Global::sub_pid = INVALID_PID; // 初始时没有子进程，为-1
+    while (true) {
+        // 提示已结束的后台作业，再显示提示
+        ReportFinishedJobs();
 
-    // 得到 MyShell 路径
-    buf[readlink("/proc/self/exe", buf, BUFFER_SIZE)] = '\0';
-    Global::shell_path = string(buf);
-    // 覆盖当前 shell 路径
-    setenv("SHELL", Global::shell_path.c_str(), 1);
+        // 读入一行，读到 EOF 结束；使用行编辑器时由编辑器显示提示符
+        bool has_line;
+        if (Global::use_editor) {
+            has_line = Global::editor.ReadLine(Global::command);
+        }
+        else if (Global::script_cache.Active()) {
+            has_line = Global::script_cache.Next(Global::command);
+        }
+        else {
+            DisplayPrompt();
+            has_line = Global::input.ReadLine(Global::command);
+        }
+        if (!has_line) {
+            break;
+        }
 
-    Global::manual_path = Global::pwd + "/manual"; // 得到帮助手册路径
+        // 交互执行时展开历史引用并记入历史
+        if (!Global::is_interactive || RecordHistory()) {
+            // 指令解释入口
+            EvaluationEntry();
+        }
 
-    // 设置父进程路径
-    setenv("PARENT", "\\bin\\bash", 1);
+        // 本行的词法单元、语法树和参数一次释放
+        Global::line_arena.Release();
+    }
 
-    // 设置中断信号处理函数
-    signal(SIGINT, SignalHandle);
-    signal(SIGTSTP, SignalHandle);
+    // 输入结束时以最近一条指令的退出状态退出，与 exit 相同
+    return Global::last_status;
 }
 
-void DisplayPrompt() {
-    // 控制颜色，输出命令提示符到终端
-    // 若为批文件，不输出
-    if (!Global::is_batch_file) {
-        string prompt = string(YELLOW) + Global::user
-                        + "@" + Global::host
-                        + string(WHITE) + ":"
-                        + string(BLUE) + Global::pwd
-                        + string(WHITE) + "$ ";
+/* ---------- 单行内存池实现 ---------- */
 
-        fprintf(stdout, "%s", prompt.c_str());
-        fflush(stdout);
-    }
+ScratchArena::~ScratchArena() {
+    Release();
 }
 
-void SignalHandle(int signal) {
+void ScratchArena::Rewind(Mark mark) {
+    current = mark.block;
+    used = mark.used;
+}
 
-    if (signal == SIGINT) { // 中断
-        fprintf(stdout, "\n");
-        kill(getpid(), SIGKILL);
+void ScratchArena::Release() {
+    for (size_t i = 1; i < blocks.size(); i++) {
+        ::operator delete(blocks[i].data);
     }
-    else if (signal == SIGTSTP) { // 挂起
-        fprintf(stdout, "\n");
-        if (Global::sub_pid != INVALID_PID) {
-            setpgid(Global::sub_pid, 0);
-            kill(Global::sub_pid, SIGTSTP); // 挂起
+    blocks.resize(1);
+    current = 0;
+    used = 0;
+}
 
-            // 添加到jobs表中
-            try {
-                AddJob(Global::sub_pid, Global::JobStatus::SUSPEND, Global::command);
-            }
-            catch (const char *s) {
-                fprintf(stderr, RED"%s", s);
-            }
-            fprintf(stdout, WHITE"%s", FormatJobMsg(Global::sub_pid, false).c_str());
-            Global::sub_pid = INVALID_PID;
+void *ScratchArena::do_allocate(size_t bytes, size_t alignment) {
+    while (true) {
+        Block &block = blocks[current];
+        size_t offset = (reinterpret_cast<uintptr_t>(block.data) + used + alignment - 1) / alignment * alignment
+                        - reinterpret_cast<uintptr_t>(block.data);
+        if (offset + bytes <= block.size) {
+            used = offset + bytes;
+            return block.data + offset;
+        }
+        // 当前块放不下，换到下一块；没有足够大的下一块时申请一块，大小至少翻倍
+        current++;
+        used = 0;
+        if (current == blocks.size() || blocks[current].size < bytes + alignment) {
+            size_t size = max(blocks[current - 1].size * 2, bytes + alignment);
+            blocks.insert(blocks.begin() + current, {static_cast<char *>(::operator new(size)), size});
         }
     }
 }
 
-vector<string> SpiltCommand(const string& cmd) {
-    stringstream stm;
-    stm << cmd;
+/* ---------- 输入缓冲实现 ---------- */
 
-    vector<string> tokens; // 指令切割结果
-    int i = 0;
-    while (true) {
-        tokens.emplace_back("");
-        stm >> tokens[i]; // 储存切割结果
-        if (tokens[i].empty()) break;
-        i++;
+LineReader::~LineReader() {
+    if (map_data != nullptr) {
+        munmap(const_cast<char *>(map_data), map_size);
     }
-
-    tokens.pop_back(); // 弹出最后一个空字符串
-    return tokens;
 }
 
-void AddJob(pid_t pid,Global::JobStatus stat,const string& sub_cmd) {
-    if (Global::jobs.size() == Global::MAX_WORK) {
-        throw "MyShell: job list is full\n";
+bool LineReader::LoadFile(const char *path) {
+    int file_fd = open(path, O_RDONLY);
+    if (file_fd < 0) {
+        return false;
+    }
+
+    struct stat file_info{};
+    if (fstat(file_fd, &file_info) < 0) {
+        close(file_fd);
+        return false;
     }
 
-    // 添加作业号，为空时添加1
-    if (Global::work_id_list.empty()) {
-        Global::jobs.insert(pair<pid_t, int>(pid, 1));
-        Global::work_id_list.push_back(1);
+    // 空文件不需要映射，直接视为 EOF
+    map_size = file_info.st_size;
+    if (map_size == 0) {
+        eof = true;
     }
-        // 否则作业号为当前最大作业号+1
     else {
-        Global::jobs.insert(pair<pid_t, int>(pid, *Global::work_id_list.rbegin() + 1));
-        Global::work_id_list.push_back(*Global::work_id_list.rbegin() + 1);
+        void *addr = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+        if (addr == MAP_FAILED) {
+            close(file_fd);
+            return false;
+        }
+        madvise(addr, map_size, MADV_SEQUENTIAL);
+        map_data = static_cast<const char *>(addr);
     }
-    Global::state.insert(pair<pid_t, Global::JobStatus>(pid, stat)); // 添加后台进程状态
-    Global::sub_commands.insert(pair<pid_t, string>(pid, sub_cmd)); // 添加后台进程执行的指令信息
+    close(file_fd);
+    fd = -1;
+    return true;
 }
 
-string FormatJobMsg(pid_t pid, bool finish) {
-    if (Global::state[pid] != Global::BACKEND && Global::state[pid] != Global::SUSPEND) {
-        return "";
+ssize_t LineReader::Fill() {
+    // 环形缓冲区中从队尾开始的连续空闲区域
+    size_t tail = (head + count) % READ_BLOCK_SIZE;
+    size_t space = (tail >= head) ? READ_BLOCK_SIZE - tail : head - tail;
+
+    // 与子进程共享的输入不能多读：普通文件可以事后退回，管道只能逐字节读入
+    if (!probed) {
+        probed = true;
+        seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+        byte_wise = !seekable && !isatty(fd);
     }
-    else {
-        return "[" + to_string(Global::jobs[pid]) + "]\t\t" +
-               to_string(pid) + "\t\t" +
-               ((finish) ? "Done" : (Global::state[pid] == Global::BACKEND) ? "Running" : "Suspend") + "\t\t" +
-               Global::sub_commands[pid] + "\n";
+    if (byte_wise) {
+        space = 1;
     }
-}
 
-string Parse2Value(const string&cmd_token) {
-    // '$'后是数字，需要返回命令行参数的值
-    if (*cmd_token.begin() == '$') {
-        if (cmd_token[1] >= '0' && cmd_token[1] <= '9') {
-            return Global::argv[(int) cmd_token[1]];
+    // 输入到达前处理 watch_fd 上的事件
+    while (watch_fd >= 0) {
+        pollfd fds[2] = {{fd, POLLIN, 0}, {watch_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
         }
-            // 命令行参数个数
-        else if (cmd_token == "$#") {
-            return to_string(Global::argc - 1);
+        if (fds[1].revents & POLLIN) {
+            on_watch();
         }
-        else {
-            // getenv 获得变量的值
-            char *val = getenv(cmd_token.substr(1).c_str());
-            // 环境变量存在
-            if (val != nullptr) {
-                return val;
-            }
-            else {
-                return "";
-            }
+        if (fds[0].revents != 0) {
+            break;
         }
     }
-        // 被''或者""引用的字符串返回值
-    else if (*cmd_token.begin() == '\'' || *cmd_token.begin() == '\"') {
-        return cmd_token.substr(1, cmd_token.size() - 2);
+
+    ssize_t n;
+    do {
+        n = read(fd, ring + tail, space);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        eof = true;
+        return 0;
     }
-    else {
-        return cmd_token;
+    count += n;
+    return n;
+}
+
+bool LineReader::ReadByte(char &c) {
+    if (count == 0 && (eof || Fill() == 0)) {
+        return false;
     }
+    c = ring[head];
+    head = (head + 1) % READ_BLOCK_SIZE;
+    count--;
+    return true;
 }
 
-void FormatPrintDir(DIR *dir, char*path) {
-    struct stat file_info{}; // 文件状态指针
-    struct dirent *p;
+void LineReader::Release() {
+    if (seekable && count > 0 && lseek(fd, -static_cast<off_t>(count), SEEK_CUR) >= 0) {
+        head = 0;
+        count = 0;
+    }
+}
 
-    // 将 readdir(dir) 的返回值赋值给 p，并在其不为 nullptr 的情况下循环读取
-    while ((p = readdir(dir)) != nullptr) {
-        //除了. 和 ..，将目录下的其他内容输出
-        if (strcmp(p->d_name, ".") != 0 && strcmp(p->d_name, "..") != 0) {
-            string abs_path(string(path) + "/");
-            abs_path += p->d_name;
+void LineReader::Watch(int watch_fd, void (*handler)()) {
+    this->watch_fd = watch_fd;
+    on_watch = handler;
+}
 
-            stat(abs_path.c_str(), &file_info); // 获取文件状态
+bool LineReader::ReadLine(string &line) {
+    line.clear();
 
-            // 是否为目录文件
-            if (S_ISDIR(file_info.st_mode)) {
-                fprintf(stdout, BLUE "%s\t", p->d_name);
-            }
-                // 是否为可执行文件
-            else if (access(p->d_name, X_OK) != -1) {
-                fprintf(stdout, GREEN "%s\t", p->d_name);
-            }
-                // 其他文件
-            else {
-                fprintf(stdout, WHITE "%s\t", p->d_name);
-            }
+    // 批文件：直接在映射区中查找换行符
+    if (fd < 0) {
+        if (map_pos >= map_size) {
+            return false;
+        }
+        const char *begin = map_data + map_pos;
+        auto *end = static_cast<const char *>(memchr(begin, '\n', map_size - map_pos));
+        if (end == nullptr) { // 最后一行没有换行符
+            end = map_data + map_size;
         }
+        line.assign(begin, end);
+        map_pos = end - map_data + 1;
+        return true;
     }
-    fprintf(stdout, WHITE"\n");
-}
 
-/* ---------- 指令解释执行实现 ---------- */
+    bool has_data = false; // 本行是否读到了数据
+    while (true) {
+        if (count == 0) {
+            if (eof || Fill() == 0) {
+                return has_data;
+            }
+        }
+        has_data = true;
 
-void EvaluationEntry() {
+        // 在连续的一段中查找换行符
+        size_t span = min(count, READ_BLOCK_SIZE - head);
+        auto *newline = static_cast<char *>(memchr(ring + head, '\n', span));
+        size_t used = (newline == nullptr) ? span : newline - (ring + head);
+        line.append(ring + head, used);
 
-    // 在执行新的指令前，先检查后台进程作业表是否有指令完成，
-    // 若已经完成，打印返回信息
-    for (auto &job: Global::jobs) {
-        if (waitpid(job.first, nullptr, WNOHANG) == job.first) {
-            fprintf(stdout, WHITE"%s", FormatJobMsg(job.first, true).c_str());
+        if (newline != nullptr) {
+            used++; // 跳过换行符
+        }
+        head = (head + used) % READ_BLOCK_SIZE;
+        count -= used;
 
-            // 更新 work_list
-            Global::work_id_list.erase(find(Global::work_id_list.begin(), Global::work_id_list.end(),job.second));
-            Global::jobs.erase(job.first);
-            Global::state.erase(job.first);
+        if (newline != nullptr) {
+            return true;
         }
     }
+}
 
-    // 命令为空，返回
-    if (Global::command_tokens.empty()) {
-        return;
-    }
+/* ---------- 补全实现 ---------- */
 
-    // 先处理后台运行字符'&'
-    if (*Global::command.crbegin() == '&') {
-        pid_t pid = fork(); // 创建子进程
-        Global::is_backend = true;
+// 补全时单词之间的分隔符
+inline bool IsWordBreak(char c) {
+    return IsMetaChar(c) || c == '(' || c == ')';
+}
 
-        if (pid != 0) { // 父进程
+inline bool SameTime(const timespec &a, const timespec &b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
 
-            try {
-                AddJob(pid, Global::BACKEND, Global::command); // 添加子进程
+bool Completer::LoadDirectory(const string &path, bool executables, CompletionDir &dir) {
+    int dirfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        return false;
+    }
+
+    // 先取修改时间再读取，读取期间的修改会在下次补全时发现
+    struct stat dir_info{};
+    DirOptions options;
+    options.color = executables; // 判断可执行文件需要权限位
+    DirListing listing;
+    bool loaded = fstat(dirfd, &dir_info) == 0 && ReadDirectory(dirfd, options, listing);
+    if (loaded) {
+        SortDirectory(options, listing);
+        dir.mtime = dir_info.st_mtim;
+        dir.entries.clear();
+        for (auto &entry: listing.entries) {
+            // 符号链接按指向的文件判断
+            mode_t mode = entry.mode;
+            if (entry.type == DT_LNK) {
+                struct stat target{};
+                mode = (fstatat(dirfd, listing.Name(entry), &target, 0) == 0) ? target.st_mode : 0;
             }
-            catch (const char *s) {
-                fprintf(stderr, RED "%s", s);
+            if (executables && !(S_ISREG(mode) && (mode & (S_IXUSR | S_IXGRP | S_IXOTH)))) {
+                continue;
             }
+            dir.entries.push_back({entry.name, entry.name_len, entry.type == DT_DIR || S_ISDIR(mode)});
+        }
+        dir.names = move(listing.names);
+    }
+    close(dirfd);
+    return loaded;
+}
 
-            Global::command[Global::command.find('&')] = ' '; // 将原指令中的'&'字符去掉
-            Global::command_tokens.pop_back();
-
-            // 打印子进程表
-            fprintf(stdout, "%s", FormatJobMsg(pid, false).c_str());
+const CompletionDir *Completer::Directory(const string &path) {
+    struct stat dir_info{};
+    if (stat(path.c_str(), &dir_info) < 0) {
+        return nullptr;
+    }
+    auto cached = dirs.find(path);
+    if (cached != dirs.end() && SameTime(cached->second.mtime, dir_info.st_mtim)) {
+        return &cached->second;
+    }
 
+    if (cached == dirs.end()) {
+        if (dirs.size() >= MAX_CACHED_DIRS) {
+            dirs.clear();
         }
-            // 子进程执行命令
-        else {
-            setpgid(0, 0); // 使子进程单独成为一个进程组，后台进程组自动忽略 Ctrl+Z, Ctrl+C 等信号
+        cached = dirs.emplace(path, CompletionDir()).first;
+    }
+    if (!LoadDirectory(path, false, cached->second)) {
+        dirs.erase(cached);
+        return nullptr;
+    }
+    return &cached->second;
+}
 
-            Global::command[Global::command.find('&')] = ' '; // 将原指令中的'&'字符去掉
-            Global::command_tokens.pop_back();
+void Completer::UpdateCommands() {
+    const string *path = Global::variables.Value("PATH");
+    string_view current = (path != nullptr) ? string_view(*path) : string_view();
+    bool changed = current != indexed_path;
+    if (changed) {
+        indexed_path = current;
+        path_dirs.clear();
+    }
 
-            try {
-                EvaluationOfPipe(Global::command_tokens);
-                exit(0);
-            }
-            catch (const char *s) {
-                fprintf(stderr, RED "%s", s);
+    // 逐个检查 PATH 中目录的修改时间，只重新读取改变了的目录
+    size_t index = 0;
+    for (size_t begin = 0; begin <= indexed_path.size(); index++) {
+        size_t end = min(indexed_path.find(':', begin), indexed_path.size());
+        string dir_path = (end == begin) ? "." : indexed_path.substr(begin, end - begin);
+        begin = end + 1;
+        if (index >= path_dirs.size()) {
+            path_dirs.emplace_back();
+        }
+
+        CompletionDir &dir = path_dirs[index];
+        struct stat dir_info{};
+        if (stat(dir_path.c_str(), &dir_info) < 0) {
+            changed |= !dir.entries.empty();
+            dir = CompletionDir();
+            continue;
+        }
+        if (!SameTime(dir.mtime, dir_info.st_mtim)) {
+            if (!LoadDirectory(dir_path, true, dir)) {
+                dir = CompletionDir();
             }
+            changed = true;
         }
     }
-        // 没有'&'，前台运行
-    else {
-        Global::is_backend = false;
-        try {
-            EvaluationOfPipe(Global::command_tokens);
-        }
-        catch (const char *s) {
-            fprintf(stderr, RED "%s", s);
+    if (!changed) {
+        return;
+    }
+
+    // 合并为有序、不重复的数组
+    commands.clear();
+    for (auto &dir: path_dirs) {
+        for (auto &entry: dir.entries) {
+            commands.push_back(dir.Name(entry));
         }
     }
+    sort(commands.begin(), commands.end());
+    commands.erase(unique(commands.begin(), commands.end()), commands.end());
 }
 
-void EvaluationOfPipe(vector<string>& cmd_tokens) {
-    bool has_pipe = false; // 是否有管道符
-
-    if (find(cmd_tokens.begin(),
-             cmd_tokens.end(),
-             "|") != cmd_tokens.end()) {
-        has_pipe = true;
+vector<Completion> Completer::Complete(string_view line, size_t end, size_t &word, string &directory) {
+    // 单词的开始：向前找到未转义的分隔符
+    word = end;
+    while (word > 0 && !(IsWordBreak(line[word - 1]) && !(word >= 2 && line[word - 2] == '\\'))) {
+        word--;
     }
 
-    // 没有管道符，直接进入第三步
-    if (!has_pipe) {
-        try {
-            EvaluationOfRedirect(cmd_tokens);
+    // 去掉引号和转义
+    string text;
+    for (size_t i = word; i < end; i++) {
+        if (line[i] == '\\' && i + 1 < end) {
+            text += line[++i];
         }
-        catch (const char *s) {
-            fprintf(stderr, RED "%s", s);
+        else if (line[i] != '\'' && line[i] != '"') {
+            text += line[i];
         }
     }
-    else {
-        // 生成父进程（自己）的拷贝
-        if (!Global::is_backend) Global::sub_pid = fork();
-        // 父进程等待子进程
-        if (!Global::is_backend && Global::sub_pid) {
-            while (Global::sub_pid != INVALID_PID && !waitpid(Global::sub_pid, nullptr, 0));
-            Global::sub_pid = INVALID_PID;
-        }
-        else { // 子进程
-            // 将信号处理函数恢复至系统默认
-            signal(SIGINT, SIG_DFL);
-            signal(SIGTSTP, SIG_DFL);
-
-            int pipe_fd1[2]{STDIN_FILENO, -1}, pipe_fd2[2]; // 管道描述符
-            vector<pid_t> pid_list; // 子进程 pid 列表
-
-            cmd_tokens.emplace_back("|"); // 在末尾临时添加一个管道符便于判断
-            int last_pipe = -1; // 标记上一个管道符的位置
-
-            for (int i = 0; i < cmd_tokens.size(); i++) {
-                if (cmd_tokens[i] == "|") {
-                    if (last_pipe == -1) { // 第一个管道符
-                        pipe(pipe_fd2);
-                    }
-                    else {
-                        pipe_fd1[0] = pipe_fd2[0];
-                        pipe_fd1[1] = pipe_fd2[1];
-                        close(pipe_fd1[1]); // 关闭管道写端口
-
-                        if (i == cmd_tokens.size() - 1) { // 最后一个临时管道符
-                            pipe_fd2[0] = -1;
-                            pipe_fd2[1] = fileno(stdout);
-                        }
-                        else { // 命令中间的管道符
-                            pipe(pipe_fd2);
-                        }
-                    }
 
-                    pid_list.push_back(fork()); // 创建执行命令的子进程
-
-                    if (*pid_list.rbegin() == 0) {
-                        // 设置信号处理函数
-                        signal(SIGINT, SIG_IGN);
-                        signal(SIGTSTP, SIG_DFL);
-
-                        // 重定向命令输入到管道读端口，同时关闭写端口
-                        dup2(pipe_fd1[0], STDIN_FILENO);
-                        close(pipe_fd1[1]);
-                        // 重定向命令输出到管道写端口，同时关闭读端口
-                        dup2(pipe_fd2[1], STDOUT_FILENO);
-                        close(pipe_fd2[0]);
-
-                        try {
-                            // 进入第三步分析
-                            EvaluationOfRedirect(vector<string>(cmd_tokens.begin() + last_pipe + 1,
-                                                                cmd_tokens.begin() + i));
-                            exit(0);
-                        }
-                        catch (const char *s) {
-                            fprintf(stderr, RED"%s", s);
-                        }
-                    }
-                    // 更新记录上一个管道符变量位置
-                    last_pipe = i;
-                }
+    // 单词之前为空或者是运算符时，单词是指令名
+    size_t before = word;
+    while (before > 0 && (line[before - 1] == ' ' || line[before - 1] == '\t')) {
+        before--;
+    }
+    bool command = before == 0 || strchr("|&;(", line[before - 1]) != nullptr;
+
+    vector<Completion> result;
+    directory.clear();
+    auto has_prefix = [](string_view name, string_view prefix) {
+        return name.substr(0, prefix.size()) == prefix;
+    };
+
+    // 指令名：内建命令和 PATH 中的可执行文件
+    if (command && text.find('/') == string::npos) {
+        for (auto &builtin: builtin_table) {
+            if (has_prefix(builtin.name, text)) {
+                result.push_back({builtin.name, false});
             }
+        }
+        UpdateCommands();
+        for (auto it = lower_bound(commands.begin(), commands.end(), string_view(text));
+             it != commands.end() && has_prefix(*it, text); ++it) {
+            result.push_back({*it, false});
+        }
+        auto by_name = [](const Completion &a, const Completion &b) { return a.name < b.name; };
+        auto same_name = [](const Completion &a, const Completion &b) { return a.name == b.name; };
+        sort(result.begin(), result.end(), by_name);
+        result.erase(unique(result.begin(), result.end(), same_name), result.end());
+        return result;
+    }
 
-            // 后一个子进程等待前一个子进程完成
-            for (auto &pid: pid_list) {
-                waitpid(pid, nullptr, 0);
-            }
-            exit(0);
+    // 文件路径：最后一个'/'之前为目录，之后为名字的前缀
+    size_t slash = text.rfind('/');
+    string_view prefix = text;
+    if (slash != string::npos) {
+        directory = text.substr(0, slash + 1);
+        prefix = string_view(text).substr(slash + 1);
+    }
+    string path = directory;
+    if (path.empty()) {
+        path = Global::pwd;
+    }
+    else if (path[0] == '~' && (path.size() == 1 || path[1] == '/')) {
+        path = Global::home_path + path.substr(1);
+    }
+    else if (path[0] != '/') {
+        path = Global::pwd + "/" + path;
+    }
+
+    const CompletionDir *dir = Directory(path);
+    if (dir == nullptr) {
+        return result;
+    }
+    auto it = lower_bound(dir->entries.begin(), dir->entries.end(), prefix,
+                          [dir](const CompletionEntry &entry, string_view prefix) {
+                              return dir->Name(entry) < prefix;
+                          });
+    for (; it != dir->entries.end() && has_prefix(dir->Name(*it), prefix); ++it) {
+        // 以'.'开头的名字只在前缀也以'.'开头时补全
+        if (dir->Name(*it)[0] == '.' && (prefix.empty() || prefix[0] != '.')) {
+            continue;
         }
+        result.push_back({dir->Name(*it), it->directory});
     }
+    return result;
 }
 
-void EvaluationOfRedirect(const vector<string>&cmd_token) {
+/* ---------- 行编辑器实现 ---------- */
 
-    // 输入、输出、错误输出重定向的文件名
-    string input, output, error;
-    // 备份三个标准输入、输出、错误流
-    auto old_input_fd = dup(STDIN_FILENO), old_output_fd = dup(STDOUT_FILENO), old_error_fd = dup(STDERR_FILENO);
-    int input_fd, output_fd, err_fd; // 新的文件描述符
-    unsigned last = cmd_token.size();
-    char err[BUFFER_SIZE]{0}; // 错误信息
+// 控制键的字节值
+constexpr int CtrlKey(char c) {
+    return c & 0x1F;
+}
 
-    // 搜索重定向符号
-    for (auto pos = cmd_token.rbegin(); pos != cmd_token.rend(); pos++) {
-        // 输入重定向
-        if (*pos == "<" || *pos == "0<") {
-            input = *(pos - 1); // 输入流文件在重定向符号'<'后
-            input_fd = open(input.c_str(), O_RDONLY);
-            // 打开失败
-            if (input_fd == -1) {
-                sprintf(err, "MyShell: cannot access %s\n", input.c_str());
-                throw err;
-            }
-            else {
-                dup2(input_fd, STDIN_FILENO);
-                close(input_fd);
-                last = distance(pos, cmd_token.rend()) - 1;
-            }
+// UTF-8 的后续字节
+inline bool IsContinuation(char c) {
+    return (c & 0xC0) == 0x80;
+}
+
+bool LineEditor::ReadLine(string &line, bool continuation) {
+    // 原始模式：逐字节读入，不回显，Ctrl+C 等作为普通按键读入；保留输出处理，子进程的换行仍转换为回车换行
+    if (!saved_mode) {
+        saved_mode = tcgetattr(STDIN_FILENO, &cooked) == 0;
+    }
+    termios raw = cooked;
+    raw.c_iflag &= ~(ICRNL | INLCR | IXON | ISTRIP);
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    fflush(stdout);
+
+    buffer.clear();
+    pos = 0;
+    searching = false;
+    at_eof = false;
+    this->continuation = continuation;
+    cancelled = false;
+    history_size = Global::history.Size();
+    history_index = history_size + 1;
+    drawn_prompt.clear();
+    drawn.clear();
+    cursor = 0;
+    active = true;
+    Refresh();
+
+    bool has_line = true;
+    while (true) {
+        char c;
+        if (!Global::input.ReadByte(c)) {
+            has_line = !buffer.empty();
+            break;
+        }
+        int key = static_cast<unsigned char>(c);
+        if (key == 0x1B) {
+            key = Escape();
+        }
+        if (searching && !SearchKey(key)) {
+            key = 0;
+        }
+        if (key != 0 && Key(key)) {
+            has_line = !at_eof;
+            break;
+        }
+        // 连续到达的输入（粘贴、高延迟连接上成批到达的按键）处理完再重画
+        if (!Global::input.Pending()) {
+            Refresh();
+        }
+    }
+
+    // 光标移到内容之后换行，恢复终端模式；放弃时已经换行
+    if (!cancelled) {
+        Refresh();
+        MoveTo(drawn_prompt_width + DisplayWidth(drawn.data(), drawn.size()));
+        if (cursor % columns != 0 || cursor == 0) {
+            out += "\r\n";
+        }
+    }
+    Flush();
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+    active = false;
+    line = buffer;
+    return has_line;
+}
+
+void LineEditor::Hide() {
+    if (!active) {
+        fprintf(stdout, "\n");
+        return;
+    }
+    MoveTo(drawn_prompt_width + DisplayWidth(drawn.data(), drawn.size()));
+    if (cursor % columns != 0) {
+        out += "\r\n";
+    }
+    Flush();
+    drawn_prompt.clear();
+    drawn.clear();
+    cursor = 0;
+}
+
+void LineEditor::Show() {
+    if (!active) {
+        DisplayPrompt();
+        return;
+    }
+    fflush(stdout);
+    Refresh();
+}
+
+int LineEditor::Escape() {
+    char c;
+    if (!Global::input.ReadByte(c)) {
+        return 0;
+    }
+    // Alt 组合键
+    switch (c) {
+        case 'b':
+        case 'B':
+            return KEY_WORD_LEFT;
+        case 'f':
+        case 'F':
+            return KEY_WORD_RIGHT;
+        case 'd':
+        case 'D':
+            return KEY_KILL_WORD;
+        case 0x7F:
+        case 0x08:
+            return KEY_KILL_WORD_BACK;
+        case 'O':
+        case '[':
+            break;
+        default:
+            return 0;
+    }
+
+    // ESC [ 参数 结束字节，或 ESC O 结束字节
+    string params;
+    char final;
+    while (true) {
+        if (!Global::input.ReadByte(final)) {
+            return 0;
+        }
+        if (c == 'O' || (final >= 0x40 && final <= 0x7E)) {
+            break;
+        }
+        params += final;
+    }
+    bool modified = params.find(';') != string::npos; // Ctrl、Alt 与方向键组合时按单词移动
+    switch (final) {
+        case 'A':
+            return CtrlKey('P');
+        case 'B':
+            return CtrlKey('N');
+        case 'C':
+            return modified ? KEY_WORD_RIGHT : CtrlKey('F');
+        case 'D':
+            return modified ? KEY_WORD_LEFT : CtrlKey('B');
+        case 'H':
+            return CtrlKey('A');
+        case 'F':
+            return CtrlKey('E');
+        case '~':
+            if (params == "1" || params == "7") {
+                return CtrlKey('A');
+            }
+            if (params == "4" || params == "8") {
+                return CtrlKey('E');
+            }
+            if (params == "3") {
+                return KEY_DELETE;
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+bool LineEditor::Key(int key) {
+    size_t next = pos + 1, prev = pos - 1;
+    while (next < buffer.size() && IsContinuation(buffer[next])) {
+        next++;
+    }
+    while (pos > 0 && prev > 0 && IsContinuation(buffer[prev])) {
+        prev--;
+    }
+
+    switch (key) {
+        case '\r':
+        case '\n':
+            return true;
+        case CtrlKey('A'):
+            pos = 0;
+            break;
+        case CtrlKey('E'):
+            pos = buffer.size();
+            break;
+        case CtrlKey('B'):
+            if (pos > 0) {
+                pos = prev;
+            }
+            break;
+        case CtrlKey('F'):
+            if (pos < buffer.size()) {
+                pos = next;
+            }
+            break;
+        case KEY_WORD_LEFT:
+            pos = WordLeft();
+            break;
+        case KEY_WORD_RIGHT:
+            pos = WordRight();
+            break;
+        case 0x7F:
+        case CtrlKey('H'):
+            if (pos > 0) {
+                buffer.erase(prev, pos - prev);
+                pos = prev;
+            }
+            break;
+        case CtrlKey('D'):
+            // 空行上为输入结束
+            if (buffer.empty()) {
+                at_eof = true;
+                return true;
+            }
+            [[fallthrough]];
+        case KEY_DELETE:
+            if (pos < buffer.size()) {
+                buffer.erase(pos, next - pos);
+            }
+            break;
+        case CtrlKey('K'):
+            Kill(pos, buffer.size());
+            break;
+        case CtrlKey('U'):
+            Kill(0, pos);
+            break;
+        case CtrlKey('W'):
+        case KEY_KILL_WORD_BACK:
+            Kill(WordLeft(), pos);
+            break;
+        case KEY_KILL_WORD:
+            Kill(pos, WordRight());
+            break;
+        case CtrlKey('Y'):
+            buffer.insert(pos, yank);
+            pos += yank.size();
+            break;
+        case CtrlKey('P'):
+            if (history_index > 1) {
+                if (history_index == history_size + 1) {
+                    saved_line = buffer;
+                }
+                buffer = Global::history.Entry(--history_index);
+                pos = buffer.size();
+            }
+            break;
+        case CtrlKey('N'):
+            if (history_index <= history_size) {
+                history_index++;
+                buffer = (history_index == history_size + 1) ? saved_line : string(Global::history.Entry(history_index));
+                pos = buffer.size();
+            }
+            break;
+        case CtrlKey('R'):
+            searching = true;
+            before_search = buffer;
+            query.clear();
+            match = 0;
+            failed = false;
+            break;
+        case '\t':
+            Complete();
+            break;
+        case CtrlKey('L'):
+            out += "\x1b[H\x1b[2J";
+            drawn_prompt.clear();
+            drawn.clear();
+            cursor = 0;
+            break;
+        case CtrlKey('C'):
+            // 放弃当前行，在新的一行重新显示提示符
+            MoveTo(drawn_prompt_width + DisplayWidth(drawn.data(), drawn.size()));
+            Advance("^C", 2);
+            if (cursor % columns != 0) {
+                out += "\r\n";
+            }
+            buffer.clear();
+            pos = 0;
+            history_index = history_size + 1;
+            drawn_prompt.clear();
+            drawn.clear();
+            cursor = 0;
+            Global::last_status = 130;
+            // 后续行中放弃整条指令
+            if (continuation) {
+                cancelled = true;
+                return true;
+            }
+            break;
+        default:
+            // 可显示的字符，包括 UTF-8 的各个字节
+            if (key >= 0x20 && key < 0x100 && key != 0x7F) {
+                buffer.insert(buffer.begin() + pos, static_cast<char>(key));
+                pos++;
+            }
+            break;
+    }
+    last_key = key;
+    return false;
+}
+
+bool LineEditor::SearchKey(int key) {
+    switch (key) {
+        case CtrlKey('R'):
+            SearchFrom(match == 0 ? history_size + 1 : match);
+            return false;
+        case 0x7F:
+        case CtrlKey('H'):
+            while (!query.empty() && IsContinuation(query.back())) {
+                query.pop_back();
+            }
+            if (!query.empty()) {
+                query.pop_back();
+            }
+            SearchFrom(history_size + 1);
+            return false;
+        case CtrlKey('G'):
+            buffer = before_search;
+            pos = buffer.size();
+            searching = false;
+            return false;
+        default:
+            // 继续输入搜索内容，当前匹配仍然包含时保持不变
+            if (key >= 0x20 && key < 0x100 && key != 0x7F) {
+                query += static_cast<char>(key);
+                SearchFrom(match == 0 ? history_size + 1 : match + 1);
+                return false;
+            }
+            // 其他按键结束搜索，匹配的记录留在编辑区中
+            searching = false;
+            return true;
+    }
+}
+
+void LineEditor::SearchFrom(size_t before) {
+    if (query.empty()) {
+        match = 0;
+        failed = false;
+        buffer = before_search;
+        pos = buffer.size();
+        return;
+    }
+    size_t found = Global::history.Search(query, before);
+    failed = (found == 0);
+    if (!failed) {
+        match = found;
+        buffer = Global::history.Entry(match);
+        pos = buffer.find(query);
+    }
+}
+
+void LineEditor::Refresh() {
+    // 终端宽度改变后原来的位置已不可靠，从当前行开头整体重画
+    winsize size{};
+    size_t width = (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) ? size.ws_col : 80;
+    if (width != columns) {
+        columns = width;
+        out += "\r\x1b[J";
+        drawn_prompt.clear();
+        drawn.clear();
+        cursor = 0;
+    }
+
+    string_view prompt = Global::prompt;
+    size_t prompt_width = Global::prompt_width;
+    if (searching) {
+        search_prompt = failed ? "(failed reverse-i-search)`" : "(reverse-i-search)`";
+        search_prompt += query;
+        search_prompt += "': ";
+        prompt = search_prompt;
+        prompt_width = DisplayWidth(prompt.data(), prompt.size());
+    }
+
+    // 与屏幕上相同的前缀不重画，提示符变化时从头重画
+    size_t old_end = drawn_prompt_width + DisplayWidth(drawn.data(), drawn.size());
+    size_t same = 0;
+    bool redraw = drawn_prompt != prompt;
+    if (redraw) {
+        MoveTo(0);
+        Advance(prompt, prompt_width);
+        drawn_prompt = prompt;
+        drawn_prompt_width = prompt_width;
+    }
+    else {
+        same = mismatch(drawn.begin(), drawn.begin() + min(drawn.size(), buffer.size()), buffer.begin()).first
+               - drawn.begin();
+        while (same > 0 && ((same < buffer.size() && IsContinuation(buffer[same]))
+                            || (same < drawn.size() && IsContinuation(drawn[same])))) {
+            same--;
+        }
+    }
+    if (redraw || same < drawn.size() || same < buffer.size()) {
+        MoveTo(prompt_width + DisplayWidth(buffer.data(), same));
+        Advance(string_view(buffer).substr(same), DisplayWidth(buffer.data() + same, buffer.size() - same));
+        // 原来的内容更长时清除多出的部分
+        if (old_end > cursor) {
+            out += "\x1b[J";
+        }
+        drawn = buffer;
+    }
+    MoveTo(prompt_width + DisplayWidth(buffer.data(), pos));
+    Flush();
+}
+
+void LineEditor::MoveTo(size_t cell) {
+    char seq[32];
+    size_t row = cursor / columns, col = cursor % columns;
+    size_t target_row = cell / columns, target_col = cell % columns;
+    if (target_row < row) {
+        out.append(seq, snprintf(seq, sizeof(seq), "\x1b[%zuA", row - target_row));
+    }
+    else if (target_row > row) {
+        out.append(seq, snprintf(seq, sizeof(seq), "\x1b[%zuB", target_row - row));
+    }
+    if (target_col == 0 && col != 0) {
+        out += '\r';
+    }
+    else if (target_col > col) {
+        out.append(seq, snprintf(seq, sizeof(seq), "\x1b[%zuC", target_col - col));
+    }
+    else if (target_col < col) {
+        out.append(seq, snprintf(seq, sizeof(seq), "\x1b[%zuD", col - target_col));
+    }
+    cursor = cell;
+}
+
+void LineEditor::Advance(string_view text, size_t width) {
+    out.append(text);
+    cursor += width;
+    // 写满一行后终端光标停在行尾，换行后位置才与计算的一致
+    if (width > 0 && cursor % columns == 0) {
+        out += "\r\n";
+    }
+}
+
+void LineEditor::Flush() {
+    size_t written = 0;
+    while (written < out.size()) {
+        ssize_t n = write(STDOUT_FILENO, out.data() + written, out.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    out.clear();
+}
+
+size_t LineEditor::WordLeft() const {
+    size_t i = pos;
+    while (i > 0 && isspace(static_cast<unsigned char>(buffer[i - 1]))) {
+        i--;
+    }
+    while (i > 0 && !isspace(static_cast<unsigned char>(buffer[i - 1]))) {
+        i--;
+    }
+    return i;
+}
+
+size_t LineEditor::WordRight() const {
+    size_t i = pos;
+    while (i < buffer.size() && isspace(static_cast<unsigned char>(buffer[i]))) {
+        i++;
+    }
+    while (i < buffer.size() && !isspace(static_cast<unsigned char>(buffer[i]))) {
+        i++;
+    }
+    return i;
+}
+
+// 补全的内容中对 shell 有特殊含义的字符加反斜杠
+void AppendEscaped(string &text, string_view name) {
+    for (char c: name) {
+        if (strchr(" \t|&;<>()$`'\"\\*?!#", c) != nullptr) {
+            text += '\\';
+        }
+        text += c;
+    }
+}
+
+void LineEditor::Complete() {
+    size_t word;
+    string directory;
+    vector<Completion> candidates = Global::completer.Complete(buffer, pos, word, directory);
+    if (candidates.empty()) {
+        out += '\a';
+        return;
+    }
+
+    // 所有候选项的公共前缀，唯一的候选项补全后加'/'或空格
+    string_view common = candidates[0].name;
+    for (auto &candidate: candidates) {
+        size_t n = 0;
+        while (n < common.size() && n < candidate.name.size() && common[n] == candidate.name[n]) {
+            n++;
+        }
+        common = common.substr(0, n);
+    }
+    string replacement;
+    AppendEscaped(replacement, directory);
+    AppendEscaped(replacement, common);
+    if (candidates.size() == 1) {
+        replacement += candidates[0].directory ? '/' : ' ';
+    }
+    if (buffer.compare(word, pos - word, replacement) != 0) {
+        buffer.replace(word, pos - word, replacement);
+        pos = word + replacement.size();
+    }
+    else if (candidates.size() > 1 && last_key == '\t') {
+        ListCompletions(candidates);
+    }
+    else {
+        out += '\a';
+    }
+}
+
+void LineEditor::ListCompletions(const vector<Completion> &candidates) {
+    Hide();
+    if (candidates.size() > 100) {
+        char answer = 'n';
+        out.append("Display all ").append(to_string(candidates.size())).append(" possibilities? (y or n)");
+        Flush();
+        Global::input.ReadByte(answer);
+        out += "\r\n";
+        if (answer != 'y' && answer != 'Y') {
+            Flush();
+            Show();
+            return;
+        }
+    }
+
+    // 与 dir 相同，按列排列，先从上到下再从左到右
+    size_t width = 0;
+    for (auto &candidate: candidates) {
+        width = max(width, DisplayWidth(candidate.name.data(), candidate.name.size()) + candidate.directory);
+    }
+    width += 2;
+    size_t per_row = max<size_t>(1, columns / width);
+    size_t rows = (candidates.size() + per_row - 1) / per_row;
+    for (size_t row = 0; row < rows; row++) {
+        for (size_t i = row; i < candidates.size(); i += rows) {
+            const Completion &candidate = candidates[i];
+            out.append(candidate.name);
+            if (candidate.directory) {
+                out += '/';
+            }
+            if (i + rows < candidates.size()) {
+                size_t shown = DisplayWidth(candidate.name.data(), candidate.name.size()) + candidate.directory;
+                out.append(width - shown, ' ');
+            }
+        }
+        out += "\r\n";
+    }
+    Flush();
+    Show();
+}
+
+void LineEditor::Kill(size_t begin, size_t end) {
+    if (begin >= end) {
+        return;
+    }
+    yank = buffer.substr(begin, end - begin);
+    buffer.erase(begin, end - begin);
+    pos = begin;
+}
+
+/* ---------- 输出缓冲实现 ---------- */
+
+OutputBuffer::OutputBuffer(int fd)
+        : fd(fd), storage(&Global::line_arena), iov(&Global::line_arena), offsets(&Global::line_arena) {}
+
+OutputBuffer::~OutputBuffer() {
+    Flush();
+}
+
+void OutputBuffer::Append(string_view data) {
+    if (data.empty()) {
+        return;
+    }
+    // 与上一段拷贝的内容相邻时合并为一个 iovec
+    if (!iov.empty() && iov.rbegin()->iov_base == nullptr) {
+        iov.rbegin()->iov_len += data.size();
+    }
+    else {
+        iov.push_back({nullptr, data.size()});
+        offsets.push_back(storage.size());
+    }
+    storage.append(data);
+    pending += data.size();
+    if (pending >= FLUSH_SIZE) {
+        Flush();
+    }
+}
+
+void OutputBuffer::AppendRef(string_view data) {
+    if (data.empty()) {
+        return;
+    }
+    iov.push_back({const_cast<char *>(data.data()), data.size()});
+    offsets.push_back(0);
+    pending += data.size();
+    if (pending >= FLUSH_SIZE || iov.size() >= IOV_MAX) {
+        Flush();
+    }
+}
+
+void OutputBuffer::Flush() {
+    fflush(stdout); // 先写出 stdio 中的内容，保证输出顺序
+
+    // storage 不再扩容，此时才能确定拷贝内容的地址
+    for (size_t i = 0; i < iov.size(); i++) {
+        if (iov[i].iov_base == nullptr) {
+            iov[i].iov_base = &storage[offsets[i]];
+        }
+    }
+
+    size_t first = 0;
+    while (first < iov.size()) {
+        ssize_t n = writev(fd, iov.data() + first, min(iov.size() - first, (size_t) IOV_MAX));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break; // 读端已关闭等错误，丢弃剩余内容
+        }
+        // 跳过已写完的 iovec，部分写出的调整起点
+        while (first < iov.size() && (size_t) n >= iov[first].iov_len) {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        if (first < iov.size()) {
+            iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + n;
+            iov[first].iov_len -= n;
+        }
+    }
+
+    storage.clear();
+    iov.clear();
+    offsets.clear();
+    pending = 0;
+}
+
+/* ---------- 历史记录实现 ---------- */
+
+History::~History() {
+    if (map_data != nullptr) {
+        munmap(const_cast<char *>(map_data), map_size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void History::Open(const string &path) {
+    // 与通知管道一样移到 10 以上，不占用脚本重定向常用的低编号描述符
+    int opened = open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (opened >= 0) {
+        fd = fcntl(opened, F_DUPFD_CLOEXEC, 10);
+        close(opened);
+    }
+}
+
+void History::Add(string_view line) {
+    if (fd < 0 || all_of(line.begin(), line.end(), [](char c) { return isspace(static_cast<unsigned char>(c)); })) {
+        return;
+    }
+    string record(line);
+    record += '\n';
+    // O_APPEND 保证写在文件末尾，加锁避免与其他 MyShell 的写入交错
+    flock(fd, LOCK_EX);
+    ssize_t written = write(fd, record.data(), record.size());
+    flock(fd, LOCK_UN);
+    (void) written;
+}
+
+size_t History::Size() {
+    Refresh();
+    return offsets.size() - 1;
+}
+
+string_view History::Entry(size_t n) const {
+    return {map_data + offsets[n - 1], offsets[n] - offsets[n - 1] - 1};
+}
+
+void History::Refresh() {
+    struct stat file_info{};
+    if (fd < 0 || fstat(fd, &file_info) < 0 || (size_t) file_info.st_size <= map_size) {
+        return;
+    }
+
+    // 文件只会增长，已有记录的偏移不变，扩大映射即可
+    size_t size = file_info.st_size;
+    void *addr = (map_data == nullptr)
+                 ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0)
+                 : mremap(const_cast<char *>(map_data), map_size, size, MREMAP_MAYMOVE);
+    if (addr == MAP_FAILED) {
+        return;
+    }
+    map_data = static_cast<const char *>(addr);
+    map_size = size;
+
+    // 只索引完整的行，其他 MyShell 正在写入的部分留到下次
+    const char *end = map_data + map_size;
+    for (const char *p = map_data + offsets.back();
+         (p = static_cast<const char *>(memchr(p, '\n', end - p))) != nullptr; p++) {
+        offsets.push_back(p - map_data + 1);
+    }
+}
+
+size_t History::Search(string_view text, size_t before) {
+    size_t size = Size();
+    before = min(before, size + 1);
+
+    // 查询太短时没有三元组，直接逐条查找
+    if (text.size() < 3) {
+        for (size_t n = before - 1; n >= 1; n--) {
+            if (Entry(n).find(text) != string_view::npos) {
+                return n;
+            }
+        }
+        return 0;
+    }
+
+    // 把新增的记录加入三元组索引，同一记录在倒排表中只出现一次
+    for (; trigram_entries < size; trigram_entries++) {
+        string_view entry = Entry(trigram_entries + 1);
+        for (size_t i = 0; i + 3 <= entry.size(); i++) {
+            vector<uint32_t> &list = trigrams[Trigram(entry.data() + i)];
+            if (list.empty() || list.back() != trigram_entries) {
+                list.push_back(trigram_entries);
+            }
+        }
+    }
+
+    // 包含 text 的记录一定包含它的每个三元组，从最短的倒排表中找候选
+    const vector<uint32_t> *shortest = nullptr;
+    for (size_t i = 0; i + 3 <= text.size(); i++) {
+        auto found = trigrams.find(Trigram(text.data() + i));
+        if (found == trigrams.end()) {
+            return 0;
+        }
+        if (shortest == nullptr || found->second.size() < shortest->size()) {
+            shortest = &found->second;
+        }
+    }
+    auto it = lower_bound(shortest->begin(), shortest->end(), (uint32_t) (before - 1));
+    while (it != shortest->begin()) {
+        --it;
+        if (Entry(*it + 1).find(text) != string_view::npos) {
+            return *it + 1;
+        }
+    }
+    return 0;
+}
+
+/* ---------- 变量表实现 ---------- */
+
+uint32_t HashName(string_view name) {
+    uint32_t hash = 2166136261u;
+    for (char c: name) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return hash;
+}
+
+void VariableTable::Import(char **env) {
+    for (; *env != nullptr; env++) {
+        const char *equal = strchr(*env, '=');
+        if (equal == nullptr || equal == *env) {
+            continue;
+        }
+        Variable &var = Intern(string_view(*env, equal - *env));
+        var.value = equal + 1;
+        var.flags |= VAR_SET | VAR_EXPORT;
+        Changed(var);
+    }
+}
+
+size_t VariableTable::Probe(string_view name, uint32_t hash) const {
+    size_t mask = slots.size() - 1;
+    size_t slot = hash & mask;
+    while (slots[slot] != 0) {
+        const Variable &var = vars[slots[slot] - 1];
+        if (var.hash == hash && var.name == name) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+void VariableTable::Grow() {
+    vector<uint32_t> old_slots(slots.size() * 2, 0);
+    old_slots.swap(slots);
+    size_t mask = slots.size() - 1;
+    for (auto index: old_slots) {
+        if (index == 0) {
+            continue;
+        }
+        size_t slot = vars[index - 1].hash & mask;
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = index;
+    }
+}
+
+const Variable *VariableTable::Find(string_view name) const {
+    size_t slot = Probe(name, HashName(name));
+    if (slots[slot] == 0) {
+        return nullptr;
+    }
+    const Variable &var = vars[slots[slot] - 1];
+    return (var.flags & VAR_SET) ? &var : nullptr;
+}
+
+Variable &VariableTable::Intern(string_view name) {
+    uint32_t hash = HashName(name);
+    size_t slot = Probe(name, hash);
+    if (slots[slot] != 0) {
+        return vars[slots[slot] - 1];
+    }
+
+    // 装载因子不超过 1/2
+    if ((vars.size() + 1) * 2 > slots.size()) {
+        Grow();
+        slot = Probe(name, hash);
+    }
+    Variable &var = vars.emplace_back();
+    var.name = name;
+    var.hash = hash;
+    slots[slot] = vars.size();
+    return var;
+}
+
+const string *VariableTable::Value(string_view name) const {
+    const Variable *var = Find(name);
+    if (var == nullptr) {
+        return nullptr;
+    }
+    if (var->flags & VAR_ARRAY) {
+        return var->elements.empty() ? nullptr : &var->elements[0];
+    }
+    return &var->value;
+}
+
+void VariableTable::Assign(Variable &var, string_view value) {
+    string text = (var.flags & VAR_INTEGER) ? to_string(EvaluateInteger(value)) : string(value);
+    if (var.flags & VAR_ARRAY) {
+        if (var.elements.empty()) {
+            var.elements.emplace_back();
+        }
+        var.elements[0] = move(text);
+    }
+    else {
+        var.value = move(text);
+    }
+    var.flags |= VAR_SET;
+    Changed(var);
+}
+
+void VariableTable::AssignElement(Variable &var, size_t index, string_view value) {
+    if (!(var.flags & VAR_ARRAY)) {
+        var.elements.clear();
+        if (var.flags & VAR_SET) {
+            var.elements.push_back(move(var.value));
+        }
+        var.value.clear();
+        var.flags |= VAR_ARRAY;
+    }
+    if (index >= var.elements.size()) {
+        var.elements.resize(index + 1);
+    }
+    var.elements[index] = (var.flags & VAR_INTEGER) ? to_string(EvaluateInteger(value)) : string(value);
+    var.flags |= VAR_SET;
+    Changed(var);
+}
+
+void VariableTable::AssignArray(Variable &var, vector<string> elements) {
+    if (var.flags & VAR_INTEGER) {
+        for (auto &element: elements) {
+            element = to_string(EvaluateInteger(element));
+        }
+    }
+    var.elements = move(elements);
+    var.value.clear();
+    var.flags |= VAR_SET | VAR_ARRAY;
+    Changed(var);
+}
+
+void VariableTable::SetFlags(string_view name, unsigned flags, bool on) {
+    Variable &var = Intern(name);
+    flags &= ~VAR_SET;
+    var.flags = on ? var.flags | flags : var.flags & ~flags;
+
+    // 声明为数组时标量的值成为第 0 个元素
+    if (on && (flags & VAR_ARRAY) && var.elements.empty() && (var.flags & VAR_SET)) {
+        var.elements.push_back(move(var.value));
+        var.value.clear();
+    }
+    Changed(var);
+}
+
+void VariableTable::Unset(string_view name) {
+    size_t slot = Probe(name, HashName(name));
+    if (slots[slot] == 0) {
+        return;
+    }
+    Variable &var = vars[slots[slot] - 1];
+    var.flags = 0;
+    var.value.clear();
+    var.elements.clear();
+    Changed(var);
+}
+
+void VariableTable::Restore(const Variable &saved) {
+    Variable &var = Intern(saved.name);
+    var.flags = saved.flags;
+    var.value = saved.value;
+    var.elements = saved.elements;
+    Changed(var);
+}
+
+EnvSnapshot::EnvSnapshot(const EnvSnapshot &other) : strings(other.strings), owners(other.owners) {
+    for (auto &entry: strings) {
+        envp.insert(envp.end() - 1, const_cast<char *>(entry.c_str()));
+    }
+}
+
+EnvSnapshot &VariableTable::WritableEnv() {
+    if (env.use_count() > 1) {
+        env = make_shared<EnvSnapshot>(*env);
+    }
+    return *env;
+}
+
+void VariableTable::Changed(Variable &var) {
+    if (var.name == "PATH") {
+        Global::command_hash.clear();
+    }
+
+    // 导出的已赋值变量：更新或追加一项
+    if ((var.flags & VAR_SET) && (var.flags & VAR_EXPORT)) {
+        EnvSnapshot &snapshot = WritableEnv();
+        const string &value = (var.flags & VAR_ARRAY)
+                              ? (var.elements.empty() ? var.value : var.elements[0]) : var.value;
+        if (var.env_index < 0) {
+            var.env_index = snapshot.strings.size();
+            snapshot.strings.emplace_back();
+            snapshot.owners.push_back(&var);
+            snapshot.envp.insert(snapshot.envp.end() - 1, nullptr);
+        }
+        string &entry = snapshot.strings[var.env_index];
+        entry.assign(var.name).append("=").append(value);
+        snapshot.envp[var.env_index] = const_cast<char *>(entry.c_str());
+    }
+        // 不再导出：与最后一项交换后删除
+    else if (var.env_index >= 0) {
+        EnvSnapshot &snapshot = WritableEnv();
+        size_t index = var.env_index, last = snapshot.strings.size() - 1;
+        if (index != last) {
+            snapshot.strings[index].swap(snapshot.strings[last]);
+            snapshot.owners[index] = snapshot.owners[last];
+            snapshot.owners[index]->env_index = index;
+            snapshot.envp[index] = const_cast<char *>(snapshot.strings[index].c_str());
+        }
+        snapshot.strings.pop_back();
+        snapshot.owners.pop_back();
+        snapshot.envp.erase(snapshot.envp.end() - 2);
+        var.env_index = -1;
+    }
+}
+
+/* ---------- 算术求值实现 ---------- */
+
+// 二元运算符及其优先级，1 最低
+struct BinaryOperator {
+    string_view text;
+    ArithOp op;
+    int level;
+};
+
+constexpr BinaryOperator binary_operators[] = {
+        {"||", OP_JUMP_IF_NONZERO, 1}, {"&&", OP_JUMP_IF_ZERO, 2},
+        {"|",  OP_BIT_OR,          3}, {"^",  OP_BIT_XOR,     4}, {"&",  OP_BIT_AND, 5},
+        {"==", OP_EQ,              6}, {"!=", OP_NE,          6},
+        {"<",  OP_LT,              7}, {"<=", OP_LE,          7}, {">",  OP_GT,      7}, {">=", OP_GE, 7},
+        {"<<", OP_SHL,             8}, {">>", OP_SHR,         8},
+        {"+",  OP_ADD,             9}, {"-",  OP_SUB,         9},
+        {"*",  OP_MUL,             10}, {"/", OP_DIV,         10}, {"%",  OP_MOD,    10},
+};
+constexpr int BINARY_LEVELS = 10;
+
+// 赋值运算符及其复合运算
+constexpr pair<string_view, ArithOp> assign_operators[] = {
+        {"=",   OP_POP}, {"*=", OP_MUL}, {"/=", OP_DIV}, {"%=", OP_MOD}, {"+=", OP_ADD}, {"-=", OP_SUB},
+        {"<<=", OP_SHL}, {">>=", OP_SHR}, {"&=", OP_BIT_AND}, {"^=", OP_BIT_XOR}, {"|=", OP_BIT_OR},
+};
+
+// 按长度从长到短排列，取最长的匹配
+constexpr string_view arith_operators[] = {
+        "<<=", ">>=", "**", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "++", "--",
+        "+=", "-=", "*=", "/=", "%=", "&=", "^=", "|=",
+        "+", "-", "*", "/", "%", "<", ">", "&", "^", "|", "!", "~", "?", ":", "=", ",", "(", ")", "[", "]",
+};
+
+void ArithCompiler::Compile() {
+    Comma();
+    if (!PeekOp().empty() || pos < text.size()) {
+        Error();
+    }
+}
+
+void ArithCompiler::Error() {
+    static char err[BUFFER_SIZE];
+    string_view token = text.substr(min(pos, text.size()));
+    snprintf(err, sizeof(err), "MyShell: %.*s: syntax error in expression (error token is \"%.*s\")\n",
+             (int) text.size(), text.data(), (int) token.size(), token.data());
+    Global::last_status = 1;
+    throw (const char *) err;
+}
+
+string_view ArithCompiler::PeekOp() {
+    while (pos < text.size() && isspace(static_cast<unsigned char>(text[pos]))) {
+        pos++;
+    }
+    for (auto op: arith_operators) {
+        if (text.compare(pos, op.size(), op) == 0) {
+            return op;
+        }
+    }
+    return {};
+}
+
+bool ArithCompiler::Accept(string_view op) {
+    if (PeekOp() == op) {
+        pos += op.size();
+        return true;
+    }
+    return false;
+}
+
+size_t ArithCompiler::Emit(ArithOp op, long long operand, Variable *var) {
+    ArithInstr &instr = program.code.emplace_back();
+    instr.op = op;
+    instr.operand = operand;
+    instr.var = var;
+    return program.code.size() - 1;
+}
+
+void ArithCompiler::Comma() {
+    Assignment();
+    while (Accept(",")) {
+        Emit(OP_POP);
+        Assignment();
+    }
+}
+
+void ArithCompiler::Assignment() {
+    // 先按左值解析，后面不是赋值运算符时回退
+    size_t saved_pos = pos, saved_size = program.code.size();
+    bool element;
+    Variable *var = LValue(element);
+    if (var != nullptr) {
+        string_view op = PeekOp();
+        for (auto &[text, binop]: assign_operators) {
+            if (op == text) {
+                pos += op.size();
+                Assignment();
+                size_t index = Emit(element ? OP_ASSIGN_ELEM : OP_ASSIGN, 0, var);
+                program.code[index].binop = binop;
+                return;
+            }
+        }
+    }
+    pos = saved_pos;
+    program.code.resize(saved_size);
+    Ternary();
+}
+
+void ArithCompiler::Ternary() {
+    Binary(1);
+    if (!Accept("?")) {
+        return;
+    }
+    size_t to_else = Emit(OP_JUMP_IF_ZERO);
+    Assignment();
+    if (!Accept(":")) {
+        Error();
+    }
+    size_t to_end = Emit(OP_JUMP);
+    program.code[to_else].operand = program.code.size();
+    Assignment();
+    program.code[to_end].operand = program.code.size();
+}
+
+void ArithCompiler::Binary(int level) {
+    if (level > BINARY_LEVELS) {
+        Power();
+        return;
+    }
+    Binary(level + 1);
+    while (true) {
+        string_view op = PeekOp();
+        const BinaryOperator *found = nullptr;
+        for (auto &binary: binary_operators) {
+            if (binary.level == level && binary.text == op) {
+                found = &binary;
+            }
+        }
+        if (found == nullptr) {
+            return;
+        }
+        pos += op.size();
+
+        // && || 短路求值，结果为 0 或 1
+        if (level <= 2) {
+            size_t to_short = Emit(found->op);
+            Binary(level + 1);
+            Emit(OP_BOOL);
+            size_t to_end = Emit(OP_JUMP);
+            program.code[to_short].operand = program.code.size();
+            Emit(OP_PUSH, level == 1 ? 1 : 0);
+            program.code[to_end].operand = program.code.size();
+        }
+        else {
+            Binary(level + 1);
+            Emit(found->op);
+        }
+    }
+}
+
+void ArithCompiler::Power() {
+    Unary();
+    // 右结合
+    if (Accept("**")) {
+        Power();
+        Emit(OP_POW);
+    }
+}
+
+void ArithCompiler::Unary() {
+    string_view op = PeekOp();
+    if (op == "++" || op == "--") {
+        pos += 2;
+        bool element;
+        Variable *var = LValue(element);
+        if (var == nullptr) {
+            Error();
+        }
+        Emit(element ? OP_INC_ELEM : OP_INC, op == "++" ? 1 : -1, var);
+    }
+    else if (op == "-" || op == "+" || op == "!" || op == "~") {
+        pos++;
+        Unary();
+        if (op != "+") {
+            Emit(op == "-" ? OP_NEG : op == "!" ? OP_NOT : OP_BIT_NOT);
+        }
+    }
+    else {
+        Postfix();
+    }
+}
+
+void ArithCompiler::Postfix() {
+    bool element;
+    Variable *var = LValue(element);
+    if (var == nullptr) {
+        Primary();
+        return;
+    }
+    string_view op = PeekOp();
+    if (op == "++" || op == "--") {
+        pos += 2;
+        size_t index = Emit(element ? OP_INC_ELEM : OP_INC, op == "++" ? 1 : -1, var);
+        program.code[index].post = true;
+    }
+    else {
+        Emit(element ? OP_LOAD_ELEM : OP_LOAD, 0, var);
+    }
+}
+
+Variable *ArithCompiler::LValue(bool &element) {
+    PeekOp();
+    size_t end = pos;
+    while (end < text.size() && (isalnum(static_cast<unsigned char>(text[end])) || text[end] == '_')) {
+        end++;
+    }
+    if (end == pos || isdigit(static_cast<unsigned char>(text[pos]))) {
+        return nullptr;
+    }
+    Variable *var = &Global::variables.Intern(text.substr(pos, end - pos));
+    pos = end;
+
+    // 数组元素的下标
+    element = Accept("[");
+    if (element) {
+        Comma();
+        if (!Accept("]")) {
+            Error();
+        }
+    }
+    return var;
+}
+
+void ArithCompiler::Primary() {
+    if (Accept("(")) {
+        Comma();
+        if (!Accept(")")) {
+            Error();
+        }
+        return;
+    }
+    if (pos >= text.size()) {
+        Error();
+    }
+
+    // 常数：十进制、0x 开头的十六进制、0 开头的八进制
+    if (isdigit(static_cast<unsigned char>(text[pos]))) {
+        size_t end = pos;
+        while (end < text.size() && isalnum(static_cast<unsigned char>(text[end]))) {
+            end++;
+        }
+        string number(text.substr(pos, end - pos));
+        char *number_end;
+        errno = 0;
+        long long value = strtoll(number.c_str(), &number_end, 0);
+        if (*number_end != '\0' || errno == ERANGE) {
+            Error();
+        }
+        pos = end;
+        Emit(OP_PUSH, value);
+        return;
+    }
+
+    // $NAME ${NAME} 与变量名相同，$1 $# $? $$ 等在执行时查找
+    if (text[pos] == '$') {
+        size_t begin = pos + 1, end;
+        if (begin < text.size() && text[begin] == '{') {
+            end = text.find('}', begin);
+            if (end == string_view::npos) {
+                Error();
+            }
+            begin++;
+        }
+        else {
+            end = begin;
+            if (end < text.size() && strchr("#?$", text[end]) != nullptr) {
+                end++;
+            }
+            else {
+                while (end < text.size() && (isalnum(static_cast<unsigned char>(text[end])) || text[end] == '_')) {
+                    end++;
+                }
+            }
+        }
+        string_view name = text.substr(begin, end - begin);
+        if (name.empty()) {
+            Error();
+        }
+        pos = (text[pos + 1] == '{') ? end + 1 : end;
+        if (IsIdentifier(name)) {
+            Emit(OP_LOAD, 0, &Global::variables.Intern(name));
+        }
+        else {
+            program.specials.emplace_back(name);
+            Emit(OP_LOAD_SPECIAL, program.specials.size() - 1);
+        }
+        return;
+    }
+    Error();
+}
+
+// 变量的值转换为整数：空为 0，不是整数时作为表达式求值
+long long ArithValue(const string &value, int depth) {
+    if (value.empty()) {
+        return 0;
+    }
+    char *end;
+    long long number = strtoll(value.c_str(), &end, 0);
+    if (*end == '\0') {
+        return number;
+    }
+    return EvaluateArithmetic(value, depth + 1);
+}
+
+// 数组元素的值，标量变量只有第 0 个元素
+const string &ElementOf(const Variable &var, long long index) {
+    static const string empty;
+    if (!(var.flags & VAR_SET)) {
+        return empty;
+    }
+    if (!(var.flags & VAR_ARRAY)) {
+        return index == 0 ? var.value : empty;
+    }
+    return (index >= 0 && index < (long long) var.elements.size()) ? var.elements[index] : empty;
+}
+
+// 二元运算，除数为 0 或指数为负时抛出异常
+long long ApplyBinary(const ArithProgram &program, ArithOp op, long long a, long long b) {
+    switch (op) {
+        case OP_MUL:
+            return (long long) ((unsigned long long) a * (unsigned long long) b);
+        case OP_DIV:
+        case OP_MOD:
+            if (b == 0) {
+                static char err[BUFFER_SIZE];
+                snprintf(err, sizeof(err), "MyShell: %s: division by 0\n", program.source.c_str());
+                Global::last_status = 1;
+                throw (const char *) err;
+            }
+            // LLONG_MIN / -1 溢出
+            if (b == -1) {
+                return op == OP_DIV ? (long long) (0ull - (unsigned long long) a) : 0;
+            }
+            return op == OP_DIV ? a / b : a % b;
+        case OP_POW: {
+            if (b < 0) {
+                static char err[BUFFER_SIZE];
+                snprintf(err, sizeof(err), "MyShell: %s: exponent less than 0\n", program.source.c_str());
+                Global::last_status = 1;
+                throw (const char *) err;
+            }
+            long long result = 1;
+            for (; b > 0; b >>= 1, a = (long long) ((unsigned long long) a * (unsigned long long) a)) {
+                if (b & 1) {
+                    result = (long long) ((unsigned long long) result * (unsigned long long) a);
+                }
+            }
+            return result;
+        }
+        case OP_ADD:
+            return (long long) ((unsigned long long) a + (unsigned long long) b);
+        case OP_SUB:
+            return (long long) ((unsigned long long) a - (unsigned long long) b);
+        case OP_SHL:
+            return (long long) ((unsigned long long) a << (b & 63));
+        case OP_SHR:
+            return a >> (b & 63);
+        case OP_LT:
+            return a < b;
+        case OP_LE:
+            return a <= b;
+        case OP_GT:
+            return a > b;
+        case OP_GE:
+            return a >= b;
+        case OP_EQ:
+            return a == b;
+        case OP_NE:
+            return a != b;
+        case OP_BIT_AND:
+            return a & b;
+        case OP_BIT_XOR:
+            return a ^ b;
+        case OP_BIT_OR:
+            return a | b;
+        default:
+            return b;
+    }
+}
+
+long long ArithProgram::Run(int depth) const {
+    // 栈深度不超过指令数
+    long long local[64];
+    vector<long long> heap;
+    long long *stack = local;
+    if (code.size() >= 64) {
+        heap.resize(code.size() + 1);
+        stack = heap.data();
+    }
+    size_t top = 0;
+
+    for (size_t pc = 0; pc < code.size(); pc++) {
+        const ArithInstr &instr = code[pc];
+        switch (instr.op) {
+            case OP_PUSH:
+                stack[top++] = instr.operand;
+                break;
+            case OP_POP:
+                top--;
+                break;
+            case OP_LOAD:
+                stack[top++] = ArithValue(ElementOf(*instr.var, 0), depth);
+                break;
+            case OP_LOAD_ELEM:
+                stack[top - 1] = ArithValue(ElementOf(*instr.var, stack[top - 1]), depth);
+                break;
+            case OP_LOAD_SPECIAL: {
+                pmr::string value(&Global::line_arena);
+                LookupVariable(specials[instr.operand], value);
+                stack[top++] = ArithValue(string(value), depth);
+                break;
+            }
+            case OP_ASSIGN:
+            case OP_ASSIGN_ELEM:
+            case OP_INC:
+            case OP_INC_ELEM: {
+                bool element = instr.op == OP_ASSIGN_ELEM || instr.op == OP_INC_ELEM;
+                bool increment = instr.op == OP_INC || instr.op == OP_INC_ELEM;
+                long long rhs = increment ? instr.operand : stack[--top];
+                long long index = element ? stack[--top] : 0;
+                if (index < 0) {
+                    static char err[BUFFER_SIZE];
+                    snprintf(err, sizeof(err), "MyShell: %s: bad array subscript\n", source.c_str());
+                    Global::last_status = 1;
+                    throw (const char *) err;
+                }
+                long long old = ArithValue(ElementOf(*instr.var, index), depth);
+                long long result = increment ? old + rhs
+                                             : instr.binop == OP_POP ? rhs : ApplyBinary(*this, instr.binop, old, rhs);
+                if (element) {
+                    Global::variables.AssignElement(*instr.var, index, to_string(result));
+                }
+                else {
+                    Global::variables.Assign(*instr.var, to_string(result));
+                }
+                stack[top++] = instr.post ? old : result;
+                break;
+            }
+            case OP_NEG:
+                stack[top - 1] = (long long) (0ull - (unsigned long long) stack[top - 1]);
+                break;
+            case OP_NOT:
+                stack[top - 1] = !stack[top - 1];
+                break;
+            case OP_BIT_NOT:
+                stack[top - 1] = ~stack[top - 1];
+                break;
+            case OP_BOOL:
+                stack[top - 1] = stack[top - 1] != 0;
+                break;
+            case OP_JUMP:
+                pc = instr.operand - 1;
+                break;
+            case OP_JUMP_IF_ZERO:
+                if (stack[--top] == 0) {
+                    pc = instr.operand - 1;
+                }
+                break;
+            case OP_JUMP_IF_NONZERO:
+                if (stack[--top] != 0) {
+                    pc = instr.operand - 1;
+                }
+                break;
+            default:
+                top--;
+                stack[top - 1] = ApplyBinary(*this, instr.op, stack[top - 1], stack[top]);
+                break;
+        }
+    }
+    return top > 0 ? stack[top - 1] : 0;
+}
+
+long long EvaluateArithmetic(string_view text, int depth) {
+    // 数组下标、整数变量赋值等从执行中的字节码重入时不带 depth，以执行中的层数为准
+    depth = max(depth, (int) Global::arith_running);
+    if (depth > 32) {
+        static char err[BUFFER_SIZE];
+        snprintf(err, sizeof(err), "MyShell: %.*s: expression recursion level exceeded\n", (int) text.size(), text.data());
+        Global::last_status = 1;
+        throw (const char *) err;
+    }
+
+    // 按源文本查找已编译的字节码，键指向缓存中保存的源文本，查找时不复制字符串
+    auto cached = Global::arith_cache.find(text);
+    if (cached == Global::arith_cache.end()) {
+        // 有字节码仍在执行时不能清空，否则会释放执行中的字节码
+        if (Global::arith_running == 0 && Global::arith_cache.size() >= Global::ARITH_CACHE_SIZE) {
+            Global::arith_cache.clear();
+        }
+        auto program = make_unique<ArithProgram>();
+        program->source = text;
+        ArithCompiler(program->source, *program).Compile();
+        string_view key = program->source;
+        cached = Global::arith_cache.emplace(key, move(program)).first;
+    }
+    Global::arith_running++;
+    try {
+        long long result = cached->second->Run(depth);
+        Global::arith_running--;
+        return result;
+    }
+    catch (const char *) {
+        Global::arith_running--;
+        throw;
+    }
+}
+
+/* ---------- 脚本缓存实现 ---------- */
+
+constexpr char SCRIPT_CACHE_MAGIC[8] = {'M', 'Y', 'S', 'H', 'A', 'S', 'T', '3'};
+constexpr uint32_t NO_SPAN = UINT32_MAX; // 空的范围，或指令没有缓存的语法树
+constexpr uint32_t LONG_SPAN = UINT32_MAX - 1; // 之后两个字为偏移和长度
+
+// 64 位 FNV-1a 哈希
+uint64_t HashBytes(string_view bytes) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c: bytes) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/* 单词记为相对指令开头的偏移和长度，通常各占 16 位合为一个字，
+ * 超过 16 位时先写 LONG_SPAN，再写偏移和长度两个字
+ */
+void EncodeSpan(vector<uint32_t> &out, const char *base, string_view text) {
+    size_t offset = text.data() - base;
+    if (text.data() == nullptr) {
+        out.push_back(NO_SPAN);
+    }
+    else if (offset < 0xFFFF && text.size() < 0xFFFF) {
+        out.push_back(offset << 16 | text.size());
+    }
+    else {
+        out.push_back(LONG_SPAN);
+        out.push_back(offset);
+        out.push_back(text.size());
+    }
+}
+
+// 从缓存中读取语法树的位置，单词和元素个数都要在指令和语法树数据的范围之内
+struct SyntaxReader {
+    const uint32_t *p; // 下一个字
+    const uint32_t *end; // 语法树数据的结尾
+    string_view command; // 单词所在的指令
+};
+
+// 缓存中的语法树嵌套过深时不再还原，避免恶意构造的数据耗尽栈空间
+constexpr unsigned MAX_DECODE_DEPTH = 256;
+
+[[noreturn]] void CorruptedCache() {
+    throw "MyShell: script cache: corrupted syntax tree\n";
+}
+
+uint32_t DecodeWord(SyntaxReader &in) {
+    if (in.p >= in.end) {
+        CorruptedCache();
+    }
+    return *in.p++;
+}
+
+// 每个元素至少占一个字，元素个数不能超过剩余的字数
+uint32_t DecodeCount(SyntaxReader &in) {
+    uint32_t count = DecodeWord(in);
+    if (count > (size_t) (in.end - in.p)) {
+        CorruptedCache();
+    }
+    return count;
+}
+
+string_view DecodeSpan(SyntaxReader &in) {
+    uint32_t word = DecodeWord(in);
+    if (word == NO_SPAN) {
+        return {};
+    }
+    uint64_t offset = word >> 16, len = word & 0xFFFF;
+    if (word == LONG_SPAN) {
+        offset = DecodeWord(in);
+        len = DecodeWord(in);
+    }
+    if (offset + len > in.command.size()) {
+        CorruptedCache();
+    }
+    return in.command.substr(offset, len);
+}
+
+// 语法树按先序写出，每个数组先写元素个数，复合指令的各部分递归写出
+void EncodeList(vector<uint32_t> &out, const char *base, const ListNode &list) {
+    out.push_back(list.items.size());
+    for (auto &item: list.items) {
+        out.push_back(item.background);
+        EncodeSpan(out, base, item.text);
+        out.push_back(item.ops.size());
+        for (auto op: item.ops) {
+            out.push_back(op);
+        }
+        out.push_back(item.pipelines.size());
+        for (auto &pipeline: item.pipelines) {
+            out.push_back(pipeline.negate);
+            EncodeSpan(out, base, pipeline.text);
+            out.push_back(pipeline.commands.size());
+            for (auto &command: pipeline.commands) {
+                out.push_back(command.kind);
+                EncodeSpan(out, base, command.text);
+                out.push_back(command.assigns.size());
+                for (auto assign: command.assigns) {
+                    EncodeSpan(out, base, assign);
+                }
+                out.push_back(command.words.size());
+                for (auto word: command.words) {
+                    EncodeSpan(out, base, word);
+                }
+                out.push_back(command.redirects.size());
+                for (auto &[redirect, target]: command.redirects) {
+                    out.push_back(redirect.kind);
+                    out.push_back(redirect.fd);
+                    out.push_back(redirect.flags);
+                    out.push_back(redirect.src_fd);
+                    EncodeSpan(out, base, target);
+                }
+                out.push_back(command.patterns.size());
+                for (auto count: command.patterns) {
+                    out.push_back(count);
+                }
+                out.push_back(command.parts.size());
+                for (auto &part: command.parts) {
+                    EncodeList(out, base, part);
+                }
+            }
+        }
+    }
+}
+
+// 复合指令各部分的个数必须与执行时的用法相符
+bool ValidShape(const CommandNode &command) {
+    size_t parts = command.parts.size(), words = command.words.size();
+    switch (command.kind) {
+        case CommandNode::SIMPLE:
+            return parts == 0 && command.patterns.empty()
+                   && !(command.assigns.empty() && words == 0 && command.redirects.empty());
+        case CommandNode::GROUP:
+            return parts == 1;
+        case CommandNode::IF:
+            return parts >= 2;
+        case CommandNode::WHILE:
+        case CommandNode::UNTIL:
+            return parts == 2;
+        case CommandNode::FOR:
+        case CommandNode::FUNCTION:
+            return parts == 1 && words >= 1;
+        case CommandNode::CASE: {
+            if (command.patterns.size() != parts || words == 0) {
+                return false;
+            }
+            size_t patterns = 0;
+            for (auto count: command.patterns) {
+                if (count == 0) {
+                    return false;
+                }
+                patterns += count;
+            }
+            return patterns == words - 1;
+        }
+    }
+    return false;
+}
+
+void DecodeList(SyntaxReader &in, ListNode &list, unsigned depth = 0) {
+    if (depth > MAX_DECODE_DEPTH) {
+        CorruptedCache();
+    }
+    list.items.resize(DecodeCount(in));
+    for (auto &item: list.items) {
+        item.background = DecodeWord(in) != 0;
+        item.text = DecodeSpan(in);
+        item.ops.resize(DecodeCount(in));
+        for (auto &op: item.ops) {
+            uint32_t kind = DecodeWord(in);
+            if (kind != AND_IF && kind != OR_IF) {
+                CorruptedCache();
+            }
+            op = static_cast<TokenKind>(kind);
+        }
+        item.pipelines.resize(DecodeCount(in));
+        if (item.pipelines.empty() || item.ops.size() + 1 != item.pipelines.size()) {
+            CorruptedCache();
+        }
+        for (auto &pipeline: item.pipelines) {
+            pipeline.negate = DecodeWord(in) != 0;
+            pipeline.text = DecodeSpan(in);
+            pipeline.commands.resize(DecodeCount(in));
+            if (pipeline.commands.empty()) {
+                CorruptedCache();
+            }
+            for (auto &command: pipeline.commands) {
+                uint32_t kind = DecodeWord(in);
+                if (kind > CommandNode::FUNCTION) {
+                    CorruptedCache();
+                }
+                command.kind = static_cast<CommandNode::Kind>(kind);
+                command.text = DecodeSpan(in);
+                command.assigns.resize(DecodeCount(in));
+                for (auto &assign: command.assigns) {
+                    assign = DecodeSpan(in);
+                }
+                command.words.resize(DecodeCount(in));
+                for (auto &word: command.words) {
+                    word = DecodeSpan(in);
+                }
+                command.redirects.resize(DecodeCount(in));
+                for (auto &[redirect, target]: command.redirects) {
+                    uint32_t redirect_kind = DecodeWord(in);
+                    redirect.fd = static_cast<int>(DecodeWord(in));
+                    redirect.flags = static_cast<int>(DecodeWord(in));
+                    redirect.src_fd = static_cast<int>(DecodeWord(in));
+                    // 只接受 ParseRedirectOperator 能产生的打开方式
+                    if (redirect_kind > Redirection::STRING || redirect.fd < -1 || redirect.src_fd < -1
+                        || (redirect.flags != 0 && redirect.flags != (O_WRONLY | O_CREAT | O_TRUNC)
+                            && redirect.flags != (O_WRONLY | O_CREAT | O_APPEND))) {
+                        CorruptedCache();
+                    }
+                    redirect.kind = static_cast<Redirection::Kind>(redirect_kind);
+                    target = DecodeSpan(in);
+                }
+                command.patterns.resize(DecodeCount(in));
+                for (auto &count: command.patterns) {
+                    count = DecodeWord(in);
+                }
+                command.parts.resize(DecodeCount(in));
+                for (auto &part: command.parts) {
+                    DecodeList(in, part, depth + 1);
+                }
+                if (!ValidShape(command)) {
+                    CorruptedCache();
+                }
+            }
+        }
+    }
+}
+
+ScriptCache::~ScriptCache() {
+    if (map_data != nullptr) {
+        munmap(map_data, map_size);
+    }
+}
+
+void ScriptCache::Load(const char *path, string_view script, bool stats) {
+    auto start = chrono::steady_clock::now();
+    this->script = script;
+    char resolved[PATH_MAX];
+    struct stat script_info{};
+    if (realpath(path, resolved) == nullptr || stat(resolved, &script_info) < 0 || script.size() >= NO_SPAN) {
+        return;
+    }
+    script_path = resolved;
+
+    // 缓存的键：路径决定文件名，大小、修改时间和内容哈希记在文件头中
+    ScriptCacheHeader header{};
+    memcpy(header.magic, SCRIPT_CACHE_MAGIC, sizeof(header.magic));
+    header.size = script_info.st_size;
+    header.mtime_sec = script_info.st_mtim.tv_sec;
+    header.mtime_nsec = script_info.st_mtim.tv_nsec;
+    header.hash = HashBytes(script);
+    header.path_len = script_path.size();
+
+    const char *cache_env = getenv("MYSHELL_CACHE_DIR");
+    string cache_dir = (cache_env != nullptr && *cache_env != '\0') ? cache_env : Global::home_path + "/.cache/myshell";
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx", static_cast<unsigned long long>(HashBytes(script_path)));
+    string cache_path = cache_dir + name;
+
+    const char *result = "hit";
+    if (!Map(cache_path, header)) {
+        Compile();
+        table = compiled_table.data();
+        data = compiled_data.data();
+        count = compiled_table.size() / 3;
+        data_size = compiled_data.size();
+        header.count = count;
+        header.data_size = data_size;
+
+        // 逐级创建缓存目录，写入失败时本次仍使用编译的结果
+        for (size_t slash = cache_dir.find('/', 1); ; slash = cache_dir.find('/', slash + 1)) {
+            mkdir(cache_dir.substr(0, slash).c_str(), 0755);
+            if (slash == string::npos) {
+                break;
+            }
+        }
+        result = Write(cache_path, header) ? "miss" : "miss, not saved";
+    }
+
+    if (stats) {
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        fprintf(stderr, "MyShell: script cache %s: %s (%u commands, %u words of syntax tree, %.3f ms)\n",
+                result, cache_path.c_str(), count, data_size, ms);
+    }
+}
+
+void ScriptCache::Compile() {
+    // 分析时出错会修改退出状态，编译不应影响执行
+    int saved_status = Global::last_status;
+    for (size_t begin = 0; begin < script.size();) {
+        size_t end = min(script.find('\n', begin), script.size());
+        size_t index = compiled_data.size();
+        bool compiled = false;
+        // 复合指令等未结束时并入下一行再分析，直到完整或到达批文件末尾，执行时 Next 一次读入多行
+        while (true) {
+            Global::incomplete_input = false;
+            try {
+                pmr::vector<Token> tokens = Tokenize(script.substr(begin, end - begin));
+                ListNode list = Parser(tokens).ParseList();
+                EncodeList(compiled_data, script.data() + begin, list);
+                compiled = true;
+            }
+            catch (const char *) {
+                compiled_data.resize(index);
+            }
+            Global::line_arena.Release();
+            if (compiled || !Global::incomplete_input || end >= script.size()) {
+                break;
+            }
+            end = min(script.find('\n', end + 1), script.size());
+        }
+        compiled_table.push_back(begin);
+        compiled_table.push_back(end - begin);
+        compiled_table.push_back(compiled ? index : NO_SPAN);
+        begin = end + 1;
+    }
+    Global::incomplete_input = false;
+    Global::last_status = saved_status;
+}
+
+bool ScriptCache::Map(const string &cache_path, const ScriptCacheHeader &expected) {
+    int cache_fd = open(cache_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (cache_fd < 0) {
+        return false;
+    }
+    // 只使用自己拥有、其他用户不能写入的普通文件，否则别人可以让 MyShell 执行任意拼接的指令
+    struct stat cache_info{};
+    void *addr = MAP_FAILED;
+    if (fstat(cache_fd, &cache_info) == 0 && S_ISREG(cache_info.st_mode) && cache_info.st_uid == geteuid()
+        && (cache_info.st_mode & (S_IWGRP | S_IWOTH)) == 0
+        && (size_t) cache_info.st_size >= sizeof(ScriptCacheHeader)) {
+        addr = mmap(nullptr, cache_info.st_size, PROT_READ, MAP_PRIVATE, cache_fd, 0);
+    }
+    close(cache_fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+    map_data = addr;
+    map_size = cache_info.st_size;
+
+    // 文件头与批文件一致、大小与文件头相符，且路径相同（排除文件名的哈希冲突）
+    auto *header = static_cast<const ScriptCacheHeader *>(addr);
+    const char *path = reinterpret_cast<const char *>(header + 1);
+    size_t path_size = (header->path_len + 3) / 4 * 4;
+    bool valid = memcmp(header->magic, expected.magic, sizeof(header->magic)) == 0
+                 && header->size == expected.size && header->hash == expected.hash
+                 && header->mtime_sec == expected.mtime_sec && header->mtime_nsec == expected.mtime_nsec
+                 && header->path_len == expected.path_len
+                 && map_size == sizeof(ScriptCacheHeader) + path_size + (3 * (size_t) header->count + header->data_size) * 4
+                 && string_view(path, header->path_len) == script_path;
+    if (valid) {
+        table = reinterpret_cast<const uint32_t *>(path + path_size);
+        data = table + 3 * (size_t) header->count;
+        count = header->count;
+        data_size = header->data_size;
+        // 指令必须在批文件之内，语法树必须在数据之内
+        for (uint32_t i = 0; valid && i < count; i++) {
+            valid = (size_t) table[3 * i] + table[3 * i + 1] <= script.size()
+                    && (table[3 * i + 2] == NO_SPAN || table[3 * i + 2] < header->data_size);
+        }
+    }
+    if (!valid) {
+        munmap(map_data, map_size);
+        map_data = nullptr;
+        table = data = nullptr;
+        count = data_size = 0;
+    }
+    return valid;
+}
+
+bool ScriptCache::Write(const string &cache_path, const ScriptCacheHeader &header) {
+    string temp_path = cache_path + "." + to_string(getpid()) + ".tmp";
+    int cache_fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (cache_fd < 0) {
+        return false;
+    }
+    static const char padding[4] = {};
+    iovec iov[] = {
+            {const_cast<ScriptCacheHeader *>(&header), sizeof(header)},
+            {script_path.data(), script_path.size()},
+            {const_cast<char *>(padding), (4 - script_path.size() % 4) % 4},
+            {compiled_table.data(), compiled_table.size() * 4},
+            {compiled_data.data(), compiled_data.size() * 4},
+    };
+    size_t total = 0;
+    for (auto &part: iov) {
+        total += part.iov_len;
+    }
+    bool written = writev(cache_fd, iov, sizeof(iov) / sizeof(iov[0])) == (ssize_t) total;
+    close(cache_fd);
+    if (!written || rename(temp_path.c_str(), cache_path.c_str()) < 0) {
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ScriptCache::Next(string &command) {
+    if (next >= count) {
+        return false;
+    }
+    command.assign(script.data() + table[3 * next], table[3 * next + 1]);
+    next++;
+    return true;
+}
+
+bool ScriptCache::Restore(ListNode &list) {
+    if (!Active() || next == 0 || table[3 * (next - 1) + 2] == NO_SPAN) {
+        return false;
+    }
+    // 缓存损坏或被篡改时按未命中处理，照常分析这条指令
+    const uint32_t *entry = table + 3 * (next - 1);
+    SyntaxReader in{data + entry[2], data + data_size, script.substr(entry[0], entry[1])};
+    try {
+        DecodeList(in, list);
+    }
+    catch (const char *) {
+        list = ListNode();
+        return false;
+    }
+    return true;
+}
+
+/* ---------- 辅助函数实现 ---------- */
+
+const Builtin *FindBuiltin(string_view name) {
+    int index = builtin_slots.index[BuiltinHash(name, BUILTIN_SEED) & (BUILTIN_SLOTS - 1)];
+    if (index >= 0 && builtin_table[index].name == name) {
+        return &builtin_table[index];
+    }
+    return nullptr;
+}
+
+void Initialization(int argc, char**&argv) {
+
+    char buf[BUFFER_SIZE] = {0};
+
+    // 批文件之前的选项：--no-cache 不使用编译缓存，--cache-stats 输出缓存的统计
+    int script = 1;
+    bool use_cache = true, cache_stats = false;
+    for (; script < argc && strncmp(argv[script], "--", 2) == 0; script++) {
+        if (strcmp(argv[script], "--no-cache") == 0) {
+            use_cache = false;
+        }
+        else if (strcmp(argv[script], "--cache-stats") == 0) {
+            cache_stats = true;
+        }
+        else {
+            fprintf(stderr, RED "MyShell: %s: invalid option\n", argv[script]);
+            exit(2);
+        }
+    }
+
+    // 拷贝命令行参数信息，执行批文件时 $0 为批文件，之后的参数为位置参数
+    Global::argv.emplace_back(argv[(script < argc) ? script : 0]);
+    for (int i = script + 1; i < argc; i++) {
+        Global::argv.emplace_back(argv[i]);
+    }
+    Global::argc = Global::argv.size();
+
+    if (script < argc) { // 给出了批文件
+        // 批文件映射到内存中读取，标准输入保留给子进程
+        if (!Global::input.LoadFile(argv[script])) {
+            // 文件打开失败，退出并提示
+            sprintf(buf, "MyShell: fail to access %s\n", argv[script]);
+            fprintf(stderr, RED "%s", buf);
+            exit(-1);
+        }
+
+        Global::is_batch_file = true; // 设置批文件标记
+    }
+
+    gethostname(buf, BUFFER_SIZE); // 得到主机名
+    Global::host = string(buf);
+
+    Global::user = getenv("USERNAME"); // 得到用户名
+
+    Global::home_path = getenv("HOME"); // 得到主目录路径
+
+    Global::pwd = getenv("PWD"); // 得到当前工作目录路径
+
+    RenderPrompt(); // 生成命令提示符
+
+    Global::sub_pid = INVALID_PID; // 初始时没有子进程，为-1
+
+    // 最大作业数
+    const char *max_jobs = getenv("MYSHELL_MAX_JOBS");
+    if (max_jobs != nullptr && atoi(max_jobs) > 0) {
+        Global::max_jobs = atoi(max_jobs);
+    }
+
+    // 交互执行时，MyShell 需要在后台进程组中也能设置终端的前台进程组
+    Global::is_interactive = !Global::is_batch_file && isatty(STDIN_FILENO);
+    Global::shell_pgid = getpgrp();
+    if (Global::is_interactive) {
+        signal(SIGTTOU, SIG_IGN);
+    }
+    const char *term = getenv("TERM");
+    Global::use_editor = Global::is_interactive && isatty(STDOUT_FILENO) && (term == nullptr || strcmp(term, "dumb") != 0);
+
+    // 得到 MyShell 路径
+    buf[readlink("/proc/self/exe", buf, BUFFER_SIZE)] = '\0';
+    Global::shell_path = string(buf);
+    // 导入环境变量，之后所有变量都在变量表中
+    Global::variables.Import(environ);
+
+    // 覆盖当前 shell 路径
+    Global::variables.Assign("SHELL", Global::shell_path);
+    Global::variables.SetFlags("SHELL", VAR_EXPORT, true);
+
+    // 得到帮助手册路径，与启动时的工作目录无关
+    const char *manual_env = getenv("MYSHELL_MANUAL");
+    if (manual_env != nullptr && *manual_env != '\0') {
+        Global::manual_path = manual_env;
+    }
+    else {
+        Global::manual_path = Global::shell_path.substr(0, Global::shell_path.rfind('/') + 1) + "manual";
+    }
+
+    // 批文件使用编译缓存，之后不再逐行分析
+    if (Global::is_batch_file && use_cache) {
+        Global::script_cache.Load(argv[script], Global::input.Mapped(), cache_stats);
+    }
+
+    // 设置父进程路径，子进程的 PARENT 指向 MyShell
+    Global::variables.Assign("PARENT", Global::shell_path);
+    Global::variables.SetFlags("PARENT", VAR_EXPORT, true);
+
+    // 交互执行时记录历史，只打开文件，首次使用时才读入
+    if (Global::is_interactive) {
+        const string *history_file = Global::variables.Value("HISTFILE");
+        Global::history.Open((history_file != nullptr && !history_file->empty())
+                             ? *history_file : Global::home_path + "/.myshell_history");
+    }
+
+    // 设置中断信号处理函数
+    signal(SIGINT, SignalHandle);
+    signal(SIGTSTP, SignalHandle);
+
+    // 子进程状态变化时唤醒等待输入的主循环
+    // 两端移到 10 以上，低编号的描述符留给脚本中的重定向（如 >&3）
+    int notify_pipe[2];
+    if (pipe2(notify_pipe, O_CLOEXEC | O_NONBLOCK) == 0) {
+        for (int i = 0; i < 2; i++) {
+            Global::notify_pipe[i] = fcntl(notify_pipe[i], F_DUPFD_CLOEXEC, 10);
+            close(notify_pipe[i]);
+        }
+        if (Global::notify_pipe[0] >= 0 && Global::notify_pipe[1] >= 0) {
+            Global::input.Watch(Global::notify_pipe[0], NotifyHandle);
+        }
+        else {
+            for (int &fd: Global::notify_pipe) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+                fd = -1;
+            }
+        }
+    }
+
+    // 设置子进程回收函数，被中断的系统调用自动重启
+    struct sigaction act{};
+    act.sa_handler = ChildHandle;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &act, nullptr);
+}
+
+void RenderPrompt() {
+    // 控制颜色，一次拼接后缓存
+    Global::prompt.clear();
+    Global::prompt.append(YELLOW).append(Global::user).append("@").append(Global::host)
+            .append(WHITE ":" BLUE).append(Global::pwd).append(WHITE "$ ");
+    Global::prompt_width = DisplayWidth(Global::user.data(), Global::user.size()) + 1
+                           + DisplayWidth(Global::host.data(), Global::host.size()) + 1
+                           + DisplayWidth(Global::pwd.data(), Global::pwd.size()) + 2;
+}
+
+void DisplayPrompt() {
+    // 输出命令提示符到终端
+    // 若为批文件，不输出
+    if (!Global::is_batch_file) {
+        fwrite(Global::prompt.data(), 1, Global::prompt.size(), stdout);
+        fflush(stdout);
+    }
+}
+
+void SignalHandle(int signal) {
+
+    if (signal == SIGINT) { // 中断
+        // parallel、wait 等待期间只中断等待，parallel 运行中的指令与 MyShell 同组，已直接收到信号
+        if (Global::waiting_jobs) {
+            Global::wait_interrupted = 1;
+            return;
+        }
+        // 交互执行复合指令期间只中断复合指令，循环在这一轮结束时退出
+        if (Global::is_interactive && Global::compound_depth > 0) {
+            Global::interrupted = 1;
+            return;
+        }
+        fprintf(stdout, "\n");
+        kill(getpid(), SIGKILL);
+    }
+    else if (signal == SIGTSTP) { // 挂起
+        fprintf(stdout, "\n");
+        // 挂起前台作业，作业表由 WaitForeground 在收到停止状态后更新
+        if (Global::sub_pid != INVALID_PID) {
+            if (Global::fg_own_group) {
+                kill(-Global::sub_pid, SIGTSTP); // 挂起整个进程组
+            }
+            else {
+                setpgid(Global::sub_pid, 0);
+                kill(Global::sub_pid, SIGTSTP); // 挂起
+            }
+        }
+    }
+}
+
+void ChildHandle(int signal) {
+    (void) signal; // 只处理 SIGCHLD
+    int saved_errno = errno; // 处理函数不能改变被中断代码的 errno
+    int status;
+    pid_t pid;
+
+    bool reaped = false;
+
+    // 队列满时停止回收，剩余子进程留给 ProcessReaped 补收
+    while ((Global::reap_tail + 1) % Global::REAP_QUEUE_SIZE != Global::reap_head &&
+           (pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+        Global::reap_queue[Global::reap_tail] = {pid, status};
+        Global::reap_tail = (Global::reap_tail + 1) % Global::REAP_QUEUE_SIZE;
+        reaped = true;
+    }
+
+    // 唤醒等待输入的主循环，管道满时说明已有未处理的通知
+    if (reaped && Global::notify_pipe[1] >= 0) {
+        ssize_t ignored = write(Global::notify_pipe[1], "", 1);
+        (void) ignored;
+    }
+    errno = saved_errno;
+}
+
+void ProcessReaped() {
+    while (true) {
+        // 队列为空时补收一次，防止队列满时遗漏的子进程
+        if (Global::reap_head == Global::reap_tail) {
+            ChildHandle(SIGCHLD);
+            if (Global::reap_head == Global::reap_tail) {
+                break;
+            }
+        }
+
+        Global::ReapRecord record = Global::reap_queue[Global::reap_head];
+        Global::reap_head = (Global::reap_head + 1) % Global::REAP_QUEUE_SIZE;
+
+        // 前台作业：全部结束或被挂起时唤醒等待者，继续运行的通知忽略
+        auto fg = find(Global::fg_pids.begin(), Global::fg_pids.end(), record.pid);
+        if (fg != Global::fg_pids.end()) {
+            if (WIFSTOPPED(record.status)) {
+                Global::fg_stopped = true;
+            }
+            else if (!WIFCONTINUED(record.status)) {
+                Global::fg_status[fg - Global::fg_pids.begin()] = record.status;
+                Global::fg_remaining--;
+            }
+        }
+            // 后台作业：更新作业表中的状态，所有进程都结束时作业结束
+        else {
+            auto owner = Global::job_of_pid.find(record.pid);
+            if (owner != Global::job_of_pid.end()) {
+                Global::Job &job = Global::job_slots[owner->second - 1];
+                if (WIFSTOPPED(record.status)) {
+                    job.state = Global::SUSPEND;
+                }
+                else if (WIFCONTINUED(record.status)) {
+                    job.state = Global::BACKEND;
+                }
+                else {
+                    auto index = find(job.pids.begin(), job.pids.end(), record.pid) - job.pids.begin();
+                    job.status[index] = record.status;
+                    Global::job_of_pid.erase(owner);
+                    if (--job.remaining == 0) {
+                        job.state = Global::DONE;
+                        Global::finished_jobs.push_back(job.id);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void ReportFinishedJobs() {
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+    ProcessReaped();
+    for (auto &id: Global::finished_jobs) {
+        Global::Job &job = Global::job_slots[id - 1];
+        if (job.id != id || job.state != Global::DONE) {
+            continue;
+        }
+        fprintf(stdout, WHITE"%s", FormatJobMsg(job).c_str());
+        RemoveJob(id);
+    }
+    Global::finished_jobs.clear();
+    sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+}
+
+void NotifyHandle() {
+    // 清空通知管道，通知只表示"有子进程状态变化"，不需要计数
+    char buf[BUFFER_SIZE];
+    while (read(Global::notify_pipe[0], buf, sizeof(buf)) > 0) {}
+
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+    ProcessReaped();
+    bool has_finished = !Global::finished_jobs.empty();
+    sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+
+    // set -b：另起一行提示，再重新显示提示符和正在编辑的内容
+    if (Global::notify_now && has_finished) {
+        Global::editor.Hide();
+        ReportFinishedJobs();
+        Global::editor.Show();
+    }
+}
+
+int WaitForeground(const vector<pid_t>&pids, pid_t pgid) {
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+
+    // 屏蔽 SIGCHLD 后再检查队列，sigsuspend 原子地解除屏蔽并睡眠，不会丢失唤醒
+    sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+    Global::fg_pids = pids;
+    Global::fg_status.assign(pids.size(), -1);
+    Global::fg_remaining = pids.size();
+    Global::fg_stopped = false;
+    Global::fg_own_group = (pgid != INVALID_PID);
+    Global::sub_pid = (pgid != INVALID_PID) ? pgid : *pids.begin();
+
+    // 交互执行时把终端交给前台作业，Ctrl+C、Ctrl+Z 直接发送给作业
+    bool give_terminal = Global::is_interactive && !Global::is_backend && pgid != INVALID_PID;
+    if (give_terminal) {
+        tcsetpgrp(STDIN_FILENO, pgid);
+    }
+
+    while (true) {
+        ProcessReaped();
+        if (Global::fg_remaining == 0 || Global::fg_stopped) {
+            break;
+        }
+        sigsuspend(&old_mask);
+    }
+
+    if (give_terminal) {
+        tcsetpgrp(STDIN_FILENO, Global::shell_pgid);
+    }
+    Global::sub_pid = INVALID_PID;
+    Global::fg_pids.clear();
+
+    // 被 Ctrl+Z 挂起，尚未结束的进程作为一个作业加入作业表
+    if (Global::fg_stopped) {
+        vector<pid_t> alive;
+        for (size_t i = 0; i < pids.size(); i++) {
+            if (Global::fg_status[i] == -1) {
+                alive.push_back(pids[i]);
+            }
+        }
+        try {
+            int id = AddJob(alive, pgid, Global::SUSPEND, Global::job_command);
+            fprintf(stdout, WHITE"%s", FormatJobMsg(Global::job_slots[id - 1]).c_str());
+        }
+        catch (const char *s) {
+            fprintf(stderr, RED"%s", s);
+        }
+        Global::last_status = 128 + SIGTSTP;
+        Global::pipe_status.assign(pids.size(), Global::last_status);
+    }
+    else {
+        Global::pipe_status.clear();
+        for (auto &status: Global::fg_status) {
+            Global::pipe_status.push_back(ExitStatus(status));
+            // 被 Ctrl+C 终止时本行其余的指令不再执行，循环随之结束
+            if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+                Global::interrupted = 1;
+            }
+        }
+        Global::last_status = *Global::pipe_status.rbegin();
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+    return Global::last_status;
+}
+
+int ExitStatus(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    else if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    else if (WIFSTOPPED(status)) {
+        return 128 + WSTOPSIG(status);
+    }
+    return 0;
+}
+
+int AddJob(const vector<pid_t>&pids, pid_t pgid, Global::JobStatus stat, string_view sub_cmd) {
+    if (Global::job_count >= Global::max_jobs) {
+        throw "MyShell: job list is full\n";
+    }
+
+    // 优先重用已释放的作业号，否则新开一个槽
+    int id;
+    if (!Global::free_job_ids.empty()) {
+        id = *Global::free_job_ids.rbegin();
+        Global::free_job_ids.pop_back();
+    }
+    else {
+        Global::job_slots.emplace_back();
+        id = (int) Global::job_slots.size();
+    }
+
+    Global::Job &job = Global::job_slots[id - 1];
+    job.id = id;
+    job.pgid = pgid;
+    job.state = stat;
+    job.command.assign(sub_cmd);
+    job.pids = pids;
+    job.status.assign(pids.size(), -1);
+    job.remaining = pids.size();
+    for (auto &pid: pids) {
+        Global::job_of_pid[pid] = id;
+    }
+    Global::job_count++;
+    return id;
+}
+
+void RemoveJob(int id) {
+    Global::Job &job = Global::job_slots[id - 1];
+    for (size_t i = 0; i < job.pids.size(); i++) {
+        if (job.status[i] == -1) {
+            Global::job_of_pid.erase(job.pids[i]);
+        }
+    }
+    job.id = 0;
+    job.pids.clear();
+    job.status.clear();
+    Global::free_job_ids.push_back(id);
+    Global::job_count--;
+}
+
+Global::Job &FindJob(const ArgList&cmd_token, size_t index, const char *name) {
+    static char err[BUFFER_SIZE];
+
+    // 没有参数，取作业号最大的作业
+    if (index >= cmd_token.size()) {
+        for (auto job = Global::job_slots.rbegin(); job != Global::job_slots.rend(); job++) {
+            if (job->id != 0) {
+                return *job;
+            }
+        }
+        snprintf(err, BUFFER_SIZE, "%s: current: no such job\n", name);
+        throw (const char *) err;
+    }
+
+    // 作业号，可以带'%'前缀
+    const char *arg = cmd_token[index].c_str();
+    char *end;
+    long id = strtol(arg + (*arg == '%'), &end, 10);
+    if (*end != '\0' || id <= 0 || id > (long) Global::job_slots.size() || Global::job_slots[id - 1].id == 0) {
+        snprintf(err, BUFFER_SIZE, "%s: %s: no such job\n", name, arg);
+        throw (const char *) err;
+    }
+    return Global::job_slots[id - 1];
+}
+
+void SignalJob(const Global::Job &job, int signal) {
+    // 作业单独成组时发送给整个进程组，否则逐个发送给尚未结束的进程
+    if (job.pgid != INVALID_PID) {
+        kill(-job.pgid, signal);
+        return;
+    }
+    for (size_t i = 0; i < job.pids.size(); i++) {
+        if (job.status[i] == -1) {
+            kill(job.pids[i], signal);
+        }
+    }
+}
+
+string FormatJobMsg(const Global::Job &job) {
+    const char *state = (job.state == Global::DONE) ? "Done" : (job.state == Global::BACKEND) ? "Running" : "Suspend";
+    pid_t pid = (job.pgid != INVALID_PID) ? job.pgid : *job.pids.begin();
+    return "[" + to_string(job.id) + "]\t\t" + to_string(pid) + "\t\t" + state + "\t\t" + job.command + "\n";
+}
+
+void LookupVariable(string_view name, pmr::string &value) {
+    // ${#NAME} 值的长度，${#NAME[@]} 数组的元素个数
+    if (name.size() > 1 && name[0] == '#') {
+        string_view target = name.substr(1);
+        size_t bracket = target.find('[');
+        if (bracket != string_view::npos && (target.substr(bracket) == "[@]" || target.substr(bracket) == "[*]")) {
+            const Variable *var = Global::variables.Find(target.substr(0, bracket));
+            size_t count = (var == nullptr) ? 0 : (var->flags & VAR_ARRAY) ? var->elements.size() : 1;
+            value += to_string(count);
+        }
+        else {
+            pmr::string text(&Global::line_arena);
+            LookupVariable(target, text);
+            value += to_string(DisplayWidth(text.data(), text.size()));
+        }
+    }
+        // 位置参数
+    else if (!name.empty() && all_of(name.begin(), name.end(), [](char c) { return isdigit(static_cast<unsigned char>(c)); })) {
+        size_t index = (name.size() < 10) ? stoul(string(name)) : SIZE_MAX;
+        if (index < Global::argv.size()) {
+            value += Global::argv[index];
+        }
+    }
+        // 命令行参数个数
+    else if (name == "#") {
+        value += to_string(Global::argc - 1);
+    }
+        // 所有位置参数，以空格分隔
+    else if (name == "@" || name == "*") {
+        for (size_t i = 1; i < Global::argv.size(); i++) {
+            value += (i == 1 ? "" : " ") + Global::argv[i];
+        }
+    }
+        // 最近一条前台指令的退出状态
+    else if (name == "?") {
+        value += to_string(Global::last_status);
+    }
+        // MyShell 的进程号
+    else if (name == "$") {
+        value += to_string(getpid());
+    }
+        // 数组元素 NAME[index]，NAME[@] 为所有元素
+    else if (name.size() > 3 && name.back() == ']' && name.find('[') != string_view::npos) {
+        size_t bracket = name.find('[');
+        const Variable *var = Global::variables.Find(name.substr(0, bracket));
+        if (var == nullptr) {
+            return;
+        }
+        string_view subscript = name.substr(bracket + 1, name.size() - bracket - 2);
+        if (subscript == "@" || subscript == "*") {
+            if (!(var->flags & VAR_ARRAY)) {
+                value += var->value;
+                return;
+            }
+            for (size_t i = 0; i < var->elements.size(); i++) {
+                value += (i == 0 ? "" : " ") + var->elements[i];
+            }
+            return;
+        }
+        long long index = EvaluateInteger(Parse2Value(subscript));
+        if (!(var->flags & VAR_ARRAY)) {
+            value += (index == 0) ? var->value : "";
+        }
+        else if (index >= 0 && index < (long long) var->elements.size()) {
+            value += var->elements[index];
+        }
+    }
+        // 变量表中的变量，不存在时为空
+    else {
+        const string *text = Global::variables.Value(name);
+        if (text != nullptr) {
+            value += *text;
+        }
+    }
+}
+
+bool ExpandListWord(string_view word, ArgList &argv) {
+    if (word.size() >= 2 && word.front() == '"' && word.back() == '"') {
+        word = word.substr(1, word.size() - 2);
+    }
+
+    // $@ ${@}：每个位置参数一个参数
+    if (word == "$@" || word == "${@}") {
+        for (size_t i = 1; i < Global::argv.size(); i++) {
+            argv.emplace_back(Global::argv[i]);
+        }
+        return true;
+    }
+
+    // ${NAME[@]}：每个元素一个参数
+    if (word.size() > 6 && word.substr(0, 2) == "${" && word.substr(word.size() - 4) == "[@]}") {
+        string_view name = word.substr(2, word.size() - 6);
+        if (!IsIdentifier(name)) {
+            return false;
+        }
+        const Variable *var = Global::variables.Find(name);
+        if (var != nullptr && (var->flags & VAR_ARRAY)) {
+            for (auto &element: var->elements) {
+                argv.emplace_back(element);
+            }
+        }
+        else if (var != nullptr) {
+            argv.emplace_back(var->value);
+        }
+        return true;
+    }
+    return false;
+}
+
+long long EvaluateInteger(string_view text, int depth) {
+    // 十进制整数直接转换，不经过表达式缓存
+    long long result = 0;
+    auto [end, error] = from_chars(text.data(), text.data() + text.size(), result);
+    if (error == errc() && end == text.data() + text.size()) {
+        return result;
+    }
+    if (all_of(text.begin(), text.end(), [](char c) { return isspace(static_cast<unsigned char>(c)); })) {
+        return 0;
+    }
+    return EvaluateArithmetic(text, depth);
+}
+
+bool IsIdentifier(string_view name) {
+    return !name.empty() && !isdigit(static_cast<unsigned char>(name[0])) &&
+           all_of(name.begin(), name.end(), [](char c) { return isalnum(static_cast<unsigned char>(c)) || c == '_'; });
+}
+
+void AppendQuoted(OutputBuffer &out, const string &value) {
+    out.Append("\"");
+    size_t begin = 0, end;
+    while ((end = value.find_first_of("\"\\$", begin)) != string::npos) {
+        out.Append(string_view(value).substr(begin, end - begin));
+        out.Append("\\");
+        out.Append(string_view(value).substr(end, 1));
+        begin = end + 1;
+    }
+    out.Append(string_view(value).substr(begin));
+    out.Append("\"");
+}
+
+void AppendDeclaration(OutputBuffer &out, string_view prefix, const Variable &var) {
+    out.Append(prefix);
+    out.Append(var.name);
+    out.Append("=");
+    if (var.flags & VAR_ARRAY) {
+        out.Append("(");
+        for (size_t i = 0; i < var.elements.size(); i++) {
+            if (i > 0) {
+                out.Append(" ");
+            }
+            AppendQuoted(out, var.elements[i]);
+        }
+        out.Append(")");
+    }
+    else {
+        AppendQuoted(out, var.value);
+    }
+    out.Append("\n");
+}
+
+void ApplyAssignment(string_view word) {
+    size_t equal = AssignmentLength(word);
+    string_view target = word.substr(0, equal);
+    string_view text = word.substr(equal + 1);
+    size_t bracket = target.find('[');
+
+    // 数组赋值 NAME=(a b c)，括号中的内容按单词切分后分别展开
+    if (bracket == string_view::npos && text.size() >= 2 && text.front() == '(' && text.back() == ')') {
+        ArgList list(&Global::line_arena);
+        for (auto &token: Tokenize(text.substr(1, text.size() - 2))) {
+            if (token.kind != WORD) {
+                static char err[BUFFER_SIZE];
+                snprintf(err, sizeof(err), "MyShell: syntax error in array assignment `%.*s`\n",
+                         (int) target.size(), target.data());
+                Global::last_status = 1;
+                throw (const char *) err;
+            }
+            if (!ExpandListWord(token.text, list)) {
+                list.push_back(Parse2Value(token.text));
+            }
+        }
+        Global::variables.AssignArray(target, vector<string>(list.begin(), list.end()));
+    }
+        // 数组元素 NAME[index]=value，下标可以使用变量
+    else if (bracket != string_view::npos) {
+        long long index = EvaluateInteger(Parse2Value(target.substr(bracket + 1, target.size() - bracket - 2)));
+        if (index < 0) {
+            static char err[BUFFER_SIZE];
+            snprintf(err, sizeof(err), "MyShell: %.*s: bad array subscript\n", (int) target.size(), target.data());
+            Global::last_status = 1;
+            throw (const char *) err;
+        }
+        Global::variables.AssignElement(target.substr(0, bracket), index, Parse2Value(text));
+    }
+    else {
+        Global::variables.Assign(target, Parse2Value(text));
+    }
+}
+
+pmr::string Parse2Value(string_view word, bool pattern) {
+    pmr::string value(&Global::line_arena);
+    size_t i = 0;
+    bool in_double = false; // 是否在双引号中
+
+    // 开头的'~'展开为主目录
+    if (!word.empty() && word[0] == '~' && (word.size() == 1 || word[1] == '/')) {
+        value = Global::home_path;
+        i = 1;
+    }
+
+    while (i < word.size()) {
+        char c = word[i];
+        // 单引号中的内容原样保留，词法分析已保证引号匹配
+        if (c == '\'' && !in_double) {
+            size_t close = word.find('\'', i + 1);
+            size_t from = value.size();
+            value.append(word.substr(i + 1, close - i - 1));
+            if (pattern) {
+                EscapeGlob(value, from);
+            }
+            i = close + 1;
+        }
+        else if (c == '"') {
+            in_double = !in_double;
+            i++;
+        }
+            // 双引号中只有 \" \\ \$ 是转义
+        else if (c == '\\' && i + 1 < word.size()) {
+            char next = word[i + 1];
+            size_t from = value.size();
+            if (in_double && next != '"' && next != '\\' && next != '$') {
+                value += c;
+            }
+            value += next;
+            if (pattern) {
+                EscapeGlob(value, from);
+            }
+            i += 2;
+        }
+        else if (c == '$' && word.compare(i, 3, "$((") == 0) {
+            // $((expression))，表达式中的 $NAME ${NAME} 由字节码在执行时读取，源文本不变即可复用缓存
+            size_t end = ArithmeticEnd(word, i);
+            if (end == string_view::npos) {
+                value += c;
+                i++;
+                continue;
+            }
+            long long result = EvaluateArithmetic(word.substr(i + 3, end - i - 5));
+            char number[24];
+            value.append(number, to_chars(number, number + sizeof(number), result).ptr);
+            i = end;
+        }
+        else if (c == '$' && i + 1 < word.size()) {
+            // ${NAME}
+            if (word[i + 1] == '{') {
+                size_t close = word.find('}', i + 2);
+                if (close == string_view::npos) {
+                    value += c;
+                    i++;
+                    continue;
+                }
+                size_t from = value.size();
+                LookupVariable(word.substr(i + 2, close - i - 2), value);
+                if (pattern && in_double) {
+                    EscapeGlob(value, from);
+                }
+                i = close + 1;
+                continue;
+            }
+            // $? $# $$ $@ $* $0-$9
+            size_t end = i + 1;
+            if (strchr("?#$@*", word[end]) != nullptr || isdigit(static_cast<unsigned char>(word[end]))) {
+                end++;
+            }
+                // $NAME
+            else {
+                while (end < word.size() && (isalnum(static_cast<unsigned char>(word[end])) || word[end] == '_')) {
+                    end++;
+                }
+            }
+            // '$'后不是变量名，原样保留
+            if (end == i + 1) {
+                value += c;
+                i++;
+                continue;
+            }
+            size_t from = value.size();
+            LookupVariable(word.substr(i + 1, end - i - 1), value);
+            if (pattern && in_double) {
+                EscapeGlob(value, from);
+            }
+            i = end;
+        }
+        else {
+            value += c;
+            // 双引号中的通配符按字面匹配
+            if (pattern && in_double) {
+                EscapeGlob(value, value.size() - 1);
+            }
+            i++;
+        }
+    }
+    return value;
+}
+
+void EscapeGlob(pmr::string &value, size_t from) {
+    for (size_t i = from; i < value.size(); i++) {
+        if (strchr("*?[]\\", value[i]) != nullptr) {
+            value.insert(i, 1, '\\');
+            i++;
+        }
+    }
+}
+
+bool LoadManual() {
+    if (Global::manual.data() != nullptr) {
+        return true;
+    }
+
+    int manual_fd = open(Global::manual_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (manual_fd < 0) {
+        return false;
+    }
+    struct stat file_info{};
+    if (fstat(manual_fd, &file_info) < 0 || file_info.st_size == 0) {
+        close(manual_fd);
+        return false;
+    }
+    void *data = mmap(nullptr, file_info.st_size, PROT_READ, MAP_PRIVATE, manual_fd, 0);
+    close(manual_fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    string_view manual(static_cast<const char *>(data), file_info.st_size);
+
+    // 一次扫描：每个以'*'开头的行开始一个小节，小节延续到下一个标题行
+    string_view name;
+    size_t begin = 0;
+    for (size_t pos = 0; pos < manual.size();) {
+        size_t line_end = manual.find('\n', pos);
+        line_end = (line_end == string_view::npos) ? manual.size() : line_end + 1;
+        if (manual[pos] == '*') {
+            if (!name.empty()) {
+                Global::manual_index.emplace(name, manual.substr(begin, pos - begin));
+            }
+            // 去掉两侧的'*'和空白得到名字
+            name = manual.substr(pos + 1, line_end - pos - 1);
+            size_t first = name.find_first_not_of(" \t");
+            size_t last = name.find_last_not_of(" \t\r\n*");
+            name = (first == string_view::npos || last == string_view::npos || last < first)
+                   ? string_view() : name.substr(first, last - first + 1);
+            begin = pos;
+        }
+        pos = line_end;
+    }
+    if (!name.empty()) {
+        Global::manual_index.emplace(name, manual.substr(begin));
+    }
+    Global::manual = manual;
+    return true;
+}
+
+bool ExpandHistory(string &line) {
+    if (line.find('!') == string::npos) {
+        return false;
+    }
+    string result;
+    bool in_single = false, in_double = false, expanded = false;
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (c == '\\' && i + 1 < line.size() && !in_single) {
+            result += c;
+            result += line[++i];
+            continue;
+        }
+        if (c == '\'' && !in_double) {
+            in_single = !in_single;
+        }
+        else if (c == '"' && !in_single) {
+            in_double = !in_double;
+        }
+        if (c != '!' || in_single || i + 1 >= line.size()) {
+            result += c;
+            continue;
+        }
+
+        // !! 为上一条记录，!n 为第 n 条记录，!-n 为倒数第 n 条记录，其他情况原样保留
+        size_t size = Global::history.Size(), n, end = i + 1;
+        if (line[end] == '!') {
+            n = size;
+            end++;
+        }
+        else {
+            bool relative = line[end] == '-';
+            size_t digits = relative ? end + 1 : end;
+            end = digits;
+            while (end < line.size() && isdigit(static_cast<unsigned char>(line[end]))) {
+                end++;
+            }
+            if (end == digits) {
+                result += c;
+                continue;
+            }
+            n = strtoull(line.substr(digits, end - digits).c_str(), nullptr, 10);
+            if (relative) {
+                n = (n <= size) ? size + 1 - n : 0;
+            }
+        }
+        if (n == 0 || n > size) {
+            static char err[BUFFER_SIZE];
+            snprintf(err, sizeof(err), "MyShell: %s: event not found\n", line.substr(i, end - i).c_str());
+            Global::last_status = 1;
+            throw (const char *) err;
+        }
+        result += Global::history.Entry(n);
+        i = end - 1;
+        expanded = true;
+    }
+    if (expanded) {
+        line = move(result);
+    }
+    return expanded;
+}
+
+bool RecordHistory() {
+    try {
+        // 展开后的指令回显到终端
+        if (ExpandHistory(Global::command)) {
+            fprintf(stdout, WHITE "%s\n", Global::command.c_str());
+        }
+    }
+    catch (const char *s) {
+        fprintf(stderr, RED "%s", s);
+        return false;
+    }
+    Global::history.Add(Global::command);
+    return true;
+}
+
+bool ReadContinuation(string &line) {
+    // 行编辑器和 DisplayPrompt 都显示 Global::prompt，读入期间临时换成 PS2
+    const string *ps2 = Global::variables.Value("PS2");
+    string prompt = (ps2 != nullptr) ? *ps2 : "> ";
+    size_t prompt_width = DisplayWidth(prompt.data(), prompt.size());
+    swap(Global::prompt, prompt);
+    swap(Global::prompt_width, prompt_width);
+
+    bool has_line;
+    if (Global::use_editor) {
+        has_line = Global::editor.ReadLine(line, true) && !Global::editor.Cancelled();
+    }
+    else if (Global::script_cache.Active()) {
+        has_line = Global::script_cache.Next(line);
+    }
+    else {
+        DisplayPrompt();
+        has_line = Global::input.ReadLine(line);
+    }
+
+    swap(Global::prompt, prompt);
+    swap(Global::prompt_width, prompt_width);
+    if (has_line && Global::is_interactive) {
+        Global::history.Add(line);
+    }
+    return has_line;
+}
+
+string FindCommand(string_view name) {
+    // 含有'/'的指令是路径，不查找 PATH
+    if (name.find('/') != string_view::npos) {
+        return string(name);
+    }
+
+    // 命中缓存
+    string key(name);
+    auto entry = Global::command_hash.find(key);
+    if (entry != Global::command_hash.end()) {
+        entry->second.hits++;
+        return entry->second.path;
+    }
+
+    // 依次在 PATH 的每个目录中查找可执行的普通文件，空目录表示当前目录
+    const string *path_env = Global::variables.Value("PATH");
+    string path_list = (path_env != nullptr) ? *path_env : "/usr/local/bin:/usr/bin:/bin";
+    size_t begin = 0;
+    while (begin <= path_list.size()) {
+        size_t end = path_list.find(':', begin);
+        if (end == string::npos) {
+            end = path_list.size();
+        }
+
+        string candidate = (end == begin) ? "." : path_list.substr(begin, end - begin);
+        candidate += '/';
+        candidate += name;
+
+        struct stat file_info{};
+        if (stat(candidate.c_str(), &file_info) == 0 && S_ISREG(file_info.st_mode) &&
+            access(candidate.c_str(), X_OK) == 0) {
+            Global::command_hash[key] = {candidate, 1};
+            return candidate;
+        }
+        begin = end + 1;
+    }
+    return "";
+}
+
+bool IsExternal(string_view name) {
+    return FindBuiltin(name) == nullptr && Global::functions.find(name) == Global::functions.end();
+}
+
+size_t ParseRedirectOperator(string_view token, Redirection &redirect) {
+    size_t i = 0;
+    while (i < token.size() && isdigit(static_cast<unsigned char>(token[i]))) {
+        i++;
+    }
+    bool has_fd = i > 0;
+    int fd = has_fd ? atoi(string(token.substr(0, i)).c_str()) : -1;
+    string_view op = token.substr(i);
+
+    redirect.src_fd = -1;
+    redirect.flags = 0;
+    if (op.substr(0, 3) == "<<<") {
+        redirect.kind = Redirection::STRING;
+        redirect.fd = has_fd ? fd : STDIN_FILENO;
+        return i + 3;
+    }
+    else if (!has_fd && (op.substr(0, 3) == "&>>" || op.substr(0, 2) == "&>")) {
+        // 标准输出和错误输出都重定向到文件，fd 为 -1 表示两者
+        bool append = op.substr(0, 3) == "&>>";
+        redirect.kind = Redirection::OPEN;
+        redirect.fd = -1;
+        redirect.flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+        return append ? 3 : 2;
+    }
+    else if (op.substr(0, 2) == ">>") {
+        redirect.kind = Redirection::OPEN;
+        redirect.fd = has_fd ? fd : STDOUT_FILENO;
+        redirect.flags = O_WRONLY | O_CREAT | O_APPEND;
+        return i + 2;
+    }
+    else if (!op.empty() && (op[0] == '>' || op[0] == '<')) {
+        bool output = op[0] == '>';
+        redirect.kind = Redirection::OPEN;
+        redirect.fd = has_fd ? fd : (output ? STDOUT_FILENO : STDIN_FILENO);
+        redirect.flags = output ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+        // n>&m、n<&m、n>&-
+        if (op.size() >= 2 && op[1] == '&') {
+            string_view target = op.substr(2);
+            if (target == "-") {
+                redirect.kind = Redirection::CLOSE;
+                return token.size();
+            }
+            if (!target.empty() && all_of(target.begin(), target.end(),
+                                          [](char c) { return isdigit(static_cast<unsigned char>(c)); })) {
+                redirect.kind = Redirection::DUP;
+                redirect.src_fd = atoi(string(target).c_str());
+                return token.size();
+            }
+            return 0;
+        }
+        return i + 1;
+    }
+    return 0;
+}
+
+RedirectPlan PlanRedirect(const CommandNode &command) {
+    RedirectPlan plan;
+
+    // 复合指令只有重定向，其中的单词由各自的执行函数展开
+    if (command.kind == CommandNode::SIMPLE) {
+        plan.assigns.assign(command.assigns.begin(), command.assigns.end());
+        plan.argv.reserve(command.words.size());
+        for (auto &word: command.words) {
+            if (ExpandListWord(word, plan.argv)) {
+                continue;
+            }
+            pmr::string value = Parse2Value(word);
+            // 没有引号且展开为空的单词不作为参数
+            if (!value.empty() || word.find_first_of("'\"") != string_view::npos) {
+                plan.argv.push_back(move(value));
+            }
+        }
+    }
+
+    for (auto &[redirect, target]: command.redirects) {
+        // 就地构造，text 使用单行内存池，展开结果直接移入
+        Redirection &item = plan.items.emplace_back();
+        item.kind = redirect.kind;
+        item.fd = redirect.fd;
+        item.flags = redirect.flags;
+        item.src_fd = redirect.src_fd;
+        if (item.kind == Redirection::OPEN || item.kind == Redirection::STRING) {
+            item.text = Parse2Value(target);
+        }
+
+        // &> file 等价于 > file 2>&1
+        if (item.fd == -1) {
+            item.fd = STDOUT_FILENO;
+            Redirection &dup = plan.items.emplace_back();
+            dup.kind = Redirection::DUP;
+            dup.fd = STDERR_FILENO;
+            dup.flags = 0;
+            dup.src_fd = STDOUT_FILENO;
+        }
+    }
+    return plan;
+}
+
+int MakeHereString(const pmr::string &text) {
+    int fd = memfd_create("here-string", MFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    pmr::string content = text + "\n";
+    if (write(fd, content.data(), content.size()) != (ssize_t) content.size()) {
+        close(fd);
+        return -1;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+void ApplyRedirection(const Redirection &redirect) {
+    static char err[BUFFER_SIZE];
+    int fd = -1;
+
+    switch (redirect.kind) {
+        case Redirection::OPEN:
+            fd = open(redirect.text.c_str(), redirect.flags | O_CLOEXEC, 0666);
+            if (fd < 0) {
+                snprintf(err, BUFFER_SIZE, "MyShell: cannot access %s\n", redirect.text.c_str());
+                Global::last_status = 1;
+                throw (const char *) err;
+            }
+            break;
+        case Redirection::STRING:
+            fd = MakeHereString(redirect.text);
+            if (fd < 0) {
+                throw "MyShell: cannot create here-string\n";
+            }
+            break;
+        case Redirection::DUP:
+            if (dup2(redirect.src_fd, redirect.fd) < 0) {
+                snprintf(err, BUFFER_SIZE, "MyShell: %d: bad file descriptor\n", redirect.src_fd);
+                Global::last_status = 1;
+                throw (const char *) err;
+            }
+            return;
+        case Redirection::CLOSE:
+            close(redirect.fd);
+            return;
+    }
+
+    if (fd != redirect.fd) {
+        dup2(fd, redirect.fd);
+        close(fd);
+    }
+}
+
+void AddRedirectActions(const RedirectPlan &plan, posix_spawn_file_actions_t *actions, vector<int> &temp_fds) {
+    for (auto &redirect: plan.items) {
+        switch (redirect.kind) {
+            case Redirection::OPEN:
+                // 输入文件在父进程中先检查，错误信息能指出是哪个文件
+                if ((redirect.flags & O_ACCMODE) == O_RDONLY && access(redirect.text.c_str(), R_OK) != 0) {
+                    static char err[BUFFER_SIZE];
+                    snprintf(err, BUFFER_SIZE, "MyShell: cannot access %s\n", redirect.text.c_str());
+                    Global::last_status = 1;
+                    throw (const char *) err;
+                }
+                posix_spawn_file_actions_addopen(actions, redirect.fd, redirect.text.c_str(), redirect.flags, 0666);
+                break;
+            case Redirection::DUP:
+                posix_spawn_file_actions_adddup2(actions, redirect.src_fd, redirect.fd);
+                break;
+            case Redirection::CLOSE:
+                posix_spawn_file_actions_addclose(actions, redirect.fd);
+                break;
+            case Redirection::STRING: {
+                int fd = MakeHereString(redirect.text);
+                if (fd < 0) {
+                    throw "MyShell: cannot create here-string\n";
+                }
+                temp_fds.push_back(fd);
+                posix_spawn_file_actions_adddup2(actions, fd, redirect.fd);
+                break;
+            }
+        }
+    }
+}
+
+AssignmentGuard::AssignmentGuard(const RedirectPlan &plan) {
+    // 没有指令，直接修改 MyShell 的变量
+    if (plan.argv.empty()) {
+        for (auto &word: plan.assigns) {
+            ApplyAssignment(word);
+        }
+        return;
+    }
+
+    try {
+        for (auto &word: plan.assigns) {
+            string_view name = word.substr(0, AssignmentLength(word));
+            name = name.substr(0, name.find('['));
+            saved.push_back(Global::variables.Intern(name));
+            ApplyAssignment(word);
+            Global::variables.SetFlags(name, VAR_EXPORT, true);
+        }
+    }
+    catch (...) {
+        Restore();
+        throw;
+    }
+}
+
+AssignmentGuard::~AssignmentGuard() {
+    Restore();
+}
+
+void AssignmentGuard::Restore() {
+    for (auto var = saved.rbegin(); var != saved.rend(); var++) {
+        Global::variables.Restore(*var);
+    }
+    saved.clear();
+}
+
+RedirectGuard::RedirectGuard(const RedirectPlan &plan) {
+    fflush(stdout); // 重定向前写出缓冲区中属于原输出的内容
+    try {
+        for (auto &redirect: plan.items) {
+            // 每个描述符只在第一次被重定向前备份，备份不会被子进程继承
+            bool is_saved = false;
+            for (auto &entry: saved) {
+                is_saved = is_saved || entry.first == redirect.fd;
+            }
+            if (!is_saved) {
+                saved.emplace_back(redirect.fd, fcntl(redirect.fd, F_DUPFD_CLOEXEC, 10));
+            }
+            ApplyRedirection(redirect);
+        }
+    }
+    catch (const char *s) {
+        // 构造函数抛出异常时不会调用析构函数，在这里恢复已经应用的部分
+        Restore();
+        throw;
+    }
+}
+
+RedirectGuard::~RedirectGuard() {
+    Restore();
+}
+
+void RedirectGuard::Restore() {
+    fflush(stdout); // 恢复前写出缓冲区中属于重定向目标的内容
+    for (auto entry = saved.rbegin(); entry != saved.rend(); entry++) {
+        if (entry->second >= 0) {
+            dup2(entry->second, entry->first);
+            close(entry->second);
+        }
+        else {
+            close(entry->first);
+        }
+    }
+    saved.clear();
+}
+
+pid_t SpawnCommand(const ArgList&cmd_token, const posix_spawn_file_actions_t *actions, pid_t pgid) {
+    // 在父进程中查找路径，缓存得以保留
+    string path = FindCommand(*cmd_token.begin());
+    if (path.empty()) {
+        static char err[BUFFER_SIZE];
+        snprintf(err, BUFFER_SIZE, "MyShell: %s: command not found\n", cmd_token.begin()->c_str());
+        Global::last_status = 127;
+        throw (const char *) err;
+    }
+
+    pmr::vector<char *> args(&Global::line_arena);
+    for (auto &token: cmd_token) {
+        args.push_back(const_cast<char *>(token.c_str()));
+    }
+    args.push_back(nullptr);
+
+    // 子进程中恢复默认的信号处理并清空信号屏蔽字
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t default_signals, empty_mask;
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGINT);
+    sigaddset(&default_signals, SIGTSTP);
+    sigaddset(&default_signals, SIGCHLD);
+    sigaddset(&default_signals, SIGTTOU);
+    sigemptyset(&empty_mask);
+    posix_spawnattr_setsigdefault(&attr, &default_signals);
+    posix_spawnattr_setsigmask(&attr, &empty_mask);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if (pgid != INVALID_PID) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    // 直接使用变量表维护的环境变量表，启动期间持有快照
+    shared_ptr<const EnvSnapshot> env = Global::variables.Snapshot();
+    char *const *envp = env->envp.data();
+
+    fflush(stdout); // 避免缓冲区中的内容与子进程的输出乱序
+    pid_t pid;
+    int err = posix_spawn(&pid, path.c_str(), actions, &attr, args.data(), envp);
+
+    // 缓存的路径已经失效，清除后重新搜索 PATH；重定向的文件不存在时不清除
+    if (err == ENOENT && access(path.c_str(), F_OK) != 0 && Global::command_hash.erase(string(*cmd_token.begin()))) {
+        path = FindCommand(*cmd_token.begin());
+        if (!path.empty()) {
+            err = posix_spawn(&pid, path.c_str(), actions, &attr, args.data(), envp);
+        }
+    }
+    posix_spawnattr_destroy(&attr);
+
+    if (err != 0) {
+        static char msg[BUFFER_SIZE];
+        snprintf(msg, BUFFER_SIZE, "MyShell: %s: %s\n", cmd_token.begin()->c_str(), strerror(err));
+        Global::last_status = 126;
+        throw (const char *) msg;
+    }
+    return pid;
+}
+
+bool TestExpression::Evaluate() {
+    if (pos >= end) {
+        return false;
+    }
+    bool result = Or();
+    if (pos < end) {
+        Error("%s: too many arguments\n");
+    }
+    return result;
+}
+
+bool TestExpression::Or() {
+    bool result = And();
+    while (pos < end && args[pos] == "-o") {
+        pos++;
+        // 右侧总要解析，不能短路
+        bool rhs = And();
+        result = result || rhs;
+    }
+    return result;
+}
+
+bool TestExpression::And() {
+    bool result = Not();
+    while (pos < end && args[pos] == "-a") {
+        pos++;
+        bool rhs = Not();
+        result = result && rhs;
+    }
+    return result;
+}
+
+bool TestExpression::Not() {
+    // 最后一个参数是 ! 时作为字符串
+    if (pos + 1 < end && args[pos] == "!") {
+        pos++;
+        return !Not();
+    }
+    return Primary();
+}
+
+bool TestExpression::Primary() {
+    if (pos >= end) {
+        Error("%s: argument expected\n");
+    }
+    const pmr::string &arg = args[pos];
+
+    // 第二个参数是二元运算符时优先作为二元运算，[ "(" = "(" ] 比较的是字符串
+    if (pos + 2 < end && IsBinary(args[pos + 1])) {
+        pos += 3;
+        return Binary(args[pos - 3], args[pos - 2], args[pos - 1]);
+    }
+    // 括号
+    if (arg == "(" && pos + 1 < end) {
+        pos++;
+        bool result = Or();
+        if (pos >= end || args[pos] != ")") {
+            Error("%s: `)' expected\n");
+        }
+        pos++;
+        return result;
+    }
+    // 一元运算符，-a、-o 之前没有操作数时也按选项处理
+    if (arg.size() == 2 && arg[0] == '-' && pos + 1 < end) {
+        pos += 2;
+        return Unary(arg, args[pos - 1]);
+    }
+    // 单个字符串，不为空时为真
+    pos++;
+    return !arg.empty();
+}
+
+bool TestExpression::Unary(const pmr::string &option, const pmr::string &val) const {
+    // 字符串长度不为 0、为 0
+    if (option == "-n") {
+        return !val.empty();
+    }
+    if (option == "-z") {
+        return val.empty();
+    }
+
+    // 文件存在、可读、可写、可执行
+    if (option == "-e") {
+        return access(val.c_str(), F_OK) == 0;
+    }
+    if (option == "-r") {
+        return access(val.c_str(), R_OK) == 0;
+    }
+    if (option == "-w") {
+        return access(val.c_str(), W_OK) == 0;
+    }
+    if (option == "-x") {
+        return access(val.c_str(), X_OK) == 0;
+    }
+
+    // 文件类型，符号链接本身用 lstat 判断，其余跟随链接
+    struct stat file_info{};
+    bool is_link = (option == "-h" || option == "-L");
+    if (!is_link && option != "-s" && option != "-d" && option != "-f" && option != "-c"
+        && option != "-b" && option != "-p" && option != "-S") {
+        Error("%s: %s: invalid option\n", option.c_str());
+    }
+    if ((is_link ? lstat(val.c_str(), &file_info) : stat(val.c_str(), &file_info)) != 0) {
+        return false;
+    }
+    switch (option[1]) {
+        case 's': // 不为空
+            return file_info.st_size > 0;
+        case 'd': // 目录
+            return S_ISDIR(file_info.st_mode);
+        case 'f': // 普通文件
+            return S_ISREG(file_info.st_mode);
+        case 'c': // 字符型特殊文件
+            return S_ISCHR(file_info.st_mode);
+        case 'b': // 块特殊文件
+            return S_ISBLK(file_info.st_mode);
+        case 'p': // 命名管道
+            return S_ISFIFO(file_info.st_mode);
+        case 'S': // 套接字
+            return S_ISSOCK(file_info.st_mode);
+        default: // 符号链接
+            return S_ISLNK(file_info.st_mode);
+    }
+}
+
+bool TestExpression::Binary(const pmr::string &val1, const pmr::string &option, const pmr::string &val2) const {
+    // 字符串比较
+    if (option == "=" || option == "==") {
+        return val1 == val2;
+    }
+    if (option == "!=") {
+        return val1 != val2;
+    }
+
+    // 整数比较
+    long n1 = Integer(val1), n2 = Integer(val2);
+    if (option == "-eq") {
+        return n1 == n2;
+    }
+    if (option == "-ne") {
+        return n1 != n2;
+    }
+    if (option == "-lt") {
+        return n1 < n2;
+    }
+    if (option == "-le") {
+        return n1 <= n2;
+    }
+    if (option == "-gt") {
+        return n1 > n2;
+    }
+    return n1 >= n2;
+}
+
+bool TestExpression::IsBinary(const pmr::string &option) {
+    static const string_view operators[] = {"=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    return find(std::begin(operators), std::end(operators), option) != std::end(operators);
+}
+
+long TestExpression::Integer(const pmr::string &val) const {
+    // 允许前后的空白
+    const char *begin = val.c_str();
+    char *stop;
+    errno = 0;
+    long n = strtol(begin, &stop, 10);
+    while (isspace(static_cast<unsigned char>(*stop))) {
+        stop++;
+    }
+    if (stop == begin || *stop != '\0' || errno == ERANGE) {
+        Error("%s: %s: integer expression expected\n", val.c_str());
+    }
+    return n;
+}
+
+void TestExpression::Error(const char *format, const char *arg) const {
+    static char err[BUFFER_SIZE];
+    snprintf(err, sizeof(err), format, args.begin()->c_str(), arg);
+    throw (const char *) err;
+}
+
+/* ---------- 词法与语法分析实现 ---------- */
+
+bool IsMetaChar(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '|' || c == '&' || c == ';' || c == '<' || c == '>' ||
+           c == '(' || c == ')';
+}
+
+size_t RedirectLength(string_view rest) {
+    size_t i = 0;
+    while (i < rest.size() && isdigit(static_cast<unsigned char>(rest[i]))) {
+        i++;
+    }
+    string_view op = rest.substr(i);
+    if (i == 0 && op.substr(0, 3) == "&>>") {
+        return 3;
+    }
+    else if (i == 0 && op.substr(0, 2) == "&>") {
+        return 2;
+    }
+    else if (op.substr(0, 3) == "<<<") {
+        return i + 3;
+    }
+    else if (op.substr(0, 2) == ">>") {
+        return i + 2;
+    }
+    else if (op.substr(0, 2) == ">&" || op.substr(0, 2) == "<&") {
+        size_t end = i + 2;
+        if (end < rest.size() && rest[end] == '-') {
+            return end + 1;
+        }
+        while (end < rest.size() && isdigit(static_cast<unsigned char>(rest[end]))) {
+            end++;
+        }
+        return end;
+    }
+    else if (!op.empty() && (op[0] == '<' || op[0] == '>')) {
+        return i + 1;
+    }
+    return 0;
+}
+
+pmr::vector<Token> Tokenize(string_view line) {
+    pmr::vector<Token> tokens(&Global::line_arena);
+    size_t i = 0;
+
+    while (i < line.size()) {
+        char c = line[i];
+        // 跳过空白
+        if (c == ' ' || c == '\t' || c == '\r') {
+            i++;
+            continue;
+        }
+        if (c == '\n') {
+            tokens.push_back({NEWLINE, line.substr(i, 1)});
+            i++;
+            continue;
+        }
+        // 单词开头的'#'之后到行尾是注释
+        if (c == '#') {
+            i = min(line.find('\n', i), line.size());
+            continue;
+        }
+
+        // 运算符
+        bool twice = i + 1 < line.size() && line[i + 1] == c;
+        if (c == '|') {
+            tokens.push_back({twice ? OR_IF : PIPE, line.substr(i, twice ? 2 : 1)});
+            i += twice ? 2 : 1;
+            continue;
+        }
+        if (c == '&' && twice) {
+            tokens.push_back({AND_IF, line.substr(i, 2)});
+            i += 2;
+            continue;
+        }
+        if (c == ';') {
+            tokens.push_back({twice ? DSEMI : SEMI, line.substr(i, twice ? 2 : 1)});
+            i += twice ? 2 : 1;
+            continue;
+        }
+        if (c == '(' || c == ')') {
+            tokens.push_back({c == '(' ? LPAREN : RPAREN, line.substr(i, 1)});
+            i++;
+            continue;
+        }
+        size_t redirect_len = RedirectLength(line.substr(i));
+        if (redirect_len > 0) {
+            tokens.push_back({REDIRECT, line.substr(i, redirect_len)});
+            i += redirect_len;
+            continue;
+        }
+        if (c == '&') {
+            tokens.push_back({AMP, line.substr(i, 1)});
+            i++;
+            continue;
+        }
+
+        // 单词：引号中的空白和运算符不结束单词，引号保留到展开时处理
+        size_t begin = i;
+        while (i < line.size()) {
+            // 数组赋值 NAME=(a b c)，括号中的空白不结束单词
+            if (line[i] == '(' && i > begin && line[i - 1] == '='
+                && AssignmentLength(line.substr(begin, i - begin + 1)) == i - begin - 1) {
+                size_t close = i + 1;
+                while (close < line.size() && line[close] != ')') {
+                    if (line[close] == '\'' || line[close] == '"') {
+                        char quote = line[close++];
+                        while (close < line.size() && line[close] != quote) {
+                            close += (quote == '"' && line[close] == '\\') ? 2 : 1;
+                        }
+                    }
+                    close++;
+                }
+                if (close >= line.size()) {
+                    Global::last_status = 2;
+                    Global::incomplete_input = true;
+                    throw "MyShell: unexpected EOF while looking for matching `)`\n";
+                }
+                i = close + 1;
+            }
+            else if (IsMetaChar(line[i])) {
+                break;
+            }
+            else if (line[i] == '\\') {
+                i = min(i + 2, line.size());
+            }
+                // 算术展开 $((...))，其中的运算符和空白不结束单词
+            else if (line.compare(i, 3, "$((") == 0) {
+                i = ArithmeticEnd(line, i);
+                if (i == string_view::npos) {
+                    Global::last_status = 2;
+                    Global::incomplete_input = true;
+                    throw "MyShell: unexpected EOF while looking for matching `))'\n";
+                }
+            }
+            else if (line[i] == '\'' || line[i] == '"') {
+                char quote = line[i++];
+                while (i < line.size() && line[i] != quote) {
+                    // 双引号中的反斜杠可以转义引号
+                    i += (quote == '"' && line[i] == '\\') ? 2 : 1;
+                }
+                if (i >= line.size()) {
+                    static char err[BUFFER_SIZE];
+                    snprintf(err, BUFFER_SIZE, "MyShell: unexpected EOF while looking for matching `%c`\n", quote);
+                    Global::last_status = 2;
+                    Global::incomplete_input = true;
+                    throw (const char *) err;
+                }
+                i++;
+            }
+            else {
+                i++;
+            }
+        }
+        tokens.push_back({WORD, line.substr(begin, i - begin)});
+    }
+    return tokens;
+}
+
+size_t AssignmentLength(string_view word) {
+    size_t i = 0;
+    while (i < word.size() && (isalnum(static_cast<unsigned char>(word[i])) || word[i] == '_')) {
+        i++;
+    }
+    // 名字不能为空，不能以数字开头
+    if (i == 0 || isdigit(static_cast<unsigned char>(word[0]))) {
+        return 0;
+    }
+    // 数组元素 NAME[index]
+    if (i < word.size() && word[i] == '[') {
+        size_t close = word.find(']', i);
+        if (close == string_view::npos) {
+            return 0;
+        }
+        i = close + 1;
+    }
+    return (i < word.size() && word[i] == '=') ? i : 0;
+}
+
+size_t ArithmeticEnd(string_view text, size_t begin) {
+    int depth = 0;
+    for (size_t i = begin + 3; i < text.size(); i++) {
+        if (text[i] == '(') {
+            depth++;
+        }
+        else if (text[i] == ')') {
+            if (depth > 0) {
+                depth--;
+            }
+            else {
+                return (i + 1 < text.size() && text[i + 1] == ')') ? i + 2 : string_view::npos;
+            }
+        }
+    }
+    return string_view::npos;
+}
+
+string_view SpanOf(string_view first, string_view last) {
+    return {first.data(), static_cast<size_t>(last.data() + last.size() - first.data())};
+}
+
+// 结束复合指令中一个指令列表的保留字
+constexpr string_view TERMINATOR_WORDS[] = {"then", "elif", "else", "fi", "do", "done", "esac", "}"};
+
+// 开始复合指令的保留字
+constexpr string_view COMPOUND_WORDS[] = {"{", "if", "while", "until", "for", "case"};
+
+bool Parser::Peek(TokenKind kind) const {
+    return pos < tokens.size() && tokens[pos].kind == kind;
+}
+
+bool Parser::PeekWord(string_view word) const {
+    return Peek(WORD) && tokens[pos].text == word;
+}
+
+void Parser::Expect(string_view word) {
+    if (!PeekWord(word)) {
+        SyntaxError();
+    }
+    pos++;
+}
+
+bool Parser::AtTerminator() const {
+    if (Peek(RPAREN) || Peek(DSEMI)) {
+        return true;
+    }
+    return Peek(WORD) && find(begin(TERMINATOR_WORDS), end(TERMINATOR_WORDS), tokens[pos].text) != end(TERMINATOR_WORDS);
+}
+
+bool Parser::AtCompound() const {
+    return Peek(WORD) && find(begin(COMPOUND_WORDS), end(COMPOUND_WORDS), tokens[pos].text) != end(COMPOUND_WORDS);
+}
+
+void Parser::SkipNewlines() {
+    while (Peek(NEWLINE)) {
+        pos++;
+    }
+}
+
+void Parser::SyntaxError() const {
+    static char err[BUFFER_SIZE];
+    Global::last_status = 2;
+
+    // 复合指令尚未结束，或以"|"、"&&"、"||"结尾时到达输入末尾，读入下一行后还可以继续
+    if (pos >= tokens.size()) {
+        size_t last = tokens.size();
+        while (last > 0 && tokens[last - 1].kind == NEWLINE) {
+            last--;
+        }
+        TokenKind kind = (last > 0) ? tokens[last - 1].kind : NEWLINE;
+        if (depth > 0 || kind == PIPE || kind == AND_IF || kind == OR_IF) {
+            Global::incomplete_input = true;
+            throw "MyShell: syntax error: unexpected end of file\n";
+        }
+    }
+    string near = (pos < tokens.size() && tokens[pos].kind != NEWLINE) ? string(tokens[pos].text) : "newline";
+    snprintf(err, BUFFER_SIZE, "MyShell: syntax error near unexpected token `%s`\n", near.c_str());
+    throw (const char *) err;
+}
+
+ListNode Parser::ParseList() {
+    ListNode list = ParseBody(false);
+    // 顶层出现了 fi、done 等保留字
+    if (pos < tokens.size()) {
+        SyntaxError();
+    }
+    return list;
+}
+
+ListNode Parser::ParseBody(bool required) {
+    ListNode list;
+    SkipNewlines();
+    while (pos < tokens.size() && !AtTerminator()) {
+        list.items.push_back(ParseAndOr());
+        if (Peek(AMP)) {
+            list.items.rbegin()->background = true;
+            pos++;
+        }
+        else if (Peek(SEMI) || Peek(NEWLINE)) {
+            pos++;
+        }
+        else if (pos < tokens.size() && !AtTerminator()) {
+            SyntaxError();
+        }
+        SkipNewlines();
+    }
+    if (required && list.items.empty()) {
+        SyntaxError();
+    }
+    return list;
+}
+
+AndOrNode Parser::ParseAndOr() {
+    AndOrNode and_or;
+    and_or.pipelines.push_back(ParsePipeline());
+    while (Peek(AND_IF) || Peek(OR_IF)) {
+        and_or.ops.push_back(tokens[pos++].kind);
+        SkipNewlines();
+        and_or.pipelines.push_back(ParsePipeline());
+    }
+    and_or.text = SpanOf(and_or.pipelines.begin()->text, and_or.pipelines.rbegin()->text);
+    return and_or;
+}
+
+PipelineNode Parser::ParsePipeline() {
+    PipelineNode pipeline;
+    if (PeekWord("!")) {
+        pipeline.negate = true;
+        pos++;
+    }
+    pipeline.commands.push_back(ParseCommand());
+    while (Peek(PIPE)) {
+        pos++;
+        SkipNewlines();
+        pipeline.commands.push_back(ParseCommand());
+    }
+    pipeline.text = SpanOf(pipeline.commands.begin()->text, pipeline.commands.rbegin()->text);
+    return pipeline;
+}
+
+CommandNode Parser::ParseCommand() {
+    size_t begin = pos;
+
+    // 函数定义：NAME () 或 function NAME
+    if (PeekWord("function") || (Peek(WORD) && pos + 1 < tokens.size() && tokens[pos + 1].kind == LPAREN)) {
+        return ParseFunction();
+    }
+
+    // 复合指令，之后可以有重定向
+    if (AtCompound()) {
+        CommandNode command = PeekWord("{") ? ParseGroup() : PeekWord("if") ? ParseIf() :
+                              PeekWord("for") ? ParseFor() : PeekWord("case") ? ParseCase() : ParseLoop();
+        while (Peek(REDIRECT)) {
+            ParseRedirect(command);
+        }
+        command.text = SpanOf(tokens[begin].text, tokens[pos - 1].text);
+        return command;
+    }
+
+    // then、fi 等保留字不能作为指令名
+    if (AtTerminator()) {
+        SyntaxError();
+    }
+
+    CommandNode command;
+    while (Peek(WORD) || Peek(REDIRECT)) {
+        if (Peek(WORD)) {
+            // 指令名之前的 NAME=value 是变量赋值
+            if (command.words.empty() && AssignmentLength(tokens[pos].text) > 0) {
+                command.assigns.push_back(tokens[pos++].text);
+            }
+            else {
+                command.words.push_back(tokens[pos++].text);
+            }
+            continue;
+        }
+        ParseRedirect(command);
+    }
+
+    // 空指令，如 "| cat"、"a && && b"
+    if (pos == begin) {
+        SyntaxError();
+    }
+    command.text = SpanOf(tokens[begin].text, tokens[pos - 1].text);
+    return command;
+}
+
+void Parser::ParseRedirect(CommandNode &command) {
+    Redirection redirect{};
+    if (ParseRedirectOperator(tokens[pos].text, redirect) != tokens[pos].text.size()) {
+        SyntaxError();
+    }
+    pos++;
+
+    // 复制和关闭描述符不需要目标，其他重定向的目标是下一个单词
+    string_view target;
+    if (redirect.kind == Redirection::OPEN || redirect.kind == Redirection::STRING) {
+        if (!Peek(WORD)) {
+            SyntaxError();
+        }
+        target = tokens[pos++].text;
+    }
+    command.redirects.emplace_back(redirect, target);
+}
+
+CommandNode Parser::ParseGroup() {
+    CommandNode command;
+    command.kind = CommandNode::GROUP;
+    pos++;
+    depth++;
+    command.parts.push_back(ParseBody(true));
+    Expect("}");
+    depth--;
+    return command;
+}
+
+CommandNode Parser::ParseIf() {
+    CommandNode command;
+    command.kind = CommandNode::IF;
+    pos++;
+    depth++;
+    while (true) {
+        command.parts.push_back(ParseBody(true));
+        Expect("then");
+        command.parts.push_back(ParseBody(true));
+        if (!PeekWord("elif")) {
+            break;
+        }
+        pos++;
+    }
+    if (PeekWord("else")) {
+        pos++;
+        command.parts.push_back(ParseBody(true));
+    }
+    Expect("fi");
+    depth--;
+    return command;
+}
+
+CommandNode Parser::ParseLoop() {
+    CommandNode command;
+    command.kind = PeekWord("while") ? CommandNode::WHILE : CommandNode::UNTIL;
+    pos++;
+    depth++;
+    command.parts.push_back(ParseBody(true));
+    Expect("do");
+    command.parts.push_back(ParseBody(true));
+    Expect("done");
+    depth--;
+    return command;
+}
+
+CommandNode Parser::ParseFor() {
+    CommandNode command;
+    command.kind = CommandNode::FOR;
+    pos++;
+    depth++;
+    if (!Peek(WORD) || !IsIdentifier(tokens[pos].text)) {
+        SyntaxError();
+    }
+    command.words.push_back(tokens[pos++].text);
+    SkipNewlines();
+
+    // 没有 in 时取值为位置参数
+    if (PeekWord("in")) {
+        command.words.push_back(tokens[pos++].text);
+        while (Peek(WORD)) {
+            command.words.push_back(tokens[pos++].text);
+        }
+        if (!Peek(SEMI) && !Peek(NEWLINE)) {
+            SyntaxError();
+        }
+        pos++;
+    }
+    else if (Peek(SEMI)) {
+        pos++;
+    }
+    SkipNewlines();
+    Expect("do");
+    command.parts.push_back(ParseBody(true));
+    Expect("done");
+    depth--;
+    return command;
+}
+
+CommandNode Parser::ParseCase() {
+    CommandNode command;
+    command.kind = CommandNode::CASE;
+    pos++;
+    depth++;
+    if (!Peek(WORD)) {
+        SyntaxError();
+    }
+    command.words.push_back(tokens[pos++].text);
+    SkipNewlines();
+    Expect("in");
+    SkipNewlines();
+
+    // 每个分支：[(] 模式 [| 模式]... ) 指令列表 [;;]，最后一个分支可以省略";;"
+    while (!PeekWord("esac")) {
+        if (Peek(LPAREN)) {
+            pos++;
+        }
+        uint32_t count = 0;
+        while (true) {
+            if (!Peek(WORD)) {
+                SyntaxError();
+            }
+            command.words.push_back(tokens[pos++].text);
+            count++;
+            if (!Peek(PIPE)) {
+                break;
+            }
+            pos++;
+        }
+        if (!Peek(RPAREN)) {
+            SyntaxError();
+        }
+        pos++;
+        command.patterns.push_back(count);
+        command.parts.push_back(ParseBody(false));
+        if (Peek(DSEMI)) {
+            pos++;
+            SkipNewlines();
+        }
+        else if (!PeekWord("esac")) {
+            SyntaxError();
+        }
+    }
+    pos++;
+    depth--;
+    return command;
+}
+
+CommandNode Parser::ParseFunction() {
+    CommandNode command;
+    command.kind = CommandNode::FUNCTION;
+    size_t begin = pos;
+    bool keyword = PeekWord("function");
+    if (keyword) {
+        pos++;
+    }
+
+    // 函数名不能是保留字，不能含引号、展开和'/'
+    if (!Peek(WORD) || AtTerminator() || AtCompound() || PeekWord("function") || PeekWord("!")
+        || tokens[pos].text.find_first_of("'\"\\$=/") != string_view::npos) {
+        SyntaxError();
+    }
+    command.words.push_back(tokens[pos++].text);
+    if (Peek(LPAREN)) {
+        pos++;
+        if (!Peek(RPAREN)) {
+            SyntaxError();
+        }
+        pos++;
+    }
+    else if (!keyword) {
+        SyntaxError();
+    }
+
+    // 函数体是一条复合指令，包括其后的重定向，每次调用时应用
+    depth++;
+    SkipNewlines();
+    if (!AtCompound()) {
+        SyntaxError();
+    }
+    PipelineNode pipeline;
+    pipeline.commands.push_back(ParseCommand());
+    pipeline.text = pipeline.commands.begin()->text;
+    AndOrNode and_or;
+    and_or.text = pipeline.text;
+    and_or.pipelines.push_back(move(pipeline));
+    ListNode body;
+    body.items.push_back(move(and_or));
+    command.parts.push_back(move(body));
+    depth--;
+
+    command.text = SpanOf(tokens[begin].text, tokens[pos - 1].text);
+    return command;
+}
+
+/* ---------- 目录列表实现 ---------- */
+
+// getdents64 返回的目录项，glibc 没有提供定义
+struct LinuxDirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[256];
+};
+
+bool ReadDirectory(int dirfd, const DirOptions &options, DirListing &listing) {
+    alignas(LinuxDirent64) char buf[READ_BLOCK_SIZE];
+    long n;
+
+    // 一次系统调用读取一整块目录项
+    while ((n = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0) {
+        for (long pos = 0; pos < n;) {
+            auto *dirent = reinterpret_cast<LinuxDirent64 *>(buf + pos);
+            pos += dirent->d_reclen;
+
+            const char *name = dirent->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            DirEntry entry;
+            entry.name = listing.names.size();
+            entry.name_len = strlen(name);
+            entry.type = dirent->d_type;
+            listing.names.append(name, entry.name_len + 1);
+            listing.entries.push_back(entry);
+        }
+    }
+    if (n < 0) {
+        return false;
+    }
+
+    // 只对需要的条目调用 fstatat，路径相对于目录的文件描述符，不需要拼接绝对路径
+    bool need_all = options.long_format || options.totals ||
+                    options.sort == DirOptions::BY_SIZE || options.sort == DirOptions::BY_TIME;
+    for (auto &entry: listing.entries) {
+        if (!need_all && entry.type != DT_UNKNOWN && !(options.color && entry.type == DT_REG)) {
+            continue;
+        }
+        struct stat file_info{};
+        if (fstatat(dirfd, listing.Name(entry), &file_info, AT_SYMLINK_NOFOLLOW) == 0) {
+            entry.has_stat = true;
+            entry.type = IFTODT(file_info.st_mode);
+            entry.mode = file_info.st_mode;
+            entry.nlink = file_info.st_nlink;
+            entry.size = file_info.st_size;
+            entry.mtime = file_info.st_mtime;
+        }
+
+        // 长格式显示符号链接指向的路径
+        if (options.long_format && entry.type == DT_LNK) {
+            char target[PATH_MAX];
+            ssize_t len = readlinkat(dirfd, listing.Name(entry), target, sizeof(target));
+            if (len > 0) {
+                entry.link = listing.names.size();
+                entry.link_len = len;
+                listing.names.append(target, len);
+            }
+        }
+    }
+    return true;
+}
+
+void SortDirectory(const DirOptions &options, DirListing &listing) {
+    auto by_name = [&listing](const DirEntry &a, const DirEntry &b) {
+        return strcmp(listing.Name(a), listing.Name(b)) < 0;
+    };
+
+    switch (options.sort) {
+        case DirOptions::BY_NAME:
+            sort(listing.entries.begin(), listing.entries.end(), by_name);
+            break;
+            // 大的在前，相同时按名字
+        case DirOptions::BY_SIZE:
+            sort(listing.entries.begin(), listing.entries.end(), [&by_name](const DirEntry &a, const DirEntry &b) {
+                return a.size != b.size ? a.size > b.size : by_name(a, b);
+            });
+            break;
+            // 新的在前，相同时按名字
+        case DirOptions::BY_TIME:
+            sort(listing.entries.begin(), listing.entries.end(), [&by_name](const DirEntry &a, const DirEntry &b) {
+                return a.mtime != b.mtime ? a.mtime > b.mtime : by_name(a, b);
+            });
+            break;
+            // 保持目录中的顺序
+        case DirOptions::UNSORTED:
+            break;
+    }
+    if (options.reverse) {
+        reverse(listing.entries.begin(), listing.entries.end());
+    }
+}
+
+const char *EntryColor(const DirEntry &entry) {
+    if (entry.type == DT_DIR) {
+        return BLUE;
+    }
+    if (entry.type == DT_REG && (entry.mode & (S_IXUSR | S_IXGRP | S_IXOTH))) {
+        return GREEN;
+    }
+    return WHITE;
+}
+
+size_t DisplayWidth(const char *name, size_t len) {
+    size_t width = 0;
+    for (size_t i = 0; i < len; i++) {
+        width += (name[i] & 0xC0) != 0x80;
+    }
+    return width;
+}
+
+void FormatPrintDir(OutputBuffer &out, const DirOptions &options, const DirListing &listing) {
+    const vector<DirEntry> &entries = listing.entries;
+    if (entries.empty()) {
+        return;
+    }
+
+    // 长格式：类型和权限、硬链接数、大小、修改时间、名字，符号链接显示指向的路径
+    if (options.long_format) {
+        int nlink_width = 1, size_width = 1;
+        for (auto &entry: entries) {
+            nlink_width = max(nlink_width, snprintf(nullptr, 0, "%lu", (unsigned long) entry.nlink));
+            size_width = max(size_width, snprintf(nullptr, 0, "%lld", (long long) entry.size));
+        }
+
+        char line[BUFFER_SIZE];
+        for (auto &entry: entries) {
+            const char *name = listing.Name(entry);
+            char mode[11] = "?---------";
+            static const char type_chars[] = "?pc?d?b?-?l?s";
+            unsigned type = entry.has_stat ? IFTODT(entry.mode) : (unsigned) DT_UNKNOWN;
+            mode[0] = type < sizeof(type_chars) - 1 ? type_chars[type] : '?';
+            static const char perm_chars[] = "rwxrwxrwx";
+            for (int i = 0; i < 9; i++) {
+                if (entry.mode & (1 << (8 - i))) {
+                    mode[i + 1] = perm_chars[i];
+                }
+            }
+
+            char time_text[32] = "";
+            struct tm tm_info{};
+            if (localtime_r(&entry.mtime, &tm_info) != nullptr) {
+                strftime(time_text, sizeof(time_text), "%Y-%m-%d %H:%M", &tm_info);
+            }
+            snprintf(line, sizeof(line), "%s %*lu %*lld %s ", mode,
+                     nlink_width, (unsigned long) entry.nlink,
+                     size_width, (long long) entry.size, time_text);
+            out.Append(line);
+
+            if (options.color) {
+                out.Append(EntryColor(entry));
+            }
+            out.Append(string_view(name, entry.name_len));
+            if (options.color) {
+                out.Append(WHITE);
+            }
+            if (entry.link_len > 0) {
+                out.Append(" -> ");
+                out.Append(string_view(listing.names.data() + entry.link, entry.link_len));
+            }
+            out.Append("\n");
+        }
+        return;
+    }
+
+    // 非终端：每行一个名字，便于管道处理
+    if (!options.columns) {
+        for (auto &entry: entries) {
+            if (options.color) {
+                out.Append(EntryColor(entry));
+            }
+            out.Append(string_view(listing.Name(entry), entry.name_len));
+            out.Append("\n");
+        }
+        if (options.color) {
+            out.Append(WHITE);
+        }
+        return;
+    }
+
+    // 终端：按列排版，先填满一列再换到下一列，列宽为最长名字加两个空格
+    size_t max_width = 0;
+    for (auto &entry: entries) {
+        max_width = max(max_width, DisplayWidth(listing.Name(entry), entry.name_len));
+    }
+    size_t column_width = max_width + 2;
+    size_t columns = max<size_t>(1, options.width / column_width);
+    size_t rows = (entries.size() + columns - 1) / columns;
+    static const string spaces(BUFFER_SIZE, ' ');
+
+    for (size_t row = 0; row < rows; row++) {
+        for (size_t column = 0; column < columns; column++) {
+            size_t i = column * rows + row;
+            if (i >= entries.size()) {
+                break;
+            }
+            const DirEntry &entry = entries[i];
+            if (options.color) {
+                out.Append(EntryColor(entry));
+            }
+            out.Append(string_view(listing.Name(entry), entry.name_len));
+
+            // 不是本行最后一个时补齐列宽
+            if (i + rows < entries.size() && column + 1 < columns) {
+                size_t pad = column_width - DisplayWidth(listing.Name(entry), entry.name_len);
+                out.Append(string_view(spaces.data(), min(pad, spaces.size())));
+            }
+        }
+        out.Append("\n");
+    }
+    if (options.color) {
+        out.Append(WHITE);
+    }
+}
+
+void FilterDirectory(const DirOptions &options, DirListing &listing) {
+    if (options.glob.empty()) {
+        return;
+    }
+    auto end = remove_if(listing.entries.begin(), listing.entries.end(), [&](const DirEntry &entry) {
+        return fnmatch(options.glob.c_str(), listing.Name(entry), 0) != 0;
+    });
+    listing.entries.erase(end, listing.entries.end());
+}
+
+void AppendDirTotals(OutputBuffer &out, const DirListing &listing, DirTotals &totals) {
+    long long bytes = 0;
+    for (auto &entry: listing.entries) {
+        bytes += entry.size;
+    }
+    totals.directories++;
+    totals.entries += listing.entries.size();
+    totals.bytes += bytes;
+
+    char line[BUFFER_SIZE];
+    snprintf(line, sizeof(line), "total: %zu entries, %lld bytes\n", listing.entries.size(), bytes);
+    out.Append(line);
+}
+
+DirWalker::DirWalker(const DirOptions &options) : options(options), queues(max(1u, options.threads)) {}
+
+unique_ptr<DirNode> DirWalker::Walk(int dirfd, const string &path) {
+    auto root = make_unique<DirNode>();
+    root->path = path;
+
+    // 根目录的文件描述符属于调用者，任务中使用副本
+    int fd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+    if (fd >= 0) {
+        open_fds++;
+    }
+    pending = 1;
+    queued = 1;
+    queues[0].tasks.push_back({root.get(), fd});
+
+    // 工作线程屏蔽所有信号，SIGCHLD 等信号仍由主线程处理
+    sigset_t all_mask, old_mask;
+    sigfillset(&all_mask);
+    pthread_sigmask(SIG_BLOCK, &all_mask, &old_mask);
+    vector<thread> workers;
+    for (size_t i = 1; i < queues.size(); i++) {
+        workers.emplace_back(&DirWalker::Worker, this, i);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+
+    Worker(0);
+    for (auto &worker: workers) {
+        worker.join();
+    }
+    return root;
+}
+
+void DirWalker::Worker(size_t self) {
+    Task task{};
+    while (true) {
+        if (Pop(self, task)) {
+            Process(self, task);
+            // 最后一个任务完成，唤醒所有等待的线程退出
+            if (--pending == 0) {
+                lock_guard<mutex> guard(idle_lock);
+                idle.notify_all();
+            }
+            continue;
         }
-            // 输出重定向（覆盖）
-        else if (*pos == ">" || *pos == "1>") {
-            output = *(pos - 1);
-            output_fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
-            if (output_fd == -1) {
-                sprintf(err, "MyShell: cannot access %s\n", output.c_str());
-                throw err;
+        // 其他线程还在处理，可能产生新任务；计数在入队后、加锁唤醒前修改，不会错过唤醒
+        unique_lock<mutex> guard(idle_lock);
+        idle.wait(guard, [this] { return pending == 0 || queued > 0; });
+        if (pending == 0) {
+            return;
+        }
+    }
+}
+
+bool DirWalker::Pop(size_t self, Task &task) {
+    {
+        lock_guard<mutex> guard(queues[self].lock);
+        if (!queues[self].tasks.empty()) {
+            task = queues[self].tasks.back();
+            queues[self].tasks.pop_back();
+            queued--;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); i++) {
+        WorkQueue &victim = queues[(self + i) % queues.size()];
+        lock_guard<mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void DirWalker::Process(size_t self, const Task &task) {
+    DirNode &node = *task.node;
+    int fd = task.fd;
+    if (fd >= 0) {
+        open_fds--;
+    }
+    else if ((fd = open(node.path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+        node.error = errno;
+        return;
+    }
+
+    if (!ReadDirectory(fd, options, node.listing)) {
+        node.error = errno;
+        close(fd);
+        return;
+    }
+    SortDirectory(options, node.listing);
+
+    // 未超过深度限制时，按排序后的顺序为子目录创建节点，不跟随符号链接
+    vector<Task> tasks;
+    if (options.max_depth < 0 || node.depth < options.max_depth) {
+        for (auto &entry: node.listing.entries) {
+            if (entry.type != DT_DIR) {
+                continue;
             }
-            else {
-                dup2(output_fd, STDOUT_FILENO);
-                close(output_fd);
-                last = distance(pos, cmd_token.rend()) - 1;
+            const char *name = node.listing.Name(entry);
+            auto child = make_unique<DirNode>();
+            child->path = node.path + "/" + name;
+            child->depth = node.depth + 1;
+
+            int child_fd = -1;
+            if (open_fds < MAX_OPEN_FDS) {
+                child_fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (child_fd >= 0) {
+                    open_fds++;
+                }
+                    // 文件描述符用完时留到处理时再按路径打开
+                else if (errno != EMFILE && errno != ENFILE) {
+                    child->error = errno;
+                    node.children.push_back(move(child));
+                    continue;
+                }
             }
+            tasks.push_back({child.get(), child_fd});
+            node.children.push_back(move(child));
+        }
+    }
+    close(fd);
+    FilterDirectory(options, node.listing);
+
+    // 先计数再入队，保证其他线程看到 pending 为 0 时已没有任务
+    if (tasks.empty()) {
+        return;
+    }
+    pending += tasks.size();
+    {
+        lock_guard<mutex> guard(queues[self].lock);
+        queues[self].tasks.insert(queues[self].tasks.end(), tasks.rbegin(), tasks.rend());
+        queued += tasks.size();
+    }
+    lock_guard<mutex> guard(idle_lock);
+    idle.notify_all();
+}
+
+void PrintDirTree(OutputBuffer &out, const DirOptions &options, const DirNode &node, DirTotals &totals) {
+    out.Append(node.path);
+    out.Append(": \n");
+    if (node.error != 0) {
+        // 错误信息与已缓冲的输出保持顺序
+        out.Flush();
+        fprintf(stderr, "dir: cannot read directory '%s': %s\n", node.path.c_str(), strerror(node.error));
+    }
+    else {
+        FormatPrintDir(out, options, node.listing);
+        if (options.totals) {
+            AppendDirTotals(out, node.listing, totals);
+        }
+    }
+
+    for (auto &child: node.children) {
+        out.Append("\n");
+        PrintDirTree(out, options, *child, totals);
+    }
+}
+
+void ListDirectory(OutputBuffer &out, const DirOptions &options, int dirfd, const string &path, bool header) {
+    // 递归：并行遍历整棵树后按顺序输出
+    if (options.recursive) {
+        DirWalker walker(options);
+        unique_ptr<DirNode> root = walker.Walk(dirfd, path);
+        DirTotals totals;
+        PrintDirTree(out, options, *root, totals);
+        if (options.totals) {
+            char line[BUFFER_SIZE];
+            snprintf(line, sizeof(line), "\ntotal: %zu directories, %zu entries, %lld bytes\n",
+                     totals.directories, totals.entries, totals.bytes);
+            out.Append(line);
         }
-            // 输出重定向（追加）
-        else if (*pos == ">>" || *pos == "1>>") {
-            output = *(pos - 1);
-            output_fd = open(output.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
-            if (output_fd == -1) {
-                sprintf(err, "MyShell: cannot access %s\n", output.c_str());
-                throw err;
+        return;
+    }
+
+    DirListing listing;
+    if (!ReadDirectory(dirfd, options, listing)) {
+        fprintf(stderr, "dir: cannot read directory '%s': %s\n", path.c_str(), strerror(errno));
+        return;
+    }
+    SortDirectory(options, listing);
+    FilterDirectory(options, listing);
+
+    if (header) {
+        out.Append(path);
+        out.Append(": \n");
+    }
+    FormatPrintDir(out, options, listing);
+    if (options.totals) {
+        DirTotals totals;
+        AppendDirTotals(out, listing, totals);
+    }
+}
+
+/* ---------- 指令解释执行实现 ---------- */
+
+void EvaluationEntry() {
+
+    // 批文件的编译缓存中有这条指令的语法树时直接还原，单词指向映射的批文件
+    // 否则词法、语法分析，语法树中的单词指向 Global::command，执行期间不能修改
+    ListNode list;
+    if (!Global::script_cache.Restore(list)) {
+        while (true) {
+            try {
+                Global::incomplete_input = false;
+                pmr::vector<Token> tokens = Tokenize(Global::command);
+                list = Parser(tokens).ParseList();
+                break;
             }
-            else {
-                dup2(output_fd, STDOUT_FILENO);
-                close(output_fd);
-                last = distance(pos, cmd_token.rend()) - 1;
+            catch (const char *s) {
+                // 引号、复合指令尚未结束，读入下一行接在后面重新分析，输入结束时才报错
+                string line;
+                if (!Global::incomplete_input || !ReadContinuation(line)) {
+                    if (!Global::editor.Cancelled()) {
+                        fprintf(stderr, RED "%s", s);
+                    }
+                    return;
+                }
+                Global::command += '\n';
+                Global::command += line;
             }
         }
-            // 错误输出重定向（覆盖）
-        else if (*pos == "2>") {
-            error = *(pos - 1);
-            err_fd = open(error.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
-            if (err_fd == -1) {
-                sprintf(err, "MyShell: cannot access %s\n", error.c_str());
-                throw err;
+    }
+    Global::interrupted = 0;
+    Global::input.Release();
+    EvaluationOfList(list);
+    // 按 Ctrl+C 中断的复合指令中最后执行的可能是内建命令，退出状态统一为被 SIGINT 终止
+    if (Global::interrupted) {
+        Global::last_status = 128 + SIGINT;
+    }
+}
+
+void EvaluationOfList(const ListNode &list) {
+    for (auto &item: list.items) {
+        // break、continue、return 或 Ctrl+C 之后不再执行其余的指令
+        if (Global::control != FLOW_NONE || Global::interrupted) {
+            break;
+        }
+
+        // 后台运行
+        if (item.background) {
+            // 作业表已满时不再创建子进程，避免产生无法管理的作业
+            if (Global::job_count >= Global::max_jobs) {
+                fprintf(stderr, RED "MyShell: job list is full\n");
+                Global::last_status = 1;
+                continue;
+            }
+
+            fflush(stdout); // 避免缓冲区中的内容被子进程重复输出
+            pid_t pid = fork(); // 创建子进程
+
+            if (pid != 0) { // 父进程
+                setpgid(pid, pid); // 与子进程中的 setpgid 相同，避免竞争
+
+                try {
+                    int id = AddJob({pid}, pid, Global::BACKEND, item.text); // 添加子进程
+
+                    // 打印作业表项
+                    fprintf(stdout, "%s", FormatJobMsg(Global::job_slots[id - 1]).c_str());
+                }
+                catch (const char *s) {
+                    fprintf(stderr, RED "%s", s);
+                }
             }
+                // 子进程执行命令
             else {
-                dup2(err_fd, STDERR_FILENO);
-                close(err_fd);
-                last = distance(pos, cmd_token.rend()) - 1;
+                setpgid(0, 0); // 使子进程单独成为一个进程组，后台进程组自动忽略 Ctrl+Z, Ctrl+C 等信号
+                Global::is_backend = true;
+                Global::exec_in_place = item.pipelines.size() == 1; // 只有一个管道时不需要再 fork
+
+                try {
+                    EvaluationOfAndOr(item);
+                }
+                catch (const char *s) {
+                    fprintf(stderr, RED "%s", s);
+                }
+                exit(Global::last_status); // 后台子进程不能回到解释循环
             }
         }
-            // 错误输出重定向（追加）
-        else if (*pos == "2>") {
-            error = *(pos - 1);
-            err_fd = open(error.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
-            if (err_fd == -1) {
-                sprintf(err, "MyShell: cannot access %s\n", error.c_str());
-                throw err;
+            // 没有'&'，前台运行
+        else {
+            try {
+                EvaluationOfAndOr(item);
             }
-            else {
-                dup2(err_fd, STDERR_FILENO);
-                close(err_fd);
-                last = distance(pos, cmd_token.rend()) - 1;
+            catch (const char *s) {
+                fprintf(stderr, RED "%s", s);
             }
         }
     }
+}
 
-    // 最后一步，直接执行
-    Execute(vector<string>(cmd_token.begin(), cmd_token.begin() + last));
-
-    // 恢复标准输入输出
-    dup2(old_input_fd, STDIN_FILENO);
-    close(old_input_fd);
-    dup2(old_output_fd, STDOUT_FILENO);
-    close(old_output_fd);
-    dup2(old_error_fd, STDERR_FILENO);
-    close(old_error_fd);
+void EvaluationOfAndOr(const AndOrNode &and_or) {
+    for (size_t i = 0; i < and_or.pipelines.size(); i++) {
+        // "&&" 前的管道失败、"||" 前的管道成功时跳过，$? 保持不变
+        if (i > 0 && (and_or.ops[i - 1] == AND_IF) != (Global::last_status == 0)) {
+            continue;
+        }
+        EvaluationOfPipe(and_or.pipelines[i]);
+        StorePipeStatus();
+        if (Global::control != FLOW_NONE || Global::interrupted) {
+            return;
+        }
+        if (and_or.pipelines[i].negate) {
+            Global::last_status = (Global::last_status == 0) ? 1 : 0;
+        }
+    }
 }
 
-void Execute(const vector<string>&cmd_token) {
+void EvaluationOfPipe(const PipelineNode &pipeline) {
+    const pmr::vector<CommandNode> &stages = pipeline.commands;
+    Global::job_command.assign(pipeline.text); // 复用已有的容量
 
-    /* 单条指令直接执行 */
-    if (*cmd_token.begin() == "cd") {
+    // 没有管道符，直接进入第四步
+    if (stages.size() == 1) {
         try {
-            cd(cmd_token);
+            EvaluationOfRedirect(*stages.begin());
         }
         catch (const char *s) {
             fprintf(stderr, RED "%s", s);
         }
+        return;
     }
-    else if (*cmd_token.begin() == "clr") {
+
+    /* 由 MyShell 直接创建每一段，所有段放在同一个进程组中
+     * 后台子进程中的管道沿用后台子进程的进程组
+     */
+    bool own_group = !Global::is_backend && Global::is_interactive;
+    pid_t pgid = own_group ? 0 : INVALID_PID;
+    vector<pid_t> pid_list; // 子进程 pid 列表
+    vector<int> launch_status; // 启动失败或在父进程中执行的段的退出状态，创建了子进程为 -1
+    int in_fd = STDIN_FILENO; // 当前段的输入
+
+    for (size_t i = 0; i < stages.size(); i++) {
+        // 除最后一段外，输出到新管道；管道带 O_CLOEXEC，exec 后不会泄漏到其他段
+        int pipe_fd[2]{-1, STDOUT_FILENO};
+        if (i + 1 < stages.size() && pipe2(pipe_fd, O_CLOEXEC) < 0) {
+            fprintf(stderr, RED "MyShell: pipe: %s\n", strerror(errno));
+            break;
+        }
+
+        pid_t pid = INVALID_PID;
         try {
-            clear(cmd_token);
+            pid = LaunchStage(stages[i], in_fd, pipe_fd[1], pipe_fd[0], pgid);
         }
         catch (const char *s) {
             fprintf(stderr, RED "%s", s);
         }
-    }
-    else if (*cmd_token.begin() == "echo") {
-        try {
-            echo(cmd_token);
+
+        if (pid != INVALID_PID) {
+            if (own_group) {
+                // 父进程中同样设置进程组，避免子进程尚未设置时交出终端
+                if (pgid == 0) {
+                    pgid = pid;
+                }
+                setpgid(pid, pgid);
+            }
+            pid_list.push_back(pid);
+            launch_status.push_back(-1);
         }
-        catch (const char *s) {
-            fprintf(stderr, RED "%s", s);
+        else {
+            launch_status.push_back(Global::last_status);
+        }
+
+        // 父进程不保留任何管道端口，只留下一段的输入
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        if (pipe_fd[1] != STDOUT_FILENO) {
+            close(pipe_fd[1]);
         }
+        in_fd = pipe_fd[0];
+    }
+    if (in_fd >= 0 && in_fd != STDIN_FILENO) {
+        close(in_fd);
+    }
+
+    // 等待所有段完成，启动失败或在父进程中执行的段保留其退出状态
+    if (!pid_list.empty()) {
+        WaitForeground(pid_list, own_group ? pgid : INVALID_PID);
+    }
+    vector<int> status;
+    auto waited = Global::pipe_status.begin();
+    for (auto &launched: launch_status) {
+        status.push_back(launched >= 0 || pid_list.empty() ? launched : *waited++);
+    }
+    Global::pipe_status = status;
+    Global::last_status = *Global::pipe_status.rbegin();
+}
+
+void StorePipeStatus() {
+    // 变量的地址在整个运行期间不变，只查找一次
+    static Variable &var = Global::variables.Intern("PIPESTATUS");
+    vector<string> elements;
+    elements.reserve(Global::pipe_status.size());
+    for (int status: Global::pipe_status) {
+        elements.push_back(to_string(status));
     }
-    else if (*cmd_token.begin() == "pwd") {
+    Global::variables.AssignArray(var, move(elements));
+}
+
+pid_t LaunchStage(const CommandNode &stage, int in_fd, int out_fd, int close_fd, pid_t pgid) {
+    // 外部指令直接 posix_spawn，先由文件操作连接管道，再应用该段自己的重定向
+    RedirectPlan plan = PlanRedirect(stage);
+    if (!plan.argv.empty() && IsExternal(*plan.argv.begin())) {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (in_fd != STDIN_FILENO) {
+            posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+        }
+        if (out_fd != STDOUT_FILENO) {
+            posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+        }
+        vector<int> temp_fds;
         try {
-            pwd(cmd_token);
+            AssignmentGuard assignments(plan);
+            AddRedirectActions(plan, &actions, temp_fds);
+            pid_t pid = SpawnCommand(plan.argv, &actions, pgid);
+            for (auto &fd: temp_fds) {
+                close(fd);
+            }
+            posix_spawn_file_actions_destroy(&actions);
+            return pid;
         }
         catch (const char *s) {
-            fprintf(stderr, RED "%s", s);
+            for (auto &fd: temp_fds) {
+                close(fd);
+            }
+            posix_spawn_file_actions_destroy(&actions);
+            throw;
         }
     }
-    else if (*cmd_token.begin() == "exit") {
-        exit(cmd_token);
+
+    // 按内建命令的属性决定：只产生输出的命令作为最后一段时在父进程中执行，修改状态的命令给出警告
+    const Builtin *builtin = (stage.kind == CommandNode::SIMPLE && !plan.argv.empty())
+                             ? FindBuiltin(*plan.argv.begin()) : nullptr;
+    if (builtin != nullptr && builtin->flags == PIPE_SAFE && out_fd == STDOUT_FILENO) {
+        AssignmentGuard assignments(plan);
+        RedirectGuard guard(plan);
+        Execute(plan.argv);
+        return INVALID_PID;
+    }
+    if (builtin != nullptr && (builtin->flags & (RUN_IN_PARENT | PIPE_SAFE)) == RUN_IN_PARENT) {
+        fprintf(stderr, RED "MyShell: %s: has no effect in a pipeline\n", plan.argv.begin()->c_str());
+    }
+
+    // 内建命令、函数和复合指令需要在子进程中解释，只能 fork
+    fflush(stdout); // 避免缓冲区中的内容被子进程重复输出
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw "MyShell: fork failed\n";
     }
-    else if (*cmd_token.begin() == "time") {
+    if (pid == 0) {
+        if (pgid != INVALID_PID) {
+            setpgid(0, pgid);
+        }
+
+        // 将信号处理函数恢复至系统默认
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+
+        // 连接管道，关闭不需要的端口
+        if (in_fd != STDIN_FILENO) {
+            dup2(in_fd, STDIN_FILENO);
+            close(in_fd);
+        }
+        if (out_fd != STDOUT_FILENO) {
+            dup2(out_fd, STDOUT_FILENO);
+            close(out_fd);
+        }
+        if (close_fd >= 0) {
+            close(close_fd);
+        }
+
+        Global::is_backend = true;
+        Global::exec_in_place = true; // 子进程中的外部指令直接 exec，不再 fork
+        Global::last_status = 0;
         try {
-            time(cmd_token);
+            // 子进程中直接应用赋值和重定向，不需要恢复
+            AssignmentGuard assignments(plan);
+            for (auto &redirect: plan.items) {
+                ApplyRedirection(redirect);
+            }
+            if (stage.kind != CommandNode::SIMPLE) {
+                EvaluationOfCompound(stage);
+            }
+            else if (!plan.argv.empty()) {
+                Execute(plan.argv);
+            }
         }
         catch (const char *s) {
-            fprintf(stderr, RED "%s", s);
+            fprintf(stderr, RED"%s", s);
+            Global::last_status = 1;
         }
+        fflush(stdout);
+        exit(Global::last_status);
     }
-    else if (*cmd_token.begin() == "umask") {
-        try {
-            umask(cmd_token);
+    return pid;
+}
+
+void EvaluationOfRedirect(const CommandNode &command) {
+    RedirectPlan plan = PlanRedirect(command);
+    AssignmentGuard assignments(plan);
+    bool compound = command.kind != CommandNode::SIMPLE;
+
+    // 没有重定向，不做任何描述符操作
+    if (plan.items.empty()) {
+        if (compound) {
+            EvaluationOfCompound(command);
         }
-        catch (const char *s) {
-            fprintf(stderr, RED "%s", s);
+        else if (!plan.argv.empty()) {
+            Execute(plan.argv);
+        }
+        else {
+            Global::last_status = 0;
         }
+        return;
     }
-    else if (*cmd_token.begin() == "dir") {
-        try {
-            dir(cmd_token);
+
+    // 子进程中的最后一条指令（管道中的内建命令、后台命令），直接应用，不需要恢复
+    if (Global::exec_in_place) {
+        for (auto &redirect: plan.items) {
+            ApplyRedirection(redirect);
         }
-        catch (const char *s) {
-            fprintf(stderr, RED "%s", s);
+        if (compound) {
+            EvaluationOfCompound(command);
+        }
+        else if (!plan.argv.empty()) {
+            Execute(plan.argv);
         }
     }
-    else if (*cmd_token.begin() == "exec") {
-        try {
-            exec(cmd_token);
+        // 外部指令由 posix_spawn 在子进程中应用重定向
+    else if (!plan.argv.empty() && IsExternal(*plan.argv.begin())) {
+        Execute(plan.argv, &plan);
+    }
+        // 父进程中的内建命令、函数和复合指令，临时重定向，离开作用域时恢复
+    else {
+        RedirectGuard guard(plan);
+        if (compound) {
+            EvaluationOfCompound(command);
         }
-        catch (const char *s) {
-            fprintf(stderr, RED "%s", s);
+        else if (!plan.argv.empty()) {
+            Execute(plan.argv);
         }
     }
-    else if (*cmd_token.begin() == "set") {
-        try {
-            set(cmd_token);
+}
+
+void EvaluationOfCompound(const CommandNode &command) {
+    // 复合指令中的指令都不是子进程要执行的最后一条指令，外部指令仍需启动子进程
+    bool in_place = Global::exec_in_place;
+    Global::exec_in_place = false;
+    Global::compound_depth++;
+    try {
+        switch (command.kind) {
+            case CommandNode::GROUP:
+                EvaluationOfList(*command.parts.begin());
+                break;
+            case CommandNode::IF:
+                EvaluationOfIf(command);
+                break;
+            case CommandNode::WHILE:
+            case CommandNode::UNTIL:
+                EvaluationOfLoop(command);
+                break;
+            case CommandNode::FOR:
+                EvaluationOfFor(command);
+                break;
+            case CommandNode::CASE:
+                EvaluationOfCase(command);
+                break;
+            case CommandNode::FUNCTION:
+                DefineFunction(command);
+                break;
+            default:
+                break;
         }
-        catch (const char *s) {
-            fprintf(stderr, RED "%s", s);
+    }
+    catch (const char *s) {
+        Global::exec_in_place = in_place;
+        Global::compound_depth--;
+        throw;
+    }
+    Global::exec_in_place = in_place;
+    Global::compound_depth--;
+}
+
+void EvaluationOfIf(const CommandNode &command) {
+    const pmr::vector<ListNode> &parts = command.parts;
+    for (size_t i = 0; i + 1 < parts.size(); i += 2) {
+        EvaluationOfList(parts[i]);
+        if (Global::control != FLOW_NONE || Global::interrupted) {
+            return;
+        }
+        if (Global::last_status == 0) {
+            EvaluationOfList(parts[i + 1]);
+            return;
         }
     }
-    else if (*cmd_token.begin() == "test") {
-        try {
-            test(cmd_token);
+    // 条件都不成立时执行 else 分支，没有 else 分支时退出状态为 0
+    if (parts.size() % 2 == 1) {
+        EvaluationOfList(*parts.rbegin());
+    }
+    else {
+        Global::last_status = 0;
+    }
+}
+
+void EvaluationOfLoop(const CommandNode &command) {
+    bool until = command.kind == CommandNode::UNTIL;
+    int status = 0; // 最后一次执行循环体的退出状态，没有执行时为 0
+    ScratchArena::Mark mark = Global::line_arena.Position();
+    Global::loop_depth++;
+    while (true) {
+        EvaluationOfList(command.parts[0]);
+        bool finished = Global::control == FLOW_NONE && (Global::last_status == 0) == until;
+        if (!finished && Global::control == FLOW_NONE) {
+            EvaluationOfList(command.parts[1]);
+            status = Global::last_status;
         }
-        catch (const char *s) {
-            fprintf(stderr, RED "%s", s);
+        // 这一轮展开的参数、重定向计划都已不再使用
+        Global::line_arena.Rewind(mark);
+        if (finished || EndOfIteration()) {
+            break;
         }
     }
-    else if (*cmd_token.begin() == "help") {
-        try {
-            help(cmd_token);
+    Global::loop_depth--;
+    Global::last_status = status;
+}
+
+void EvaluationOfFor(const CommandNode &command) {
+    // 展开方式与指令参数相同，没有 in 时为所有位置参数
+    ArgList values(&Global::line_arena);
+    if (command.words.size() == 1) {
+        values.assign(Global::argv.begin() + 1, Global::argv.end());
+    }
+    for (size_t i = 2; i < command.words.size(); i++) {
+        string_view word = command.words[i];
+        if (ExpandListWord(word, values)) {
+            continue;
         }
-        catch (const char *s) {
-            fprintf(stderr, RED "%s", s);
+        pmr::string value = Parse2Value(word);
+        if (!value.empty() || word.find_first_of("'\"") != string_view::npos) {
+            values.push_back(move(value));
         }
     }
-    else if (*cmd_token.begin() == "bg") {
-        try {
-            bg(cmd_token);
+
+    // 变量的地址不变，每轮直接赋值，不再查找变量表
+    Variable &var = Global::variables.Intern(*command.words.begin());
+    int status = 0;
+    ScratchArena::Mark mark = Global::line_arena.Position();
+    Global::loop_depth++;
+    for (auto &value: values) {
+        Global::variables.Assign(var, value);
+        EvaluationOfList(command.parts[0]);
+        status = Global::last_status;
+        Global::line_arena.Rewind(mark);
+        if (EndOfIteration()) {
+            break;
         }
-        catch (const char *s) {
-            fprintf(stderr, RED "%s", s);
+    }
+    Global::loop_depth--;
+    Global::last_status = status;
+}
+
+void EvaluationOfCase(const CommandNode &command) {
+    pmr::string subject = Parse2Value(*command.words.begin());
+    size_t word = 1;
+    for (size_t i = 0; i < command.patterns.size(); i++) {
+        // 模式按通配符匹配，引号中的部分按字面匹配，一个分支中任一模式匹配即可
+        bool matched = false;
+        for (uint32_t k = 0; k < command.patterns[i]; k++, word++) {
+            matched = matched || fnmatch(Parse2Value(command.words[word], true).c_str(), subject.c_str(), 0) == 0;
+        }
+        if (matched) {
+            Global::last_status = 0;
+            EvaluationOfList(command.parts[i]);
+            return;
         }
     }
-    else if (*cmd_token.begin() == "fg") {
-        try {
-            fg(cmd_token);
+    Global::last_status = 0;
+}
+
+bool EndOfIteration() {
+    if (Global::interrupted) {
+        return true;
+    }
+    if (Global::control == FLOW_BREAK || Global::control == FLOW_CONTINUE) {
+        // break n、continue n 还要跳出外层循环时保留控制流，由外层循环处理
+        if (--Global::control_count > 0) {
+            return true;
         }
-        catch (const char *s) {
-            fprintf(stderr, RED "%s", s);
+        bool stop = Global::control == FLOW_BREAK;
+        Global::control = FLOW_NONE;
+        return stop;
+    }
+    return Global::control == FLOW_RETURN;
+}
+
+void DefineFunction(const CommandNode &command) {
+    auto function = make_shared<ShellFunction>();
+    function->source.assign(command.text);
+
+    // 语法树节点分配在函数自己的内存池中，词法单元仍在单行内存池中
+    pmr::memory_resource *saved_arena = Global::syntax_arena;
+    Global::syntax_arena = &function->arena;
+    try {
+        pmr::vector<Token> tokens = Tokenize(function->source);
+        ListNode list = Parser(tokens).ParseList();
+        // 缓存还原的语法树中 text 可能不是函数定义
+        if (list.items.size() != 1 || list.items.begin()->pipelines.begin()->commands.begin()->kind != CommandNode::FUNCTION) {
+            throw "MyShell: syntax error in function definition\n";
+        }
+        CommandNode &definition = *list.items.begin()->pipelines.begin()->commands.begin();
+        auto *body = static_cast<ListNode *>(function->arena.allocate(sizeof(ListNode), alignof(ListNode)));
+        function->body = new(body) ListNode(move(*definition.parts.begin()));
+
+        // 同名函数先删除，键指向新函数的源文本
+        string_view name = *definition.words.begin();
+        Global::functions.erase(name);
+        Global::functions.emplace(name, function);
+    }
+    catch (const char *s) {
+        Global::syntax_arena = saved_arena;
+        throw;
+    }
+    Global::syntax_arena = saved_arena;
+    Global::last_status = 0;
+}
+
+void CallFunction(const ShellFunction &function, const ArgList&cmd_token) {
+    if (Global::function_depth >= MAX_FUNCTION_DEPTH) {
+        static char err[BUFFER_SIZE];
+        snprintf(err, sizeof(err), "MyShell: %s: maximum function nesting level exceeded (%u)\n",
+                 cmd_token.begin()->c_str(), MAX_FUNCTION_DEPTH);
+        throw (const char *) err;
+    }
+
+    // $0 不变，调用的参数作为位置参数
+    vector<string> argv;
+    argv.reserve(cmd_token.size());
+    argv.push_back(*Global::argv.begin());
+    argv.insert(argv.end(), cmd_token.begin() + 1, cmd_token.end());
+    swap(Global::argv, argv);
+    unsigned argc = Global::argc;
+    Global::argc = Global::argv.size();
+
+    // 函数中的 break、continue 只作用于函数中的循环
+    unsigned loop_depth = Global::loop_depth;
+    Global::loop_depth = 0;
+    Global::function_depth++;
+    Global::local_scopes.emplace_back();
+
+    EvaluationOfList(*function.body);
+    if (Global::control == FLOW_RETURN) {
+        Global::control = FLOW_NONE;
+    }
+
+    // 按声明的相反顺序恢复 local 变量
+    vector<Variable> &locals = *Global::local_scopes.rbegin();
+    for (auto var = locals.rbegin(); var != locals.rend(); var++) {
+        Global::variables.Restore(*var);
+    }
+    Global::local_scopes.pop_back();
+    Global::function_depth--;
+    Global::loop_depth = loop_depth;
+    swap(Global::argv, argv);
+    Global::argc = argc;
+}
+
+void Execute(const ArgList&cmd_token, const RedirectPlan *plan) {
+
+    /* 函数优先于内建命令，调用期间持有函数，函数体中重新定义同名函数也不影响正在执行的语法树 */
+    if (!Global::functions.empty()) {
+        auto found = Global::functions.find(string_view(*cmd_token.begin()));
+        if (found != Global::functions.end()) {
+            shared_ptr<ShellFunction> function = found->second;
+            try {
+                CallFunction(*function, cmd_token);
+            }
+            catch (const char *s) {
+                fprintf(stderr, RED "%s", s);
+                Global::last_status = 1;
+            }
+            Global::pipe_status.assign(1, Global::last_status);
+            return;
         }
     }
-    else if (*cmd_token.begin() == "jobs") {
+
+    /* 内建命令查表直接执行 */
+    const Builtin *builtin = FindBuiltin(*cmd_token.begin());
+    if (builtin != nullptr) {
+        Global::builtin_status = 0;
         try {
-            jobs(cmd_token);
+            builtin->handler(cmd_token);
         }
         catch (const char *s) {
             fprintf(stderr, RED "%s", s);
+            Global::builtin_status = 1;
         }
+        Global::last_status = Global::builtin_status;
+        Global::pipe_status.assign(1, Global::last_status);
     }
     else {
-        vector<string> modified_cmd(cmd_token);
-        modified_cmd.insert(modified_cmd.begin(), "exec");
-        if (!Global::is_backend) {
-            Global::sub_pid = fork();
-            if (Global::sub_pid == 0) {
-                setenv("PARENT", Global::shell_path.c_str(), 1);
-                try {
-                    exec(modified_cmd);
-                    exit(0);
+        if (!Global::exec_in_place) {
+            // 外部指令使用 posix_spawn 启动，交互执行的前台指令单独成为一个进程组，父进程阻塞等待子进程完成
+            pid_t pgid = (Global::is_interactive && !Global::is_backend) ? 0 : INVALID_PID;
+            posix_spawn_file_actions_t actions;
+            posix_spawn_file_actions_init(&actions);
+            vector<int> temp_fds;
+            try {
+                if (plan != nullptr) {
+                    AddRedirectActions(*plan, &actions, temp_fds);
                 }
-                catch (const char *s) {
-                    fprintf(stderr, RED "%s", s);
+                pid_t pid = SpawnCommand(cmd_token, &actions, pgid);
+                for (auto &fd: temp_fds) {
+                    close(fd);
+                }
+                temp_fds.clear();
+                if (pgid == 0) {
+                    pgid = pid;
+                    setpgid(pid, pgid);
                 }
+                WaitForeground({pid}, pgid);
             }
-                // 父进程等待子进程完成
-            else {
-                while (Global::sub_pid != INVALID_PID && !waitpid(Global::sub_pid, nullptr, WNOHANG));
-                Global::sub_pid = INVALID_PID;
+            catch (const char *s) {
+                fprintf(stderr, RED "%s", s);
+                Global::pipe_status.assign(1, Global::last_status);
+            }
+            for (auto &fd: temp_fds) {
+                close(fd);
             }
+            posix_spawn_file_actions_destroy(&actions);
         }
         else {
-            setenv("PARENT", Global::shell_path.c_str(), 1);
+            ArgList modified_cmd(&Global::line_arena);
+            modified_cmd.reserve(cmd_token.size() + 1);
+            modified_cmd.emplace_back("exec");
+            modified_cmd.insert(modified_cmd.end(), cmd_token.begin(), cmd_token.end());
             try {
                 exec(modified_cmd);
             }
@@ -816,26 +7042,28 @@ void Execute(const vector<string>&cmd_token) {
 
 /* ---------- 内建命令实现 ---------- */
 
-void cd(const vector<string>&cmd_token) {
+void cd(const ArgList&cmd_token) {
     // 没有显式的指明路径或者路径为"~"
     if (cmd_token.size() == 1 || (cmd_token.size() == 2 && cmd_token[1] == "~")) {
         chdir(Global::home_path.c_str());
         Global::pwd = Global::home_path;
-        setenv("PWD", Global::pwd.c_str(), 1); // 更新 pwd 环境变量
+        Global::variables.Assign("PWD", Global::pwd); // 更新 pwd 环境变量
+        RenderPrompt(); // 路径改变，重新生成提示符
     }
     else if (cmd_token.size() == 2) { // 直接调用chdir改变路径
         char buf[BUFFER_SIZE];
         // chdir 失败
         if (chdir(cmd_token[1].c_str())) {
             sprintf(buf, "cd: %s: no such file or directory\n", cmd_token[1].c_str());
-            char err[BUFFER_SIZE] = {0};
+            static char err[BUFFER_SIZE];
             strcpy(err, buf);
             throw err;
         }
         else {
             getcwd(buf, BUFFER_SIZE);
             Global::pwd = string(buf); // 更新 pwd
-            setenv("PWD", Global::pwd.c_str(), 1); // 更新 pwd 环境变量
+            Global::variables.Assign("PWD", Global::pwd); // 更新 pwd 环境变量
+            RenderPrompt(); // 路径改变，重新生成提示符
         }
     }
         // 参数过多
@@ -844,7 +7072,7 @@ void cd(const vector<string>&cmd_token) {
     }
 }
 
-void clear(const vector<string>&cmd_token) {
+void clear(const ArgList&cmd_token) {
     // 参数多于一个，报错
     if (cmd_token.size() > 1) {
         throw "clr: too many arguments\n";
@@ -855,15 +7083,17 @@ void clear(const vector<string>&cmd_token) {
     }
 }
 
-void echo(const vector<string>&cmd_token) {
+void echo(const ArgList&cmd_token) {
     // 解析给出的参数并输出
+    OutputBuffer out;
     for (int i = 1; i < cmd_token.size(); i++) {
-        fprintf(stdout, "%s ", Parse2Value(cmd_token[i]).c_str());
+        out.Append(cmd_token[i]);
+        out.Append(" ");
     }
-    fprintf(stdout, "%s", "\n");
+    out.Append("\n");
 }
 
-void pwd(const vector<string>&cmd_token) {
+void pwd(const ArgList&cmd_token) {
     // 参数多于一个，报错
     if (cmd_token.size() > 1) {
         throw "pwd: too many arguments\n";
@@ -874,12 +7104,27 @@ void pwd(const vector<string>&cmd_token) {
     }
 }
 
-void exit(const vector<string>&cmd_token) {
-    // 直接退出
-    exit(0);
+void exit(const ArgList&cmd_token) {
+    if (cmd_token.size() > 2) {
+        throw "exit: too many arguments\n";
+    }
+    // 退出状态默认为最近一条指令的退出状态
+    int status = Global::last_status;
+    if (cmd_token.size() == 2) {
+        const pmr::string &arg = cmd_token[1];
+        long n;
+        auto result = from_chars(arg.data() + (arg[0] == '+'), arg.data() + arg.size(), n);
+        if (arg.empty() || result.ec != errc() || result.ptr != arg.data() + arg.size()) {
+            static char err[BUFFER_SIZE];
+            snprintf(err, sizeof(err), "exit: %s: numeric argument required\n", arg.c_str());
+            throw (const char *) err;
+        }
+        status = (int) (n & 0xFF);
+    }
+    exit(status);
 }
 
-void time(const vector<string>&cmd_token) {
+void time(const ArgList&cmd_token) {
     // 参数多于一个，报错
     if (cmd_token.size() > 1) {
         throw "time: too many arguments\n";
@@ -899,7 +7144,7 @@ void time(const vector<string>&cmd_token) {
     }
 }
 
-void umask(const vector<string>&cmd_token) {
+void umask(const ArgList&cmd_token) {
     // 没有输入参数，显示 umask 的值
     if (cmd_token.size() == 1) {
         mode_t cur_mask = umask(0);
@@ -913,7 +7158,7 @@ void umask(const vector<string>&cmd_token) {
             throw "umask: octal number out of range\n";
         }
         else {
-            string octal = cmd_token[1]; // 8进制数
+            string octal(cmd_token[1]); // 8进制数
             // 对齐到四位
             while (octal.length() < 4) {
                 octal = "0" + octal;
@@ -938,51 +7183,133 @@ void umask(const vector<string>&cmd_token) {
     }
 }
 
-void dir(const vector<string>&cmd_token) {
-    DIR *dir; // DIR 类型指针
-    char buf[BUFFER_SIZE]{0};
+void dir(const ArgList&cmd_token) {
+    DirOptions options;
+    vector<string> paths;
+    bool end_of_options = false;
+    bool one_per_line = false; // -1: 终端上也每行一个
+
+    // 递归遍历默认每个 CPU 一个线程
+    options.threads = max(1u, min(64u, thread::hardware_concurrency()));
+
+    // 解析选项，选项可以合并如 -lR，带参数的选项如 -d 2 或 -d2，"--" 之后都是路径
+    for (size_t i = 1; i < cmd_token.size(); i++) {
+        const pmr::string &arg = cmd_token[i];
+        if (end_of_options || arg.size() < 2 || arg[0] != '-') {
+            paths.emplace_back(arg);
+            continue;
+        }
+        if (arg == "--") {
+            end_of_options = true;
+            continue;
+        }
+        for (size_t j = 1; j < arg.size(); j++) {
+            // 带参数的选项，参数为本单词的剩余部分或下一个单词
+            if (arg[j] == 'd' || arg[j] == 'g' || arg[j] == 'j') {
+                char option = arg[j];
+                string value;
+                if (j + 1 < arg.size()) {
+                    value = arg.substr(j + 1);
+                }
+                else if (i + 1 < cmd_token.size()) {
+                    value = cmd_token[++i];
+                }
+                else {
+                    static char err[BUFFER_SIZE];
+                    sprintf(err, "dir: option requires an argument -- '%c'\n", option);
+                    throw err;
+                }
 
-    // 用户没有输入目录参数（默认列出当前目录内容）或只输入了一个参数
-    if (cmd_token.size() <= 2) {
+                if (option == 'g') {
+                    options.glob = value;
+                }
+                else {
+                    char *end;
+                    long number = strtol(value.c_str(), &end, 10);
+                    if (value.empty() || *end != '\0' || number < (option == 'd' ? 0 : 1) || number > INT_MAX) {
+                        static char err[2 * BUFFER_SIZE];
+                        snprintf(err, sizeof(err), "dir: %s: invalid number\n", value.c_str());
+                        throw err;
+                    }
+                    if (option == 'd') {
+                        options.max_depth = number;
+                    }
+                    else {
+                        options.threads = min(number, 64L);
+                    }
+                }
+                break;
+            }
 
-        if (cmd_token.size() == 1) {
-            getcwd(buf, BUFFER_SIZE); // 获取当前路径
-        }
-        else {
-            strcpy(buf, cmd_token[1].c_str()); // 获取输入的一个参数
+            switch (arg[j]) {
+                case 'l':
+                    options.long_format = true;
+                    break;
+                case 'R':
+                    options.recursive = true;
+                    break;
+                case 's':
+                    options.totals = true;
+                    break;
+                case 'S':
+                    options.sort = DirOptions::BY_SIZE;
+                    break;
+                case 't':
+                    options.sort = DirOptions::BY_TIME;
+                    break;
+                case 'U':
+                    options.sort = DirOptions::UNSORTED;
+                    break;
+                case 'r':
+                    options.reverse = true;
+                    break;
+                case '1':
+                    one_per_line = true;
+                    break;
+                default:
+                    static char err[BUFFER_SIZE];
+                    sprintf(err, "dir: invalid option -- '%c'\n", arg[j]);
+                    throw err;
+            }
         }
+    }
 
-        // 打开 buf 所指的目录，返回值保存到 dir 中
-        // 打开失败则报错
-        if (!(dir = opendir(buf))) {
-            char err[2 * BUFFER_SIZE]{0};
-            sprintf(err, "dir: cannot access \'%s\': no such file or directory\n", buf);
-            throw err;
+    // 输出到终端时着色并按终端宽度分列
+    if (isatty(STDOUT_FILENO)) {
+        options.color = true;
+        options.columns = !one_per_line;
+        winsize size{};
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) {
+            options.width = size.ws_col;
         }
+    }
 
-        FormatPrintDir(dir, buf); // 格式化输出目录内容
-        closedir(dir);
+    // 没有输入目录参数，默认列出当前目录内容
+    if (paths.empty()) {
+        paths.emplace_back(".");
     }
-        // 输入了多个目录
-    else {
-        for (int i = 1; i < cmd_token.size(); i++) {
-            strcpy(buf, cmd_token[i].c_str());
 
-            if (!(dir = opendir(buf))) {
-                char err[2 * BUFFER_SIZE]{0};
-                sprintf(err, "dir: cannot access \'%s\': no such file or directory\n", buf);
-                throw err;
-            }
+    // 所有目录的内容写入同一个缓冲，最后一次写出
+    OutputBuffer out;
+    for (size_t i = 0; i < paths.size(); i++) {
+        int dirfd = open(paths[i].c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        // 打开失败则报错，停止列出后面的目录
+        if (dirfd < 0) {
+            static char err[2 * BUFFER_SIZE];
+            snprintf(err, sizeof(err), "dir: cannot access \'%s\': no such file or directory\n", paths[i].c_str());
+            throw err;
+        }
 
-            fprintf(stdout, WHITE"%s: \n", buf); // 输出待列出的目录
-            FormatPrintDir(dir, buf);
-            fprintf(stdout, "\n");
-            closedir(dir);
+        // 有多个目录或递归列出时输出目录名
+        ListDirectory(out, options, dirfd, paths[i], paths.size() > 1 || options.recursive);
+        close(dirfd);
+        if (paths.size() > 1 && i + 1 < paths.size()) {
+            out.Append("\n");
         }
     }
 }
 
-void exec(const vector<string>&cmd_token) {
+void exec(const ArgList&cmd_token) {
     // 没有给出参数，报错
     if (cmd_token.size() == 1) {
         throw "exec: lack of parameter\n";
@@ -994,34 +7321,54 @@ void exec(const vector<string>&cmd_token) {
             args[i - 1] = const_cast<char *>(cmd_token[i].c_str());
         }
         args[cmd_token.size() - 1] = nullptr;
-        execvp(cmd_token[1].c_str(), args);
+
+        // 使用缓存的路径和变量表维护的环境变量表直接 execve，不再逐个尝试 PATH 中的目录
+        shared_ptr<const EnvSnapshot> env = Global::variables.Snapshot();
+        char *const *envp = env->envp.data();
+        string path = FindCommand(cmd_token[1]);
+        if (!path.empty()) {
+            execve(path.c_str(), args, envp);
+
+            // 缓存的路径已经失效，清除后重新搜索 PATH
+            if (errno == ENOENT && Global::command_hash.erase(string(cmd_token[1]))) {
+                path = FindCommand(cmd_token[1]);
+                if (!path.empty()) {
+                    execve(path.c_str(), args, envp);
+                }
+            }
+        }
 
         // execvp 执行成功后会退出源程序，如果执行到这里说明执行出错
         throw "exec: cannot find the command\n";
     }
 }
 
-void set(const vector<string>&cmd_token) {
-    // 没有输入变量，显示当前所有环境变量
+void set(const ArgList&cmd_token) {
+    // 没有输入变量，显示当前所有变量
     if (cmd_token.size() == 1) {
-        extern char **environ; // 环境变量表，系统预定义
-        for (int i = 0; environ[i] != nullptr; i++) {
-            fprintf(stdout, "%s\n", environ[i]);
+        OutputBuffer out;
+        for (auto &var: Global::variables.All()) {
+            if (var.flags & VAR_SET) {
+                AppendDeclaration(out, "", var);
+            }
         }
     }
-        // 正确输入变量名以及值
+        // -b: 后台作业结束时立即提示，+b: 在下一个提示符前提示
+    else if (cmd_token.size() == 2 && (cmd_token[1] == "-b" || cmd_token[1] == "+b")) {
+        Global::notify_now = cmd_token[1] == "-b";
+    }
+        // 正确输入变量名以及值，不存在的变量创建为环境变量
     else if (cmd_token.size() == 3) {
-        // 环境变量不存在
-        string var = Parse2Value(cmd_token[1]);
-        if (!getenv(var.c_str())) {
-            char err[BUFFER_SIZE]{0};
-            sprintf(err, "set: cannot access `%s`: no such environment variable\n", cmd_token[1].c_str());
-            throw err;
+        const pmr::string &var = cmd_token[1];
+        if (!IsIdentifier(var)) {
+            static char err[BUFFER_SIZE];
+            snprintf(err, sizeof(err), "set: `%s`: not a valid identifier\n", var.c_str());
+            throw (const char *) err;
         }
-        else {
-            // 设置环境变量的值
-            setenv(var.c_str(), Parse2Value(cmd_token[2]).c_str(), 1);
+        if (Global::variables.Find(var) == nullptr) {
+            Global::variables.SetFlags(var, VAR_EXPORT, true);
         }
+        Global::variables.Assign(var, cmd_token[2]);
     }
         // 参数数量不正确
     else {
@@ -1029,387 +7376,740 @@ void set(const vector<string>&cmd_token) {
     }
 }
 
-void test(const vector<string>&cmd_token) {
-    if (cmd_token.size() <= 2) {
-        throw "test: lack of parameter\n";
+void export_var(const ArgList&cmd_token) {
+    size_t i = 1;
+    bool remove = false; // -n: 取消导出
+    for (; i < cmd_token.size() && cmd_token[i].size() > 1 && cmd_token[i][0] == '-'; i++) {
+        if (cmd_token[i] == "-n") {
+            remove = true;
+        }
+        else if (cmd_token[i] != "-p") {
+            static char err[BUFFER_SIZE];
+            snprintf(err, sizeof(err), "export: %s: invalid option\n", cmd_token[i].c_str());
+            throw (const char *) err;
+        }
     }
-        // 一元运算符
-    else if (cmd_token.size() == 3) {
-        const string &option = cmd_token[1]; // 选项
-        string val = Parse2Value(cmd_token[2]); // 文件名、字符串或是$开头的变量
 
-        // 文件是否存在
-        if (option == "-e") {
-            if (access(val.c_str(), F_OK) == 0) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
-        }
-            // 文件存在且是否可读
-        else if (option == "-r") {
-            if (access(val.c_str(), R_OK) == 0) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
+    // 没有变量名，列出所有导出的变量
+    if (i == cmd_token.size()) {
+        OutputBuffer out;
+        for (auto &var: Global::variables.All()) {
+            if ((var.flags & VAR_SET) && (var.flags & VAR_EXPORT)) {
+                AppendDeclaration(out, "export ", var);
             }
         }
-            // 文件存在且是否可写
-        else if (option == "-w") {
-            if (access(val.c_str(), W_OK) == 0) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
+        return;
+    }
+
+    // NAME 或 NAME=value，有非法名字时继续处理其余的名字，最后报错
+    static char err[BUFFER_SIZE];
+    err[0] = '\0';
+    for (; i < cmd_token.size(); i++) {
+        const pmr::string &arg = cmd_token[i];
+        size_t equal = arg.find('=');
+        string_view name = string_view(arg).substr(0, equal);
+        if (!IsIdentifier(name)) {
+            snprintf(err, sizeof(err), "export: `%s`: not a valid identifier\n", arg.c_str());
+            continue;
         }
-            // 文件存在且是否可执行
-        else if (option == "-x") {
-            if (access(val.c_str(), X_OK) == 0) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
+        Global::variables.SetFlags(name, VAR_EXPORT, !remove);
+        if (equal != string::npos) {
+            Global::variables.Assign(name, string_view(arg).substr(equal + 1));
         }
-            // 文件存在且不为空
-        else if (option == "-s") {
-            struct stat file_info{};
-            stat(val.c_str(), &file_info);
-            if (file_info.st_size) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
+    }
+    if (err[0] != '\0') {
+        throw (const char *) err;
+    }
+}
+
+void unset(const ArgList&cmd_token) {
+    static char err[BUFFER_SIZE];
+    err[0] = '\0';
+    // -v 表示变量，-f 表示函数，之后的参数都按此类型删除
+    bool function = false;
+    for (size_t i = 1; i < cmd_token.size(); i++) {
+        if (cmd_token[i] == "-v" || cmd_token[i] == "-f") {
+            function = (cmd_token[i] == "-f");
+            continue;
         }
-            // 文件存在且为目录
-        else if (option == "-d") {
-            struct stat file_info{};
-            stat(val.c_str(), &file_info);
-            if (S_ISDIR(file_info.st_mode)) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
+        if (!IsIdentifier(cmd_token[i])) {
+            snprintf(err, sizeof(err), "unset: `%s`: not a valid identifier\n", cmd_token[i].c_str());
+            continue;
         }
-            // 文件存在且为普通文件
-        else if (option == "-f") {
-            struct stat file_info{};
-            stat(val.c_str(), &file_info);
-            if (S_ISREG(file_info.st_mode)) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
+        if (function) {
+            Global::functions.erase(cmd_token[i]);
         }
-            // 文件存在且为字符型特殊文件
-        else if (option == "-c") {
-            struct stat file_info{};
-            stat(val.c_str(), &file_info);
-            if (S_ISCHR(file_info.st_mode)) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
+        else {
+            Global::variables.Unset(cmd_token[i]);
         }
-            // 文件存在且为块特殊文件
-        else if (option == "-b") {
-            struct stat file_info{};
-            stat(val.c_str(), &file_info);
-            if (S_ISBLK(file_info.st_mode)) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
+    }
+    if (err[0] != '\0') {
+        throw (const char *) err;
+    }
+}
+
+void let(const ArgList&cmd_token) {
+    if (cmd_token.size() < 2) {
+        throw "let: expression expected\n";
+    }
+    long long result = 0;
+    for (size_t i = 1; i < cmd_token.size(); i++) {
+        result = EvaluateArithmetic(cmd_token[i]);
+    }
+    Global::builtin_status = (result == 0) ? 1 : 0;
+}
+
+void declare(const ArgList&cmd_token) {
+    unsigned set_flags = 0, clear_flags = 0;
+    bool print = false; // -p: 显示变量的声明
+    size_t i = 1;
+
+    // 选项：-a 数组，-i 整数，-x 导出，"+"开头表示清除属性
+    for (; i < cmd_token.size() && cmd_token[i].size() > 1 && (cmd_token[i][0] == '-' || cmd_token[i][0] == '+'); i++) {
+        const pmr::string &arg = cmd_token[i];
+        for (size_t j = 1; j < arg.size(); j++) {
+            unsigned flag;
+            switch (arg[j]) {
+                case 'a':
+                    flag = VAR_ARRAY;
+                    break;
+                case 'i':
+                    flag = VAR_INTEGER;
+                    break;
+                case 'x':
+                    flag = VAR_EXPORT;
+                    break;
+                case 'p':
+                    print = true;
+                    continue;
+                default:
+                    static char err[BUFFER_SIZE];
+                    snprintf(err, sizeof(err), "declare: %c%c: invalid option\n", arg[0], arg[j]);
+                    throw (const char *) err;
             }
+            (arg[0] == '-' ? set_flags : clear_flags) |= flag;
         }
-            // 文件存在且为符号链接
-        else if (option == "-h" || option == "-L") {
-            struct stat file_info{};
-            stat(val.c_str(), &file_info);
-            if (S_ISLNK(file_info.st_mode)) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
+    }
+
+    // 变量声明的前缀，如 declare -ax
+    auto prefix = [](const Variable &var) {
+        string text = "declare -";
+        text += (var.flags & VAR_ARRAY) ? "a" : "";
+        text += (var.flags & VAR_INTEGER) ? "i" : "";
+        text += (var.flags & VAR_EXPORT) ? "x" : "";
+        text += (text.back() == '-') ? "- " : " ";
+        return text;
+    };
+
+    // 没有变量名，列出具有指定属性的变量
+    if (i == cmd_token.size()) {
+        OutputBuffer out;
+        for (auto &var: Global::variables.All()) {
+            if ((var.flags & VAR_SET) && (var.flags & set_flags) == set_flags) {
+                AppendDeclaration(out, prefix(var), var);
             }
         }
-            // 文件存在且为命名管道
-        else if (option == "-p") {
-            struct stat file_info{};
-            stat(val.c_str(), &file_info);
-            if (S_ISFIFO(file_info.st_mode)) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
+        return;
+    }
+
+    static char err[BUFFER_SIZE];
+    err[0] = '\0';
+    OutputBuffer out;
+    for (; i < cmd_token.size(); i++) {
+        const pmr::string &arg = cmd_token[i];
+        size_t equal = arg.find('=');
+        string_view name = string_view(arg).substr(0, equal);
+        if (!IsIdentifier(name)) {
+            snprintf(err, sizeof(err), "declare: `%s`: not a valid identifier\n", arg.c_str());
+            continue;
         }
-            // 文件存在且为嵌套字
-        else if (option == "-S") {
-            struct stat file_info{};
-            stat(val.c_str(), &file_info);
-            if (S_ISSOCK(file_info.st_mode)) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
+
+        // -p NAME：只显示
+        if (print) {
+            const Variable *var = Global::variables.Find(name);
+            if (var == nullptr) {
+                snprintf(err, sizeof(err), "declare: %s: not found\n", arg.c_str());
+                continue;
             }
+            AppendDeclaration(out, prefix(*var), *var);
+            continue;
         }
-            // 字符串长度不为0
-        else if (option == "-n") {
-            if (!val.empty()) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
+
+        // 先设置属性，整数变量的值按整数求值
+        Global::variables.SetFlags(name, set_flags, true);
+        Global::variables.SetFlags(name, clear_flags, false);
+        if (equal == string::npos) {
+            continue;
         }
-            // 字符串长度为0
-        else if (option == "-z") {
-            if (val.empty()) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
+        string_view value = string_view(arg).substr(equal + 1);
+        // NAME=(a b c) 按数组赋值
+        if (value.size() >= 2 && value.front() == '(' && value.back() == ')') {
+            ApplyAssignment(arg);
         }
         else {
-            // 不支持的选项报错
-            char err[BUFFER_SIZE]{0};
-            sprintf(err, "test: %s: invalid option\n", option.c_str());
-            throw (const char *) err;
+            Global::variables.Assign(name, value);
         }
     }
-        // 二元运算符
-    else if (cmd_token.size() == 4) {
-        const string &option = cmd_token[2];
-        string val1 = Parse2Value(cmd_token[1]), val2 = Parse2Value(cmd_token[3]);
+    if (err[0] != '\0') {
+        throw (const char *) err;
+    }
+}
 
-        // 字符串相等
-        if (option == "=") {
-            if (val1 == val2) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
+void test(const ArgList&cmd_token) {
+    size_t end = cmd_token.size();
+    // [ 以 ] 结束
+    if (*cmd_token.begin() == "[") {
+        if (end < 2 || cmd_token[end - 1] != "]") {
+            throw "[: missing `]'\n";
         }
-            // 字符串不等
-        else if (option == "!=") {
-            if (val1 != val2) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
+        end--;
+    }
+    Global::builtin_status = TestExpression(cmd_token, 1, end).Evaluate() ? 0 : 1;
+}
+
+void boolean(const ArgList&cmd_token) {
+    // true 和 : 的退出状态为 0
+    if (*cmd_token.begin() == "false") {
+        Global::builtin_status = 1;
+    }
+}
+
+void local(const ArgList&cmd_token) {
+    if (Global::function_depth == 0) {
+        throw "local: can only be used in a function\n";
+    }
+    vector<Variable> &locals = *Global::local_scopes.rbegin();
+    static char err[BUFFER_SIZE];
+    err[0] = '\0';
+    for (size_t i = 1; i < cmd_token.size(); i++) {
+        string_view arg = cmd_token[i];
+        size_t eq = arg.find('=');
+        string_view name = arg.substr(0, eq);
+        if (!IsIdentifier(name)) {
+            snprintf(err, sizeof(err), "local: `%s`: not a valid identifier\n", cmd_token[i].c_str());
+            continue;
         }
-            // 整数相等
-        else if (option == "-eq") {
-            if (strtol(val1.c_str(), nullptr, 10) == strtol(val2.c_str(), nullptr, 10)) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
+
+        // 同一函数中只在第一次声明时保存原来的变量，返回时恢复
+        bool saved = false;
+        for (const Variable &var : locals) {
+            if (var.name == name) {
+                saved = true;
+                break;
             }
         }
-            // 整数大于等于
-        else if (option == "-ge") {
-            if (strtol(val1.c_str(), nullptr, 10) >= strtol(val2.c_str(), nullptr, 10)) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
+        if (!saved) {
+            locals.push_back(Global::variables.Intern(name));
+            Global::variables.Unset(name);
         }
-            // 整数大于
-        else if (option == "-gt") {
-            if (strtol(val1.c_str(), nullptr, 10) > strtol(val2.c_str(), nullptr, 10)) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
+        if (eq != string_view::npos) {
+            Global::variables.Assign(name, arg.substr(eq + 1));
         }
-            // 整数小于等于
-        else if (option == "-le") {
-            if (strtol(val1.c_str(), nullptr, 10) <= strtol(val2.c_str(), nullptr, 10)) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
+    }
+    if (err[0] != '\0') {
+        throw (const char *) err;
+    }
+}
+
+void return_func(const ArgList&cmd_token) {
+    if (Global::function_depth == 0) {
+        throw "return: can only `return' from a function\n";
+    }
+    if (cmd_token.size() > 2) {
+        throw "return: too many arguments\n";
+    }
+    int status = Global::last_status;
+    if (cmd_token.size() == 2) {
+        const pmr::string &arg = cmd_token[1];
+        long n;
+        auto result = from_chars(arg.data() + (arg[0] == '+'), arg.data() + arg.size(), n);
+        if (arg.empty() || result.ec != errc() || result.ptr != arg.data() + arg.size()) {
+            static char err[BUFFER_SIZE];
+            snprintf(err, sizeof(err), "return: %s: numeric argument required\n", arg.c_str());
+            throw (const char *) err;
         }
-            // 整数小于
-        else if (option == "-lt") {
-            if (strtol(val1.c_str(), nullptr, 10) < strtol(val2.c_str(), nullptr, 10)) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
+        status = (int) (n & 0xFF);
+    }
+    Global::builtin_status = status;
+    Global::control = FLOW_RETURN;
+}
+
+void loop_control(const ArgList&cmd_token) {
+    static char err[BUFFER_SIZE];
+    const char *name = cmd_token.begin()->c_str();
+    if (Global::loop_depth == 0) {
+        snprintf(err, sizeof(err), "%s: only meaningful in a `for', `while', or `until' loop\n", name);
+        throw (const char *) err;
+    }
+    if (cmd_token.size() > 2) {
+        snprintf(err, sizeof(err), "%s: too many arguments\n", name);
+        throw (const char *) err;
+    }
+    // 跳出 n 层循环，超过嵌套层数时跳出全部
+    unsigned long n = 1;
+    if (cmd_token.size() == 2) {
+        const pmr::string &arg = cmd_token[1];
+        auto result = from_chars(arg.data(), arg.data() + arg.size(), n);
+        if (result.ec != errc() || result.ptr != arg.data() + arg.size() || n == 0) {
+            snprintf(err, sizeof(err), "%s: %s: loop count out of range\n", name, arg.c_str());
+            throw (const char *) err;
         }
-            // 整数不等于
-        else if (option == "-ne") {
-            if (strtol(val1.c_str(), nullptr, 10) != strtol(val2.c_str(), nullptr, 10)) {
-                fprintf(stdout, "true\n");
-            }
-            else {
-                fprintf(stdout, "false\n");
-            }
+    }
+    Global::control = (*cmd_token.begin() == "break") ? FLOW_BREAK : FLOW_CONTINUE;
+    Global::control_count = (unsigned) min<unsigned long>(n, Global::loop_depth);
+}
+
+void help(const ArgList&cmd_token) {
+
+    // 只有内建命令有帮助手册
+    if (cmd_token.size() == 2 && FindBuiltin(cmd_token[1]) == nullptr) {
+        static char err[BUFFER_SIZE];
+        sprintf(err, "help: no help topics match `%s`\n", cmd_token[1].c_str());
+        throw (const char *) err;
+    }
+
+    if (cmd_token.size() <= 2) {
+        if (!LoadManual()) {
+            throw "help: cannot access manual\n";
         }
-        else {
-            // 不支持的选项报错
-            char err[BUFFER_SIZE]{0};
-            sprintf(err, "test: %s: invalid option\n", option.c_str());
+
+        // 没有参数，显示全局帮助手册
+        // 有参数，显示对应指令的帮助手册
+        string_view target = (cmd_token.size() == 1) ? string_view("manual") : string_view(cmd_token[1]);
+        auto item = Global::manual_index.find(target);
+        if (item == Global::manual_index.end()) {
+            static char err[BUFFER_SIZE];
+            snprintf(err, sizeof(err), "help: no help topics match `%s`\n", string(target).c_str());
             throw (const char *) err;
         }
+
+        // 帮助内容直接引用映射的手册，一次写出
+        OutputBuffer out;
+        out.AppendRef(WHITE);
+        out.AppendRef(item->second);
     }
         // 参数过多
     else {
-        throw "test: too many arguments\n";
+        throw "help: too many arguments\n";
     }
 }
 
-void help(const vector<string>&cmd_token) {
+void history(const ArgList&cmd_token) {
+    size_t size = Global::history.Size();
+    OutputBuffer out;
+    char number[32];
 
-    if (cmd_token.size() <= 2) {
-        fstream fp(Global::manual_path); // 初始化
+    // -s: 搜索包含指定内容的记录，没有时退出状态为 1
+    if (cmd_token.size() >= 2 && cmd_token[1] == "-s") {
+        if (cmd_token.size() != 3) {
+            throw "history: usage: history -s text\n";
+        }
+        size_t n = Global::history.Search(cmd_token[2], size + 1);
+        Global::builtin_status = (n == 0) ? 1 : 0;
+        for (; n != 0; n = Global::history.Search(cmd_token[2], n)) {
+            out.Append(string_view(number, snprintf(number, sizeof(number), "%5zu  ", n)));
+            out.AppendRef(Global::history.Entry(n));
+            out.AppendRef("\n");
+        }
+        return;
+    }
+    if (cmd_token.size() > 2) {
+        throw "history: too many arguments\n";
+    }
 
-        if (!fp.is_open()) {
-            throw "help: cannot access manual\n";
+    // 有参数时只显示最近的 count 条
+    size_t count = size;
+    if (cmd_token.size() == 2) {
+        char *end;
+        count = strtoull(cmd_token[1].c_str(), &end, 10);
+        if (cmd_token[1].empty() || *end != '\0') {
+            static char err[BUFFER_SIZE];
+            snprintf(err, sizeof(err), "history: %s: numeric argument required\n", cmd_token[1].c_str());
+            throw (const char *) err;
         }
-        else {
-            // 没有参数，显示全局帮助手册
-            // 有参数，显示对应指令的帮助手册
-            string item, line, target;
-            // 寻找的命令名字
-            target = (cmd_token.size() == 1) ? "* manual *" : cmd_token[1];
-            while (!fp.eof()) {
-                getline(fp, line);
-                if (!item.empty()) {
-                    // 指令帮助内容已经打印完
-                    if (*line.begin() == '*') {
-                        break;
-                    }
-                        // 打印内容
-                    else {
-                        fprintf(stdout, WHITE"%s\n", line.c_str());
-                    }
-                }
-                // 找到对应的命令帮助手册
-                if (*line.begin() == '*' && line.find(target) != string::npos) {
-                    item = line;
-                    fprintf(stdout, WHITE"%s\n", item.c_str());
-                }
+        count = min(count, size);
+    }
+    for (size_t n = size - count + 1; n <= size; n++) {
+        out.Append(string_view(number, snprintf(number, sizeof(number), "%5zu  ", n)));
+        out.AppendRef(Global::history.Entry(n));
+        out.AppendRef("\n");
+    }
+}
+
+void bg(const ArgList&cmd_token) {
+    // 参数过多
+    if (cmd_token.size() > 2) {
+        throw "bg: too many arguments\n";
+    }
+
+    Global::Job &job = FindJob(cmd_token, 1, "bg");
+    // 已经是后台作业
+    if (job.state != Global::SUSPEND) {
+        static char err[BUFFER_SIZE];
+        sprintf(err, "bg: job %d already in background\n", job.id);
+        throw (const char *) err;
+    }
+
+    // 改变作业的状态为 BACKEND，向作业发送 SIGCONT 信号，使其继续运行
+    job.state = Global::BACKEND;
+    SignalJob(job, SIGCONT);
+    fprintf(stdout, WHITE"%s", FormatJobMsg(job).c_str());
+}
+
+void fg(const ArgList&cmd_token) {
+    // 参数过多
+    if (cmd_token.size() > 2) {
+        throw "fg: too many arguments\n";
+    }
+
+    Global::Job &job = FindJob(cmd_token, 1, "fg");
+    // 已经结束，等待下一次提示
+    if (job.state == Global::DONE) {
+        static char err[BUFFER_SIZE];
+        sprintf(err, "fg: job %d has terminated\n", job.id);
+        throw (const char *) err;
+    }
+
+    // 只等待尚未结束的进程，再次挂起时以原指令加入作业表
+    vector<pid_t> pids;
+    for (size_t i = 0; i < job.pids.size(); i++) {
+        if (job.status[i] == -1) {
+            pids.push_back(job.pids[i]);
+        }
+    }
+    pid_t pgid = job.pgid;
+    Global::job_command = job.command;
+    fprintf(stdout, WHITE"%s\n", job.command.c_str());
+
+    // 交互执行时先把终端交给作业所在的进程组，再唤醒作业，避免作业读终端时被挂起
+    if (Global::is_interactive && pgid != INVALID_PID) {
+        tcsetpgrp(STDIN_FILENO, pgid);
+    }
+    SignalJob(job, SIGCONT);
+    RemoveJob(job.id);
+
+    // 阻塞主进程，等待作业完成或再次挂起
+    Global::builtin_status = WaitForeground(pids, pgid);
+}
+
+void jobs(const ArgList&cmd_token) {
+    // 按作业号顺序输出作业表
+    if (cmd_token.size() == 1) {
+        OutputBuffer out;
+        for (auto &job: Global::job_slots) {
+            if (job.id != 0) {
+                out.Append(FormatJobMsg(job));
             }
         }
-        fp.close();
     }
-        // 参数过多
     else {
-        throw "help: too many arguments\n";
+        throw "jobs: too many arguments\n";
     }
 }
 
-void bg(const vector<string>&cmd_token) {
-    // 没有给出参数，输出后台作业表的所有信息
-    if (cmd_token.size() == 1) {
-        // 没有后台进程
-        if (Global::jobs.empty()) {
-            throw "bg: current: no such job\n";
+void parallel(const ArgList&cmd_token) {
+    static char err[BUFFER_SIZE];
+
+    // 并发数默认为在线 CPU 数，-j N 或 -jN 指定
+    long limit = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t first = 1;
+    if (cmd_token.size() > 1 && cmd_token[1].compare(0, 2, "-j") == 0) {
+        const char *arg = cmd_token[1].c_str() + 2;
+        first = 2;
+        if (*arg == '\0') {
+            if (cmd_token.size() == 2) {
+                throw "parallel: -j: lack of parameter\n";
+            }
+            arg = cmd_token[2].c_str();
+            first = 3;
         }
-            // 提示目前后台进程的数量
-        else {
-            char msg[BUFFER_SIZE]{0};
-            sprintf(msg, "bg: job %lu already in background\n", Global::jobs.size());
-            fprintf(stdout, WHITE"%s", msg);
+        char *end;
+        limit = strtol(arg, &end, 10);
+        if (*end != '\0' || limit <= 0) {
+            snprintf(err, BUFFER_SIZE, "parallel: %s: invalid number\n", arg);
+            throw (const char *) err;
         }
     }
+    limit = max(limit, 1L);
 
-    else if (cmd_token.size() == 2) {
-        auto id = strtol(cmd_token[1].c_str(), nullptr, 10);
-        // 没有找到该作业号
-        if (Global::jobs.find(id) == Global::jobs.end()) {
-            char err[BUFFER_SIZE]{0};
-            sprintf(err, "bg: %ld: no such job\n", id);
-            throw err;
+    // 待执行的指令：每个参数是一条指令，没有参数时从标准输入逐行读入
+    vector<string> commands;
+    if (first < cmd_token.size()) {
+        for (size_t i = first; i < cmd_token.size(); i++) {
+            commands.emplace_back(cmd_token[i]);
         }
-        // 已经是后台进程
-        else if (Global::state[id] == Global::BACKEND) {
-            char err[BUFFER_SIZE]{0};
-            sprintf(err, "bg: %ld: already at backend\n", id);
-            throw err;
+    }
+    else {
+        LineReader reader;
+        string line;
+        while (reader.ReadLine(line)) {
+            if (!line.empty()) {
+                commands.push_back(line);
+            }
         }
-        else {
-            // 改变该进程的状态为 BACKEND
-            Global::state.insert(pair<pid_t, Global::JobStatus>(id, Global::BACKEND));
-            // 向该进程发送SIGCONT信号，使其继续运行
-            kill(id, SIGCONT);
+    }
+
+    // 屏蔽 SIGCHLD 后再检查作业状态，sigsuspend 原子地解除屏蔽并睡眠
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+    Global::waiting_jobs = 1;
+    Global::wait_interrupted = 0;
+
+    vector<int> running; // 正在运行的作业号
+    size_t next = 0; // 下一条待启动的指令
+    unsigned failed = 0; // 退出状态不为 0 的指令数
+    while (true) {
+        // 启动新的指令，直到达到并发数上限或作业表已满
+        while (next < commands.size() && running.size() < (size_t) limit && !Global::wait_interrupted &&
+               Global::job_count < Global::max_jobs) {
+            fflush(stdout); // 避免缓冲区中的内容被子进程重复输出
+            pid_t pid = fork();
+            if (pid < 0) {
+                break;
+            }
+            if (pid == 0) {
+                // 子进程与 MyShell 同组，Ctrl+C 直接终止，不响应 Ctrl+Z
+                sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+                signal(SIGINT, SIG_DFL);
+                signal(SIGTSTP, SIG_IGN);
+                Global::waiting_jobs = 0;
+                Global::is_backend = true;
+                try {
+                    pmr::vector<Token> tokens = Tokenize(commands[next]);
+                    ListNode list = Parser(tokens).ParseList();
+                    // 单条指令直接 exec
+                    Global::exec_in_place = list.items.size() == 1 && !list.items.begin()->background &&
+                                            list.items.begin()->pipelines.size() == 1;
+                    EvaluationOfList(list);
+                }
+                catch (const char *s) {
+                    fprintf(stderr, RED "%s", s);
+                }
+                fflush(stdout);
+                exit(Global::last_status);
+            }
+            running.push_back(AddJob({pid}, INVALID_PID, Global::BACKEND, commands[next]));
+            next++;
+        }
+        if (running.empty()) {
+            break;
+        }
+
+        // 回收已结束的作业，没有作业结束时睡眠等待
+        ProcessReaped();
+        bool reaped = false;
+        for (size_t i = 0; i < running.size();) {
+            Global::Job &job = Global::job_slots[running[i] - 1];
+            if (job.state != Global::DONE) {
+                i++;
+                continue;
+            }
+            if (ExitStatus(*job.status.begin()) != 0) {
+                failed++;
+            }
+            // 作业由 parallel 自己回收，不再提示 Done
+            Global::finished_jobs.erase(remove(Global::finished_jobs.begin(), Global::finished_jobs.end(), job.id),
+                                        Global::finished_jobs.end());
+            RemoveJob(job.id);
+            running[i] = *running.rbegin();
+            running.pop_back();
+            reaped = true;
+        }
+        if (!reaped) {
+            sigsuspend(&old_mask);
         }
     }
-        // 参数过多
-    else {
-        throw "bg: too many arguments\n";
+
+    bool interrupted = Global::wait_interrupted;
+    Global::waiting_jobs = 0;
+    sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+
+    if (next < commands.size() && !interrupted) {
+        throw "parallel: job list is full\n";
     }
+    // 被中断时为 130，否则为失败的指令数，超过 100 条时为 101
+    Global::builtin_status = interrupted ? 128 + SIGINT : (int) min(failed, 101u);
 }
 
-void fg(const vector<string>&cmd_token) {
-    if (cmd_token.size() == 1) {
-        // 没有后台进程
-        if (Global::jobs.empty()) {
-            throw "fg: current: no such job\n";
+void wait(const ArgList&cmd_token) {
+    // -n: 任意一个作业结束即返回
+    bool any = cmd_token.size() > 1 && cmd_token[1] == "-n";
+    size_t first = any ? 2 : 1;
+
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+    ProcessReaped();
+
+    // 等待的作业：参数指定的作业，没有参数时为所有未挂起的作业
+    vector<int> targets;
+    vector<bool> is_target(Global::job_slots.size() + 1, false);
+    try {
+        for (size_t i = first; i < cmd_token.size(); i++) {
+            int id = FindJob(cmd_token, i, "wait").id;
+            if (!is_target[id]) {
+                targets.push_back(id);
+                is_target[id] = true;
+            }
         }
-        else {
-            throw "fg: lack of parameter\n";
+    }
+    catch (const char *s) {
+        sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+        throw;
+    }
+    if (first == cmd_token.size()) {
+        for (auto &job: Global::job_slots) {
+            if (job.id != 0 && job.state != Global::SUSPEND) {
+                targets.push_back(job.id);
+                is_target[job.id] = true;
+            }
         }
     }
+    if (targets.empty()) {
+        sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+        Global::builtin_status = any ? 127 : 0;
+        return;
+    }
 
-    else if (cmd_token.size() == 2) {
-        auto id = strtol(cmd_token[1].c_str(), nullptr, 10);
-        // 没有找到该作业号
-        if (Global::jobs.find(id) == Global::jobs.end()) {
-            char err[BUFFER_SIZE]{0};
-            sprintf(err, "fg: %ld: no such job\n", id);
-            throw err;
+    /* 每个进程一个 pidfd，由 epoll 同时等待，进程结束时 pidfd 可读，事件中带有作业号
+     * 整个等待期间屏蔽 SIGCHLD，子进程由 ProcessReaped 直接回收，唤醒次数只与结束的进程数有关
+     * 内核不支持 pidfd 时退回到 sigsuspend
+     */
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    bool use_epoll = epoll_fd >= 0;
+    vector<int> pidfds;
+    for (auto &id: targets) {
+        Global::Job &job = Global::job_slots[id - 1];
+        for (size_t i = 0; use_epoll && i < job.pids.size(); i++) {
+            if (job.status[i] != -1) {
+                continue;
+            }
+            int pidfd = (int) syscall(SYS_pidfd_open, job.pids[i], 0);
+            if (pidfd < 0) {
+                use_epoll = errno == ESRCH; // 进程已被回收，状态在回收队列中
+                continue;
+            }
+            pidfds.push_back(pidfd);
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.u64 = (uint64_t) id;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfd, &event);
         }
-        else {
-            // 更新当前指令和指令 token
-            Global::command = Global::sub_commands[id];
-            Global::command_tokens = SpiltCommand(Global::command);
+    }
 
-            // 更新作业表
-            Global::state.erase(id);
-            Global::sub_pid = id;
-            Global::jobs.erase(id);
+    // 作业结束时取得退出状态，从作业表中删除且不再提示 Done；-n 只取第一个结束的作业
+    vector<int> job_status(is_target.size(), 0);
+    int first_done = 0;
+    size_t pending = targets.size();
+    auto finish = [&](int id) {
+        Global::Job &job = Global::job_slots[id - 1];
+        if (!is_target[id] || job.id != id || job.state != Global::DONE || (any && first_done != 0)) {
+            return;
+        }
+        job_status[id] = ExitStatus(*job.status.rbegin());
+        first_done = (first_done == 0) ? id : first_done;
+        is_target[id] = false;
+        pending--;
+        Global::finished_jobs.erase(remove(Global::finished_jobs.begin(), Global::finished_jobs.end(), id),
+                                    Global::finished_jobs.end());
+        RemoveJob(id);
+    };
+    for (auto &id: targets) {
+        finish(id);
+    }
 
-            setpgid(Global::sub_pid, getpid()); // 设置进程组，使子进程进入前台进程组
-            kill(Global::sub_pid, SIGCONT);
+    Global::waiting_jobs = 1;
+    Global::wait_interrupted = 0;
+    epoll_event events[64];
+    while (pending > 0 && !(any && pending < targets.size()) && !Global::wait_interrupted) {
+        if (!use_epoll) {
+            sigsuspend(&old_mask);
+            ProcessReaped();
+            for (auto &id: targets) {
+                finish(id);
+            }
+            continue;
+        }
 
-            // 阻塞主进程，等待子进程完成
-            while (Global::sub_pid != -1 && !waitpid(Global::sub_pid, nullptr, 0));
-            Global::sub_pid = -1;
+        int n = epoll_wait(epoll_fd, events, 64, -1);
+        if (n < 0 && errno != EINTR) {
+            break;
         }
+        ProcessReaped();
+        for (int i = 0; i < n; i++) {
+            finish((int) events[i].data.u64);
+        }
+    }
+    Global::waiting_jobs = 0;
+    sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+
+    for (auto &pidfd: pidfds) {
+        close(pidfd);
+    }
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+
+    // 被 Ctrl+C 中断时为 130；-n 为结束的作业的退出状态，否则为最后一个参数指定的作业的退出状态，不带参数时为 0
+    if (Global::wait_interrupted) {
+        Global::builtin_status = 128 + SIGINT;
+    }
+    else if (any) {
+        Global::builtin_status = job_status[first_done];
     }
     else {
-        throw "fg: too many arguments\n";
+        Global::builtin_status = (first == cmd_token.size()) ? 0 : job_status[*targets.rbegin()];
     }
 }
 
-void jobs(const vector<string>&cmd_token) {
-    // 输出作业表
+void hash(const ArgList&cmd_token) {
+    // 没有参数，打印命令路径缓存
     if (cmd_token.size() == 1) {
-        for (auto &job: Global::jobs) {
-            fprintf(stdout, "%s", FormatJobMsg(job.first, false).c_str());
+        if (Global::command_hash.empty()) {
+            fprintf(stdout, WHITE"hash: hash table empty\n");
+            return;
+        }
+        fprintf(stdout, WHITE"hits\tcommand\n");
+        for (auto &entry: Global::command_hash) {
+            fprintf(stdout, "%4u\t%s\n", entry.second.hits, entry.second.path.c_str());
+        }
+    }
+        // -r: 清空缓存
+    else if (cmd_token[1] == "-r") {
+        if (cmd_token.size() > 2) {
+            throw "hash: too many arguments\n";
+        }
+        Global::command_hash.clear();
+    }
+        // -d: 删除指定指令的缓存
+    else if (cmd_token[1] == "-d") {
+        if (cmd_token.size() == 2) {
+            throw "hash: lack of parameter\n";
+        }
+        for (size_t i = 2; i < cmd_token.size(); i++) {
+            if (!Global::command_hash.erase(string(cmd_token[i]))) {
+                static char err[BUFFER_SIZE];
+                sprintf(err, "hash: %s: not found\n", cmd_token[i].c_str());
+                throw (const char *) err;
+            }
         }
     }
+        // 查找指令并加入缓存
     else {
-        throw "jobs: too many arguments\n";
+        for (size_t i = 1; i < cmd_token.size(); i++) {
+            if (cmd_token[i].find('/') != string::npos) {
+                continue;
+            }
+            Global::command_hash.erase(string(cmd_token[i])); // 重新查找，命中次数清零
+            if (FindCommand(cmd_token[i]).empty()) {
+                static char err[BUFFER_SIZE];
+                sprintf(err, "hash: %s: not found\n", cmd_token[i].c_str());
+                throw (const char *) err;
+            }
+            Global::command_hash[string(cmd_token[i])].hits = 0;
+        }
     }
-}
\ No newline at end of file
+}
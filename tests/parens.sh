@@ -0,0 +1,32 @@
+# "(" ")" 现在是元字符（数组赋值、函数定义、case 模式），以前不加引号的括号是单词的一部分
+# 用法：MyShell tests/parens.sh，全部通过时退出状态为 0，否则输出失败的项目
+# 前两项会在错误输出中打印预期的语法错误
+fail=0
+
+# 以前输出 "(hi)" 和 "a(b)c"，现在是语法错误，退出状态为 2
+echo (hi)
+[ $? -eq 2 ] || { echo "FAIL: echo (hi) should be a syntax error"; fail=1; }
+echo a(b)c
+[ $? -eq 2 ] || { echo "FAIL: echo a(b)c should be a syntax error"; fail=1; }
+
+# 加引号或转义后括号仍是单词的一部分
+[ \(x\) = '(x)' ] || { echo "FAIL: escaped parentheses"; fail=1; }
+[ a"(b)"c = 'a(b)c' ] || { echo "FAIL: double-quoted parentheses"; fail=1; }
+
+# 数组赋值不变
+a=(1 2)
+[ "${a[1]}" = 2 ] || { echo "FAIL: array assignment"; fail=1; }
+
+# 函数定义和带"("的 case 模式
+f() { return 3; }
+f
+[ $? -eq 3 ] || { echo "FAIL: function definition"; fail=1; }
+case x in (x) r=ok;; esac
+[ "$r" = ok ] || { echo "FAIL: case pattern"; fail=1; }
+
+# case 模式中引号内的通配符按字面匹配
+case abc in "a*") echo "FAIL: quoted case pattern"; fail=1;; esac
+case 'a*' in "a*") r=literal;; esac
+[ "$r" = literal ] || { echo "FAIL: quoted case pattern literal"; fail=1; }
+
+exit $fail